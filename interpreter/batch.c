@@ -0,0 +1,335 @@
+/*
+ * `iterinter --batch <list> [-j <workers>]` runs many bytecode files in one
+ * go. Every line of the list is `<file.bc> <input> <expected output>`, `-`
+ * in place of the input is an empty input and in place of the expected
+ * output means that the output is not checked. The output of `x.bc` is
+ * written to `x.log`.
+ *
+ * Programs are run by pre-forked workers, by default one per core. A worker
+ * keeps one instance of the interpreter and its heap from program to program:
+ * the next program replaces the bytecode and starts with fresh stacks and
+ * globals, objects of the previous one are garbage. Workers take the next
+ * program from a counter in shared memory, so a worker that is done early
+ * takes more of them. Results are kept in shared memory as well. If a worker
+ * dies (heap exhaustion, a signal), its program is reported as crashed and a
+ * new worker continues with the rest of the list.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lama-v1.20/runtime/runtime.h"
+#include "driver.h"
+#include "iterinter.h"
+
+#define JOB_MESSAGE_SIZE 256
+// the exit code of a worker that has no memory for its interpreter
+#define WORKER_NO_MEMORY 2
+
+typedef enum {
+    JOB_PENDING,
+    JOB_OK,
+    JOB_DIFFERS,
+    JOB_FAILED,
+    JOB_CRASHED
+} job_status;
+
+static const char* status_names[] = {"pending", "ok", "differs", "failed",
+                                     "crashed"};
+
+typedef struct {
+    char* file;
+    char* input;     // NULL is an empty input
+    char* expected;  // NULL if the output is not checked
+    char* log;
+} job;
+
+typedef struct {
+    job_status status;
+    double seconds;
+    char message[JOB_MESSAGE_SIZE];
+} job_result;
+
+// shared by the workers and the parent
+typedef struct {
+    int next_job;
+    job_result results[0];
+} batch_state;
+
+static job* jobs;
+static int jobs_count;
+static batch_state* state;
+// the job of every worker, -1 if it has none
+static int* running;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void* checked_malloc(size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
+        perror("ERROR: batch: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char* log_path(const char* file) {
+    size_t len = strlen(file);
+    if (len > 3 && strcmp(file + len - 3, ".bc") == 0) {
+        len -= 3;
+    }
+    char* log = checked_malloc(len + 5);
+    memcpy(log, file, len);
+    strcpy(log + len, ".log");
+    return log;
+}
+
+static void read_list(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror("ERROR: batch: unable to open the list\n");
+        exit(1);
+    }
+    int capacity = 0;
+    char *line = NULL, file[PATH_MAX], input[PATH_MAX], expected[PATH_MAX];
+    size_t line_size = 0;
+    for (int n = 1; getline(&line, &line_size, f) != -1; n++) {
+        int fields = sscanf(line, "%4095s %4095s %4095s", file, input, expected);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields != 3) {
+            fprintf(stderr, "ERROR: batch: %s:%d: three paths are expected\n",
+                    path, n);
+            exit(1);
+        }
+        if (jobs_count == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            jobs = realloc(jobs, capacity * sizeof(job));
+            if (jobs == NULL) {
+                perror("ERROR: batch: out of memory\n");
+                exit(1);
+            }
+        }
+        job* j = &jobs[jobs_count++];
+        j->file = strdup(file);
+        j->input = strcmp(input, "-") == 0 ? NULL : strdup(input);
+        j->expected = strcmp(expected, "-") == 0 ? NULL : strdup(expected);
+        j->log = log_path(file);
+    }
+    free(line);
+    fclose(f);
+}
+
+// opens `path` as the descriptor `fd`
+static int redirect(const char* path, int fd, int flags) {
+    int new_fd = open(path, flags, 0644);
+    if (new_fd < 0) {
+        return -1;
+    }
+    if (new_fd != fd) {
+        if (dup2(new_fd, fd) < 0) {
+            close(new_fd);
+            return -1;
+        }
+        close(new_fd);
+    }
+    return 0;
+}
+
+static bool same_contents(const char* a, const char* b) {
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    bool same = fa != NULL && fb != NULL;
+    while (same) {
+        int ca = getc(fa), cb = getc(fb);
+        same = ca == cb;
+        if (ca == EOF) {
+            break;
+        }
+    }
+    if (fa != NULL) {
+        fclose(fa);
+    }
+    if (fb != NULL) {
+        fclose(fb);
+    }
+    return same;
+}
+
+static void run_job(lama_vm* vm, const job* j, job_result* r) {
+    double start = now();
+    r->status = JOB_FAILED;
+    // the output of the previous program goes to its own log
+    fflush(stdout);
+    if (redirect(j->input != NULL ? j->input : "/dev/null", STDIN_FILENO,
+                 O_RDONLY) != 0 ||
+        redirect(j->log, STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+        snprintf(r->message, JOB_MESSAGE_SIZE, "%s\n", strerror(errno));
+    } else {
+        reset_input();
+        if (lama_vm_load_file(vm, j->file) != 0 || lama_vm_run(vm) != 0) {
+            snprintf(r->message, JOB_MESSAGE_SIZE, "%s", lama_vm_error(vm));
+        } else {
+            fflush(stdout);
+            bool same = j->expected == NULL || same_contents(j->log, j->expected);
+            r->status = same ? JOB_OK : JOB_DIFFERS;
+        }
+    }
+    r->seconds = now() - start;
+}
+
+static void worker(int w) {
+    lama_vm* vm = lama_vm_create();
+    if (vm == NULL) {
+        _exit(WORKER_NO_MEMORY);
+    }
+    for (;;) {
+        int i = __atomic_fetch_add(&state->next_job, 1, __ATOMIC_RELAXED);
+        if (i >= jobs_count) {
+            break;
+        }
+        running[w] = i;
+        run_job(vm, &jobs[i], &state->results[i]);
+        running[w] = -1;
+    }
+    // the heap and the exit handlers of the runtime are of no use any more
+    _exit(0);
+}
+
+static pid_t start_worker(int w) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ERROR: batch: unable to fork a worker\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        worker(w);
+    }
+    return pid;
+}
+
+static void crashed(job_result* r, int status) {
+    r->status = JOB_CRASHED;
+    if (WIFSIGNALED(status)) {
+        snprintf(r->message, JOB_MESSAGE_SIZE, "signal %d\n", WTERMSIG(status));
+    } else {
+        snprintf(r->message, JOB_MESSAGE_SIZE, "exit code %d\n",
+                 WEXITSTATUS(status));
+    }
+}
+
+static void report(double seconds) {
+    int counts[JOB_CRASHED + 1] = {0};
+    for (int i = 0; i < jobs_count; i++) {
+        job_result* r = &state->results[i];
+        counts[r->status]++;
+        printf("%-8s %9.3f  %s", status_names[r->status], r->seconds,
+               jobs[i].file);
+        if (r->message[0] != 0) {
+            printf(": %s", r->message[0] == '\n' ? r->message + 1 : r->message);
+            if (r->message[strlen(r->message) - 1] != '\n') {
+                printf("\n");
+            }
+        } else {
+            printf("\n");
+        }
+    }
+    printf("%d programs in %.3f s: %d ok, %d differ, %d failed, %d crashed\n",
+           jobs_count, seconds, counts[JOB_OK], counts[JOB_DIFFERS],
+           counts[JOB_FAILED], counts[JOB_CRASHED]);
+}
+
+int run_batch(int argc, char* argv[]) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 3 && strcmp(argv[1], "-j") == 0) {
+        workers = atoi(argv[2]);
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: iterinter --batch <list> [-j <workers>]\n");
+        return 1;
+    }
+    read_list(argv[0]);
+    if (jobs_count == 0) {
+        return 0;
+    }
+    workers = workers < 1 ? 1 : workers > jobs_count ? jobs_count : workers;
+
+    size_t size = sizeof(batch_state) + jobs_count * sizeof(job_result) +
+                  workers * sizeof(int);
+    state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                 -1, 0);
+    if (state == MAP_FAILED) {
+        perror("ERROR: batch: unable to map the shared state\n");
+        return 1;
+    }
+    running = (int*)&state->results[jobs_count];
+
+    double start = now();
+    pid_t* pids = checked_malloc(workers * sizeof(pid_t));
+    for (int w = 0; w < workers; w++) {
+        running[w] = -1;
+        pids[w] = start_worker(w);
+    }
+    for (int alive = workers; alive > 0;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int w = 0;
+        while (w < workers && pids[w] != pid) {
+            w++;
+        }
+        if (w == workers) {
+            continue;
+        }
+        alive--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_NO_MEMORY) {
+            fprintf(stderr, "ERROR: batch: a worker has no memory\n");
+            continue;
+        }
+        if (running[w] >= 0) {
+            crashed(&state->results[running[w]], status);
+            running[w] = -1;
+        }
+        // the worker may have died between taking a job and recording it,
+        // the rest of the list is run anyway
+        if (__atomic_load_n(&state->next_job, __ATOMIC_RELAXED) < jobs_count) {
+            pids[w] = start_worker(w);
+            alive++;
+        }
+    }
+    // the jobs taken by workers that died before recording them have no
+    // result, all workers are gone and none of them is about to record one
+    for (int i = 0; i < jobs_count; i++) {
+        if (state->results[i].status == JOB_PENDING) {
+            state->results[i].status = JOB_CRASHED;
+            snprintf(state->results[i].message, JOB_MESSAGE_SIZE,
+                     "the worker has died before running it\n");
+        }
+    }
+    report(now() - start);
+
+    for (int i = 0; i < jobs_count; i++) {
+        if (state->results[i].status != JOB_OK) {
+            return 1;
+        }
+    }
+    return 0;
+}
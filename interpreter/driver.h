@@ -0,0 +1,11 @@
+#ifndef __LAMA_DRIVER__
+#define __LAMA_DRIVER__
+
+// `iterinter --batch <list> [-j <workers>]`, the arguments follow `--batch`;
+// returns the exit code
+int run_batch(int argc, char* argv[]);
+
+// `iterinter --serve <file.bc> [-s <socket>] [-j <workers>] [-p]`, the same
+int run_server(int argc, char* argv[]);
+
+#endif
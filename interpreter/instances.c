@@ -0,0 +1,56 @@
+/*
+ * Test of two instances of the interpreter on one thread (see iterinter.h):
+ * while the first one is paused by `lama_vm_run_prefix` the second one is not
+ * loaded or run, and its destruction keeps the strings of the literals of the
+ * paused program. The results of the calls and the output of the programs go
+ * to stdout.
+ *
+ * Usage: instances <paused.bc> <other.bc> (`make test-instances`)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iterinter.h"
+
+static void report(const char* call, lama_vm* vm, int status) {
+    if (status == 0) {
+        printf("%s: ok\n", call);
+    } else {
+        printf("%s: %s", call, lama_vm_error(vm));
+    }
+    fflush(stdout);
+}
+
+static lama_vm* create(void) {
+    lama_vm* vm = lama_vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "instances: unable to allocate memory\n");
+        exit(1);
+    }
+    return vm;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <paused.bc> <other.bc>\n", argv[0]);
+        return 1;
+    }
+    lama_vm* paused = create();
+    lama_vm* other = create();
+    report("load paused", paused, lama_vm_load_file(paused, argv[1]));
+    report("prefix", paused, lama_vm_run_prefix(paused));
+    report("load other", other, lama_vm_load_file(other, argv[2]));
+    report("run other", other, lama_vm_run(other));
+    lama_vm_destroy(other);
+    report("resume", paused, lama_vm_run(paused));
+
+    // the paused instance is destroyed before it is resumed
+    other = create();
+    report("load other", other, lama_vm_load_file(other, argv[2]));
+    report("run other", other, lama_vm_run(other));
+    report("prefix", paused, lama_vm_run_prefix(paused));
+    lama_vm_destroy(paused);
+    report("run other", other, lama_vm_run(other));
+    lama_vm_destroy(other);
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Scaling benchmark of isolates: n threads run the given bytecode files, each
+ * thread on its own instance of the interpreter, for n = 1, 2, 4, ... up to the
+ * given number of threads. Every thread runs every file, so the work grows with
+ * n and the time stays the same if throughput scales linearly. The output of
+ * the programs goes to stdout, the report to stderr.
+ *
+ * Usage: isolates <max threads, 0 for the number of cores> <file.bc>...
+ * Needs the interpreter and the runtime built with LAMA_ISOLATES
+ * (`make isolates`).
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iterinter.h"
+
+static char** files;
+static int files_count;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// runs all files, returns the number of failed runs
+static void* run_files(void* arg) {
+    size_t failed = 0;
+    lama_vm* vm = lama_vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "isolates: unable to allocate memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < files_count; i++) {
+        if (lama_vm_load_file(vm, files[i]) != 0 || lama_vm_run(vm) != 0) {
+            fprintf(stderr, "isolates: %s: %s", files[i], lama_vm_error(vm));
+            failed++;
+        }
+    }
+    lama_vm_destroy(vm);
+    return (void*)failed;
+}
+
+// returns the wall time of `n` threads running all files
+static double run_threads(int n, size_t* failed) {
+    pthread_t* threads = calloc(n, sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "isolates: unable to allocate memory\n");
+        exit(1);
+    }
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, run_files, NULL) != 0) {
+            fprintf(stderr, "isolates: unable to create a thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        void* result;
+        pthread_join(threads[i], &result);
+        *failed += (size_t)result;
+    }
+    free(threads);
+    return now() - start;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <max threads> <file.bc>...\n", argv[0]);
+        return 1;
+    }
+    int max_threads = atoi(argv[1]);
+    if (max_threads <= 0) {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    files = argv + 2;
+    files_count = argc - 2;
+
+    double base = 0;
+    fprintf(stderr, "%8s %10s %14s %10s\n", "threads", "seconds", "programs/s",
+            "scaling");
+    for (int n = 1;; n = n * 2 > max_threads && n < max_threads ? max_threads : n * 2) {
+        size_t failed = 0;
+        double t = run_threads(n, &failed);
+        double throughput = (double)n * files_count / t;
+        if (n == 1) {
+            base = throughput;
+        }
+        // 1.0 is linear scaling: n threads do n times as much work per second
+        fprintf(stderr, "%8d %10.3f %14.2f %10.2f", n, t, throughput,
+                throughput / (base * n));
+        fprintf(stderr, failed ? " (%zu runs failed)\n" : "\n", failed);
+        if (n >= max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
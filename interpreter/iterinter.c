@@ -1,9 +1,12 @@
+#include <setjmp.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include "../lama-v1.20/runtime/gc.h"
 #include "../lama-v1.20/runtime/runtime.h"
 #include "../lama-v1.20/runtime/runtime_common.h"
+#include "../lama-v1.20/runtime/word_scan.h"
+#include "iterinter.h"
 
 // helper macros
 #define ASSERT_TRUE(condition, msg, ...)                         \
@@ -11,7 +14,7 @@
         if (!(condition)) failure("\n" msg "\n", ##__VA_ARGS__); \
     while (0)
 
-#define STRING get_string(bf, next_int())
+#define STRING get_string(vm->bf, next_int(vm))
 
 //"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"
 enum { PLUS, MINUS, MULT, DIV, MOD, LS, LE, GR, GE, EQ, NEQ, AND, OR };
@@ -20,9 +23,6 @@ enum { PLUS, MINUS, MULT, DIV, MOD, LS, LE, GR, GE, EQ, NEQ, AND, OR };
         def(LE, <=) def(GR, >) def(GE, >=) def(EQ, ==) def(NEQ, !=)            \
             def(AND, &&) def(OR, ||)
 
-// end of bytefile
-static const uint8_t* eof;
-
 /*THE HELPING CODE FROM BYTERUN*/
 /* The unpacked representation of bytecode file */
 typedef struct {
@@ -52,44 +52,6 @@ static inline int get_public_offset(bytefile* f, int i) {
     return f->public_ptr[i * 2 + 1];
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
-static bytefile* read_file(char* fname) {
-    FILE* f = fopen(fname, "rb");
-    long size;
-    bytefile* file;
-
-    if (f == 0) {
-        failure("%s\n", strerror(errno));
-    }
-
-    if (fseek(f, 0, SEEK_END) == -1) {
-        failure("%s\n", strerror(errno));
-    }
-
-    size_t file_size = sizeof(int) * 4 + (size = ftell(f));
-    file = (bytefile*)malloc(file_size);
-    eof = (unsigned char*)file + file_size;
-
-    if (file == 0) {
-        failure("*** FAILURE: unable to allocate memory.\n");
-    }
-
-    // to the start of stream
-    rewind(f);
-
-    if (size != fread(&file->stringtab_size, 1, size, f)) {
-        failure("%s\n", strerror(errno));
-    }
-
-    fclose(f);
-
-    file->string_ptr =
-        &file->buffer[file->public_symbols_number * 2 * sizeof(int)];
-    file->public_ptr = (int*)file->buffer;
-    file->code_ptr = (const uint8_t*)&file->string_ptr[file->stringtab_size];
-    return file;
-}
-
 // variables needed for gc linkage
 void* __stop_custom_data = 0;
 void* __start_custom_data = 0;
@@ -99,6 +61,7 @@ void* __start_custom_data = 0;
 extern int Lread();
 extern int Lwrite(int n);
 extern void* Bstring(void* p);
+extern void* Bliteral(void* p);
 extern void* Lstring(void* p);
 extern int Llength(void* p);
 extern void* Belem(void* p, int i);
@@ -109,7 +72,7 @@ extern int Bstring_patt(void* x, void* y);
 extern int Barray_patt(void* d, int n);
 
 /*
- * GLOBAL VARIABLES FOR INTERPRETER
+ * STATE OF THE INTERPRETER
  */
 
 // constants
@@ -118,31 +81,62 @@ extern int Barray_patt(void* d, int n);
 #define MEM_SIZE (STACK_SIZE * 2)
 static const int32_t EMPTY_BOX = BOX(0);
 
-// area for global variables and stack
-static int32_t gc_handled_memory[MEM_SIZE];
-// area for call stack
-static int32_t call_stack[STACK_SIZE];
-// current instruction pointer
-const uint8_t* ip;
-// address of current stack frame
-static int32_t* fp;
-// call stack bottom pointer
-static const int32_t* call_stack_bottom = call_stack + STACK_SIZE;
-// call stack top pointer
-static int32_t* call_stack_top;
+// everything the interpreter of one program needs, see iterinter.h
+struct lama_vm {
+    // bytefile info
+    bytefile* bf;
+    // end of bytefile
+    const uint8_t* eof;
+    // current instruction pointer
+    const uint8_t* ip;
+    // address of current stack frame
+    int32_t* fp;
+    // area for global variables and stack, MEM_SIZE words
+    int32_t* gc_handled_memory;
+    // operands stack bottom and start of globals area
+    int32_t* globals;
+    // area for call stack, STACK_SIZE words
+    int32_t* call_stack;
+    // call stack bottom pointer
+    const int32_t* call_stack_bottom;
+    // call stack top pointer
+    int32_t* call_stack_top;
+
+    int n_args;
+    int n_locals;
+    // needed to pop closure address from stack operands
+    bool is_closure;
+    // `lama_vm_run_prefix` stops before the first read or write
+    bool stop_at_io;
+    // the next run continues from `ip` instead of the beginning
+    bool resume;
+    // the operands stack top of the paused run
+    int32_t* paused_sp;
+
+    // failures of the runtime during `lama_vm_run` come back here
+    jmp_buf on_failure;
+    char error[FAILURE_MESSAGE_SIZE];
+};
+
 // start of gc handled memory and operands stack top
-extern size_t __gc_stack_top;
+extern ISOLATE_LOCAL size_t __gc_stack_top;
 // gc handled memory bottom
-extern size_t __gc_stack_bottom;
-// operands stack bottom and start of globals area
-static int32_t* globals;
-// bytefile info
-static bytefile* bf;
-
-static int n_args = 0;
-static int n_locals = 0;
-// needed to pop closure address from stack operands
-static bool is_closure = false;
+extern ISOLATE_LOCAL size_t __gc_stack_bottom;
+
+// the heap is shared by the instances of a thread (of the process without
+// LAMA_ISOLATES): it is created with the first instance and released with the
+// last one
+static ISOLATE_LOCAL int vms_count = 0;
+// the instance that is running, the runtime reports failures to it
+static ISOLATE_LOCAL lama_vm* running_vm = NULL;
+// the instance stopped by `lama_vm_run_prefix`: its stacks are not roots of
+// the collections of other instances and its objects refer to the shared
+// strings of literals, so the other instances of the thread do not run or
+// load while it is paused
+static ISOLATE_LOCAL lama_vm* paused_vm = NULL;
+// the strings of literals of an unloaded file, they are released once no
+// instance is paused
+static ISOLATE_LOCAL bool literals_stale = false;
 
 /*
  * STACKS HANDLING
@@ -155,16 +149,16 @@ static inline void move_sp(int delta) {
     __gc_stack_top = (size_t)(sp() + delta);
 }
 
-static inline void push_op(int32_t value) {
+static inline void push_op(lama_vm* vm, int32_t value) {
     *sp() = value;
     move_sp(-1);
-    ASSERT_TRUE(sp() != gc_handled_memory, "\nOperands stack overflow");
+    ASSERT_TRUE(sp() != vm->gc_handled_memory, "\nOperands stack overflow");
 }
 
-static inline void push_call(int32_t value) {
-    *call_stack_top = value;
-    call_stack_top--;
-    ASSERT_TRUE(call_stack_top != call_stack, "\nCall stack overflow");
+static inline void push_call(lama_vm* vm, int32_t value) {
+    *vm->call_stack_top = value;
+    vm->call_stack_top--;
+    ASSERT_TRUE(vm->call_stack_top != vm->call_stack, "\nCall stack overflow");
 }
 
 static inline int32_t pop_op(void) {
@@ -176,86 +170,89 @@ static inline int32_t pop_op(void) {
 
 static inline int32_t peek_op(void) { return *(sp() + 1); }
 
-static inline int32_t pop_call() {
-    ASSERT_TRUE(call_stack_top != call_stack_bottom - 1,
+static inline int32_t pop_call(lama_vm* vm) {
+    ASSERT_TRUE(vm->call_stack_top != vm->call_stack_bottom - 1,
                 "\nAccess to empty call stack");
-    call_stack_top++;
-    return *call_stack_top;
+    vm->call_stack_top++;
+    return *vm->call_stack_top;
 }
 
 /**
  * THE HELPING CODE FOR INTERPRETER
  */
 
-static  void init(int32_t global_area_size) {
-    // init GC heap, otherwise GC will fail (all heap pointers are 0)
-    __gc_init();
-    __gc_stack_bottom = (size_t)gc_handled_memory + MEM_SIZE;
-    globals = (int32_t*)__gc_stack_bottom - global_area_size;
-    __gc_stack_top = (size_t)(globals - 1);
+// the GC roots become the stacks of `vm`, globals are cleared
+static void init(lama_vm* vm) {
+    int32_t global_area_size = vm->bf->global_area_size;
+    __gc_stack_bottom = (size_t)(vm->gc_handled_memory + MEM_SIZE);
+    vm->globals = (int32_t*)__gc_stack_bottom - global_area_size;
+    __gc_stack_top = (size_t)(vm->globals - 1);
 
-    call_stack_top = (int32_t*)call_stack_bottom - 1;
+    vm->call_stack_top = (int32_t*)vm->call_stack_bottom - 1;
+    vm->fp = NULL;
+    vm->n_args = vm->n_locals = 0;
+    vm->is_closure = false;
 
     // set boxed values in global area memory
     for (int i = 0; i < global_area_size; i++) {
-        globals[i] = EMPTY_BOX;
+        vm->globals[i] = EMPTY_BOX;
     }
 }
 
-static inline void update_ip(const uint8_t* new_ip) {
+static inline void update_ip(lama_vm* vm, const uint8_t* new_ip) {
     ASSERT_TRUE(
-        new_ip >= bf->code_ptr && new_ip < eof,
+        new_ip >= vm->bf->code_ptr && new_ip < vm->eof,
         "IP points out of bytecode area! START_CODE: %d, EOF: %d, IP: %d",
-        bf->code_ptr, eof, new_ip);
-        ip = new_ip;
+        vm->bf->code_ptr, vm->eof, new_ip);
+        vm->ip = new_ip;
 }
 
-static inline unsigned char next_byte() {
-    ASSERT_TRUE(ip + 1 < eof, "IP points out of bytecode area!");
-    return *ip++;
+static inline unsigned char next_byte(lama_vm* vm) {
+    ASSERT_TRUE(vm->ip + 1 < vm->eof, "IP points out of bytecode area!");
+    return *vm->ip++;
 }
 
-static inline int32_t next_int() {
-    ASSERT_TRUE(ip + sizeof(int32_t) < eof, "IP points out of bytecode area!");
-    return (ip += sizeof(int32_t), *(int32_t*)(ip - sizeof(int32_t)));
+static inline int32_t next_int(lama_vm* vm) {
+    ASSERT_TRUE(vm->ip + sizeof(int32_t) < vm->eof, "IP points out of bytecode area!");
+    return (vm->ip += sizeof(int32_t), *(int32_t*)(vm->ip - sizeof(int32_t)));
 }
 
 /**
  * METHODS FOR HANDLING BYTECODE
  */
 
-static inline void call(void) {
-    int32_t func_label = next_int();
-    int32_t n_args = next_int();
-    is_closure = false;
+static inline void call(lama_vm* vm) {
+    int32_t func_label = next_int(vm);
+    int32_t n_args = next_int(vm);
+    vm->is_closure = false;
 
-    push_call((int32_t)ip);  // return address
-    update_ip(bf->code_ptr + func_label);
+    push_call(vm, (int32_t)vm->ip);  // return address
+    update_ip(vm, vm->bf->code_ptr + func_label);
 }
 
-static inline void begin(int new_n_locs, int new_n_args) {
+static inline void begin(lama_vm* vm, int new_n_locs, int new_n_args) {
     // save frame pointer of callee function
-    push_call((int32_t)fp);
-    push_call(n_args);
-    push_call(n_locals);
-    push_call(is_closure);
+    push_call(vm, (int32_t)vm->fp);
+    push_call(vm, vm->n_args);
+    push_call(vm, vm->n_locals);
+    push_call(vm, vm->is_closure);
 
-    fp = sp();
+    vm->fp = sp();
 
-    n_args = new_n_args, n_locals = new_n_locs;
+    vm->n_args = new_n_args, vm->n_locals = new_n_locs;
     for (int i = 0; i < new_n_locs; i++) {
-        push_op(EMPTY_BOX);
+        push_op(vm, EMPTY_BOX);
     }
 }
 
-static inline void tag(void) {
+static inline void tag(lama_vm* vm) {
     // for pattern matching: check
     // that sexp has given tag and fields count
     const char* tag = STRING;
-    int32_t n_field = next_int();
+    int32_t n_field = next_int(vm);
     int32_t sexp = pop_op();
     int32_t tag_hash = LtagHash((char*)tag);
-    push_op(Btag((void*)sexp, tag_hash, BOX(n_field)));
+    push_op(vm, Btag((void*)sexp, tag_hash, BOX(n_field)));
 }
 
 static inline char* get_closure_content(int32_t* p) {
@@ -271,22 +268,22 @@ static inline int32_t get_closure_addr(int32_t* p) {
 }
 
 enum { G, L, A, C };
-static inline int32_t* get_addr(int32_t place, int32_t idx) {
+static inline int32_t* get_addr(lama_vm* vm, int32_t place, int32_t idx) {
     ASSERT_TRUE(idx >= 0, "Index less than zero!!");
     switch (place) {
         case G:
-            ASSERT_TRUE(globals + idx < (int32_t*)__gc_stack_bottom,
+            ASSERT_TRUE(vm->globals + idx < (int32_t*)__gc_stack_bottom,
                         "Out of memory (global %d)", idx);
-            return globals + idx;
+            return vm->globals + idx;
         case L:
-            ASSERT_TRUE(idx < n_locals, "Operands stack overflow!");
-            return fp - idx;
+            ASSERT_TRUE(idx < vm->n_locals, "Operands stack overflow!");
+            return vm->fp - idx;
         case A:
-            ASSERT_TRUE(idx < n_args, "Arguments overflow!");
-            return fp + n_args - idx;
+            ASSERT_TRUE(idx < vm->n_args, "Arguments overflow!");
+            return vm->fp + vm->n_args - idx;
         case C: {
             int32_t* closure_addr =
-                (int32_t*)get_closure_content((int32_t*)fp[n_args + 1]);
+                (int32_t*)get_closure_content((int32_t*)vm->fp[vm->n_args + 1]);
             return (closure_addr + idx + 1);
         }
         default:
@@ -294,104 +291,111 @@ static inline int32_t* get_addr(int32_t place, int32_t idx) {
     }
 }
 
-static inline void ld(int32_t place_type, int idx) {
-    int32_t* place = get_addr(place_type, idx);
-    push_op(*place);
+static inline void ld(lama_vm* vm, int32_t place_type, int idx) {
+    int32_t* place = get_addr(vm, place_type, idx);
+    push_op(vm, *place);
 }
 
-static inline void lda(int32_t place_type, int idx) {
-    int32_t* place = get_addr(place_type, idx);
-    push_op((int32_t)place);
+static inline void lda(lama_vm* vm, int32_t place_type, int idx) {
+    int32_t* place = get_addr(vm, place_type, idx);
+    push_op(vm, (int32_t)place);
 }
 
-static inline void st(int32_t place_type, int idx) {
+static inline void st(lama_vm* vm, int32_t place_type, int idx) {
     int32_t value = peek_op();
-    int32_t* place = get_addr(place_type, idx);
+    int32_t* place = get_addr(vm, place_type, idx);
+    // captured variables live in the closure object on the heap
+    if (place_type == C) {
+        gc_write_barrier((void*)*place);
+    }
     *place = value;
 }
 
-static inline void sta() {
+static inline void sta(lama_vm* vm) {
     int32_t value = pop_op();
     int32_t dest = pop_op();
     if (UNBOXED(dest)) {
         int32_t array = pop_op();
         Bsta((void*)value, dest, (void*)array);
     } else {
+        // `dest` may be an address of a captured variable inside a closure
+        gc_write_barrier(*(void**)dest);
         *(int32_t*)dest = value;
     }
-    push_op(value);
+    push_op(vm, value);
 }
 
 // expired by function `Bclosure` from runtime.c
 // create an object of closure ant put it on stack
-static inline void closure(void) {
+static inline void closure(lama_vm* vm) {
     int i, ai;
     data* r;
 
-    void* closure_addr = (void*)next_int();
+    void* closure_addr = (void*)next_int(vm);
     // number of captured by closure variables
-    int32_t n = next_int();
+    int32_t n = next_int(vm);
 
-    r = (data*)alloc_closure(n + 1);
+    // every field is written below
+    r = (data*)alloc_uninitialized_closure(n + 1);
 
     push_extra_root((void**)&r);
 
     ((void**)r->contents)[0] = closure_addr;
 
     for (i = 0; i < n; i++) {
-        unsigned char place_type = next_byte();
-        int32_t idx = next_int();
-        int32_t* place = get_addr(place_type, idx);
+        unsigned char place_type = next_byte(vm);
+        int32_t idx = next_int(vm);
+        int32_t* place = get_addr(vm, place_type, idx);
         ai = *place;
         ((int*)r->contents)[i + 1] = ai;
     }
 
     pop_extra_root((void**)&r);
-    push_op((int32_t)r->contents);
+    push_op(vm, (int32_t)r->contents);
 }
 
 // CALLC
-static inline void call_closure(void) {
-    int32_t n_args = next_int();
+static inline void call_closure(lama_vm* vm) {
+    int32_t n_args = next_int(vm);
     // closure addr not in code -- it stored in closure object.
     // Stack store count of closure arguments and closure object
     // in 0 field in closure stored address, in other -- captured variables
     int32_t closure_label = get_closure_addr((int32_t*)sp()[n_args + 1]);
-    is_closure = true;
+    vm->is_closure = true;
 
-    push_call((int32_t)ip);  // return address
-    update_ip(bf->code_ptr + (int32_t)closure_label);
+    push_call(vm, (int32_t)vm->ip);  // return address
+    update_ip(vm, vm->bf->code_ptr + (int32_t)closure_label);
 }
 
 // CBEGIN
 // Begin in closure if there has captured variables
 // otherwise closure starts with `BEGIN`
-static inline void begin_closure() {
-    int new_n_args = next_int();
-    int new_n_locs = next_int();
-    begin(new_n_locs, new_n_args);
+static inline void begin_closure(lama_vm* vm) {
+    int new_n_args = next_int(vm);
+    int new_n_locs = next_int(vm);
+    begin(vm, new_n_locs, new_n_args);
 }
 
-static inline void end() {
+static inline void end(lama_vm* vm) {
     int32_t return_val = pop_op();
-    move_sp(n_args + n_locals);
+    move_sp(vm->n_args + vm->n_locals);
 
-    bool is_closure = pop_call();
+    bool is_closure = pop_call(vm);
     if (is_closure) {
         pop_op();
     }
 
-    push_op(return_val);
+    push_op(vm, return_val);
 
-    n_locals = pop_call();      // locs_n
-    n_args = pop_call();        // args_n
-    fp = (int32_t*)pop_call();  // fp
+    vm->n_locals = pop_call(vm);      // locs_n
+    vm->n_args = pop_call(vm);        // args_n
+    vm->fp = (int32_t*)pop_call(vm);  // fp
 
-    if (call_stack_top != call_stack_bottom - 1) {
-        ip = (unsigned char*)pop_call();  // ret addr
+    if (vm->call_stack_top != vm->call_stack_bottom - 1) {
+        vm->ip = (unsigned char*)pop_call(vm);  // ret addr
     }
 }
-static inline void binop(int32_t operator_code) {
+static inline void binop(lama_vm* vm, int32_t operator_code) {
     int32_t b = pop_op(), a = pop_op();
     a = UNBOX(a), b = UNBOX(b);
     int32_t result = 0;
@@ -408,45 +412,47 @@ static inline void binop(int32_t operator_code) {
             failure("Unknown binop operand code: %d", operator_code);
     }
     result = BOX(result);
-    push_op(result);
+    push_op(vm, result);
 }
 
 // inspired by `Barray` from runtime.c
-static inline void call_barray(void) {
-    int i, ai;
+static inline void call_barray(lama_vm* vm) {
     data* r;
-    int n = next_int();
+    int n = next_int(vm);
+    ASSERT_TRUE(n >= 0 && sp() + n < (int32_t*)__gc_stack_bottom,
+                "\nAccess to empty operands stack");
 
-    r = (data*)alloc_array(n);
+    r = (data*)alloc_uninitialized_array(n);
 
-    for (i = n - 1; i >= 0; i--) {
-        ai = pop_op();
-        ((int*)r->contents)[i] = ai;
+    // the elements are on the operands stack with the last one on top
+    copy_words_reversed((size_t*)r->contents, (size_t*)(sp() + 1), n);
+    move_sp(n);
+
+    if (find_boxed_word((size_t*)r->contents, n) == n) {
+        r->data_header |= NO_POINTERS_FLAG;
     }
-    push_op((int32_t)r->contents);
+    push_op(vm, (int32_t)r->contents);
 }
 
 // usually original method Bsexp
 // called with args <fileds numbers + 1>
 // so don't need create field `fields_count`
-static inline void call_bsexp(void) {
+static inline void call_bsexp(lama_vm* vm) {
     int i;
     int ai;
     size_t* p;
     data* r;
     const char* tag = STRING;
-    int n = next_int();
-    r = (data*)alloc_sexp(n);
-    ((sexp*)r)->tag = 0;
+    int n = next_int(vm);
+    int tag_hash = UNBOX(LtagHash((char *)tag));
+    r = (data*)alloc_uninitialized_sexp_tagged(n, tag_hash);
 
-    for (i = n; i >= 1; i--) {
+    for (i = n - 1; i >= 0; i--) {
         ai = pop_op();
-        ((int*)r->contents)[i] = ai;
+        SEXP_FIELDS(r)[i] = ai;
     }
 
-    ((sexp*)r)->tag = UNBOX(LtagHash((char *)tag));
-
-    push_op((int32_t)r->contents);
+    push_op(vm, (int32_t)r->contents);
 }
 
 enum {
@@ -463,7 +469,7 @@ static inline bool check_tag(int32_t obj, int32_t tag) {
     if (UNBOXED(obj)) {
         return false;
     }
-    int32_t actual_tag = TAG(TO_DATA(obj)->data_header);
+    int32_t actual_tag = KIND(TO_DATA(obj)->data_header);
     switch (tag) {
         case ref_type:
             return true;
@@ -489,7 +495,7 @@ Check that object from operands stack matches with pattern:
 has the same type (tag) or equals as a string (in these case
 other string stored on stack to)
 */
-static inline void patt(int32_t patt_type) {
+static inline void patt(lama_vm* vm, int32_t patt_type) {
     bool result = false;
     int32_t obj = pop_op();
 
@@ -498,14 +504,14 @@ static inline void patt(int32_t patt_type) {
     } else {
         result = check_tag(obj, patt_type);
     }
-    push_op(BOX(result));
+    push_op(vm, BOX(result));
 }
 
 // pattern matching with array
-static inline void array(void) {
-    int32_t array_size = BOX(next_int());
+static inline void array(lama_vm* vm) {
+    int32_t array_size = BOX(next_int(vm));
     int32_t actual_obj = pop_op();
-    push_op(Barray_patt((void*)actual_obj, array_size));
+    push_op(vm, Barray_patt((void*)actual_obj, array_size));
 }
 
 // outer switch
@@ -528,51 +534,178 @@ enum {
 };
 // H7 OPS
 enum { LREAD, LWRITE, LLENGTH, LSTRING, BARRAY };
-static void interpret(FILE* f) {
-    init(bf->global_area_size);
-    ip = bf->code_ptr;
+
+/**
+ * ALLOCATION PROFILE
+ */
+
+// length in bytes of the instruction at `p`, including the opcode
+static size_t instruction_length(const uint8_t* p) {
+    uint8_t h = (*p & 0xF0) >> 4, l = *p & 0x0F;
+    switch (h) {
+        case LD:
+        case LDA:
+        case ST:
+            return 5;
+        case H1_OPS:
+            switch (l) {
+                case CONST:
+                case BSTRING:
+                case JMP:
+                    return 5;
+                case BSEXP:
+                    return 9;
+                default:
+                    return 1;
+            }
+        case H5_OPS:
+            switch (l) {
+                case BEGIN:
+                case CBEGIN:
+                case CALL:
+                case TAG:
+                case FAIL:
+                    return 9;
+                case BCLOSURE:
+                    // address, number of captured variables, then a place byte and an index each
+                    return 9 + 5 * *(const int32_t*)(p + 5);
+                default:
+                    return 5;
+            }
+        case H7_OPS:
+            return l == BARRAY ? 5 : 1;
+        default:
+            return 1;
+    }
+}
+
+static const char* function_name(bytefile* bf, int32_t offset) {
+    static ISOLATE_LOCAL char label[16];
+    for (unsigned i = 0; i < bf->public_symbols_number; i++) {
+        if (get_public_offset(bf, i) == offset) {
+            return get_public_name(bf, i);
+        }
+    }
+    snprintf(label, sizeof(label), "L%x", offset);
+    return label;
+}
+
+// writes allocation sites sorted by allocated words to the file `path`
+// ("-" is stderr), every site is mapped to the function (the last BEGIN
+// before it) and the source line (the last LINE before it)
+void lama_vm_write_alloc_profile(lama_vm* vm, const char* path) {
+    bytefile* bf = vm->bf;
+    const uint8_t* eof = vm->eof;
+    FILE* out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (out == NULL) {
+        perror("ERROR: write_alloc_profile: unable to open the report file\n");
+        return;
+    }
+
+    size_t code_size = eof - bf->code_ptr;
+    int32_t* function_at = calloc(code_size, sizeof(int32_t));
+    int32_t* line_at = calloc(code_size, sizeof(int32_t));
+    if (function_at == NULL || line_at == NULL) {
+        perror("ERROR: write_alloc_profile: unable to allocate the line table\n");
+        exit(1);
+    }
+    int32_t function = 0, line = 0;
+    for (const uint8_t* p = bf->code_ptr; p < eof && *p != 0xFF;
+         p += instruction_length(p)) {
+        uint8_t h = (*p & 0xF0) >> 4, l = *p & 0x0F;
+        if (h == H5_OPS && (l == BEGIN || l == CBEGIN)) {
+            function = p - bf->code_ptr;
+        } else if (h == H5_OPS && l == LINE) {
+            line = *(const int32_t*)(p + 1);
+        }
+        function_at[p - bf->code_ptr] = function;
+        line_at[p - bf->code_ptr] = line;
+    }
+
+    size_t n;
+    const alloc_site_stats* sites = gc_alloc_profile(&n);
+    fprintf(out, "%10s %10s %10s %10s %10s  %s\n", "words", "objects",
+            "survivals", "live", "offset", "function:line");
+    for (size_t i = 0; i < n; i++) {
+        size_t at = sites[i].site < code_size ? sites[i].site : 0;
+        fprintf(out, "%10zu %10zu %10zu %10zu %10zx  %s:%d\n", sites[i].words,
+                sites[i].count, sites[i].survivals, sites[i].live,
+                sites[i].site, function_name(bf, function_at[at]), line_at[at]);
+    }
+
+    free(function_at);
+    free(line_at);
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+// stops the run before an instruction that reads or writes, the instruction
+// (one byte) is executed by the next run
+static inline bool pause_at_io(lama_vm* vm) {
+    if (vm->stop_at_io) {
+        vm->ip--;
+        vm->resume = true;
+        vm->paused_sp = sp();
+    }
+    return vm->stop_at_io;
+}
+
+static void interpret(lama_vm* vm) {
+    if (!vm->resume) {
+        init(vm);
+        vm->ip = vm->bf->code_ptr;
+    } else {
+        // the GC roots become the stacks of `vm` again
+        __gc_stack_bottom = (size_t)(vm->gc_handled_memory + MEM_SIZE);
+        __gc_stack_top = (size_t)vm->paused_sp;
+    }
+    vm->resume = false;
     do {
-        uint8_t x = next_byte(), h = (x & 0xF0) >> 4, l = x & 0x0F;
+        if (gc_alloc_profiling) {
+            gc_alloc_site = vm->ip - vm->bf->code_ptr;
+        }
+        uint8_t x = next_byte(vm), h = (x & 0xF0) >> 4, l = x & 0x0F;
 
         switch (h) {
             case 15:
                 goto stop;
 
             case BINOP:
-                binop(l - 1);
+                binop(vm, l - 1);
                 break;
             case H1_OPS:
                 switch (l) {
                     case CONST:
-                        push_op(BOX(next_int()));
+                        push_op(vm, BOX(next_int(vm)));
                         break;
 
                     case BSTRING: {
                         const char* string_in_pool = STRING;
-                        push_op((int32_t)Bstring((char *)string_in_pool));
+                        push_op(vm, (int32_t)Bliteral((char *)string_in_pool));
                         break;
                     }
                     case BSEXP:
-                        call_bsexp();
+                        call_bsexp(vm);
                         break;
 
                     case STI:
                         failure("Untested operation STI");
 
                     case STA:
-                        sta();
+                        sta(vm);
                         break;
 
                     case JMP: {  // JMP
-                        int x = next_int();
-                        update_ip(bf->code_ptr + x);
+                        int x = next_int(vm);
+                        update_ip(vm, vm->bf->code_ptr + x);
                         break;
                     }
 
                     case END:
-                        end();
+                        end(vm);
                         // check if is main function
-                        if (call_stack_top == call_stack_bottom - 1) {
+                        if (vm->call_stack_top == vm->call_stack_bottom - 1) {
                             return;
                         }
                         break;
@@ -584,7 +717,7 @@ static void interpret(FILE* f) {
                         break;
 
                     case DUP:
-                        push_op(peek_op());
+                        push_op(vm, peek_op());
                         break;
 
                     case SWAP:
@@ -593,7 +726,7 @@ static void interpret(FILE* f) {
                     case ELEM: {  
                         int32_t idx = pop_op();
                         int32_t array = pop_op();
-                        push_op((int32_t)Belem((char*)array, idx));
+                        push_op(vm, (int32_t)Belem((char*)array, idx));
                         break;
                     }
                     default:
@@ -602,70 +735,70 @@ static void interpret(FILE* f) {
                 break;
 
             case LD:
-                ld(l, next_int());
+                ld(vm, l, next_int(vm));
                 break;
             case LDA:
-                lda(l, next_int());
+                lda(vm, l, next_int(vm));
                 break;
             case ST:
-                st(l, next_int());
+                st(vm, l, next_int(vm));
                 break;
 
             case H5_OPS:
                 switch (l) {
                     case CJMPZ: {
-                        int x = next_int();
+                        int x = next_int(vm);
                         if (!UNBOX(pop_op())) {
-                            update_ip(bf->code_ptr + x);
+                            update_ip(vm, vm->bf->code_ptr + x);
                         }
                         break;
                     }
 
                     case CJMPNZ: {  // CJMPnz
-                        int x = next_int();
+                        int x = next_int(vm);
                         if (UNBOX(pop_op())) {
-                            update_ip(bf->code_ptr + x);
+                            update_ip(vm, vm->bf->code_ptr + x);
                         }
                         break;
                     }
 
                     case BEGIN: {
-                        int n_args = next_int();
-                        int n_locs = next_int();
-                        begin(n_locs, n_args);
+                        int n_args = next_int(vm);
+                        int n_locs = next_int(vm);
+                        begin(vm, n_locs, n_args);
                         break;
                     }
 
                     case CBEGIN:
-                        begin_closure();
+                        begin_closure(vm);
                         break;
 
                     case BCLOSURE:
-                        closure();
+                        closure(vm);
                         break;
 
                     case CALLC:
-                        call_closure();
+                        call_closure(vm);
                         break;
                     case CALL:
-                        call();
+                        call(vm);
                         break;
                     case TAG:
-                        tag();
+                        tag(vm);
                         break;
                     case ARRAY_KEY:
-                        array();
+                        array(vm);
                         break;
 
                     case FAIL: {
-                        int32_t line = next_int();
-                        int32_t col = next_byte();
+                        int32_t line = next_int(vm);
+                        int32_t col = next_byte(vm);
                         failure("\nFAIL at \t%d:%d", line, col);
                     }
 
                     /*information about source code line*/
                     case LINE:
-                        next_int();
+                        next_int(vm);
                         break;
 
                     default:
@@ -674,34 +807,40 @@ static void interpret(FILE* f) {
                 break;
 
             case PATT:
-                patt(l);
+                patt(vm, l);
                 break;
 
             case H7_OPS: {
                 switch (l) {
                     case LREAD: {
+                        if (pause_at_io(vm)) {
+                            return;
+                        }
                         // read make it BOX itself
                         int32_t value = Lread();
-                        push_op(value);
+                        push_op(vm, value);
                         break;
                     }
 
                     case LWRITE: {
+                        if (pause_at_io(vm)) {
+                            return;
+                        }
                         int32_t value = pop_op();
                         value = Lwrite(value);
-                        push_op(value);
+                        push_op(vm, value);
                     } break;
 
                     case LLENGTH:
-                        push_op(Llength((char*)pop_op()));
+                        push_op(vm, Llength((char*)pop_op()));
                         break;
 
                     case LSTRING:
-                        push_op((int32_t)Lstring((char*)pop_op()));
+                        push_op(vm, (int32_t)Lstring((char*)pop_op()));
                         break;
 
                     case BARRAY:
-                        call_barray();
+                        call_barray(vm);
                         break;
 
                     default:
@@ -717,11 +856,200 @@ stop:
     return;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        failure("Empty input! Specify the path to the bytecode file!");
+/**
+ * INSTANCES
+ */
+
+// sets the message of a failure outside of `lama_vm_run`, returns -1
+static int vm_error(lama_vm* vm, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(vm->error, sizeof(vm->error), fmt, args);
+    va_end(args);
+    return -1;
+}
+
+// fails if another instance of the thread is paused, see `paused_vm`
+static int check_not_paused(lama_vm* vm) {
+    if (paused_vm != NULL && paused_vm != vm) {
+        return vm_error(vm, "another instance is paused by lama_vm_run_prefix\n");
+    }
+    return 0;
+}
+
+// `vm` is not paused any more: its run has ended, it is loaded or destroyed
+static void end_pause(lama_vm* vm) {
+    vm->resume = false;
+    if (paused_vm == vm) {
+        paused_vm = NULL;
+    }
+    if (paused_vm == NULL && literals_stale) {
+        release_literals();
+        literals_stale = false;
+    }
+}
+
+static void on_failure(const char* message) {
+    snprintf(running_vm->error, sizeof(running_vm->error), "%s", message);
+    longjmp(running_vm->on_failure, 1);
+}
+
+lama_vm* lama_vm_create(void) {
+    lama_vm* vm = calloc(1, sizeof(lama_vm));
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm->gc_handled_memory = malloc(MEM_SIZE * sizeof(int32_t));
+    vm->call_stack = malloc(STACK_SIZE * sizeof(int32_t));
+    if (vm->gc_handled_memory == NULL || vm->call_stack == NULL) {
+        free(vm->gc_handled_memory);
+        free(vm->call_stack);
+        free(vm);
+        return NULL;
+    }
+    vm->call_stack_bottom = vm->call_stack + STACK_SIZE;
+    // init GC heap, otherwise GC will fail (all heap pointers are 0)
+    if (vms_count++ == 0) {
+        __init();
     }
-    bf = read_file(argv[1]);
-    interpret(stdout);
+    return vm;
+}
+
+// the bytes of the file are read to the `size` bytes after the pointers of `bytefile`
+static bytefile* alloc_bytefile(lama_vm* vm, size_t size) {
+    size_t file_size = sizeof(int) * 4 + size;
+    bytefile* file = (bytefile*)malloc(file_size);
+    if (file == NULL) {
+        vm_error(vm, "unable to allocate memory.\n");
+        return NULL;
+    }
+    vm->eof = (unsigned char*)file + file_size;
+    return file;
+}
+
+// checks the header of the file read to `file` and makes it the program of `vm`
+static int unpack_bytefile(lama_vm* vm, bytefile* file, size_t size) {
+    size_t header = 3 * sizeof(int);
+    if (size < header ||
+        file->public_symbols_number > (size - header) / (2 * sizeof(int)) ||
+        file->stringtab_size >
+            size - header - file->public_symbols_number * 2 * sizeof(int) ||
+        file->global_area_size >= STACK_SIZE) {
+        free(file);
+        return vm_error(vm, "malformed bytecode file\n");
+    }
+
+    file->string_ptr =
+        &file->buffer[file->public_symbols_number * 2 * sizeof(int)];
+    file->public_ptr = (int*)file->buffer;
+    file->code_ptr = (const uint8_t*)&file->string_ptr[file->stringtab_size];
+
+    if (vm->bf != NULL) {
+        free(vm->bf);
+        // the strings of literals were found by their addresses in the old file
+        literals_stale = true;
+    }
+    end_pause(vm);
+    vm->bf = file;
     return 0;
 }
+
+int lama_vm_load(lama_vm* vm, const void* buf, size_t size) {
+    if (check_not_paused(vm) != 0) {
+        return -1;
+    }
+    bytefile* file = alloc_bytefile(vm, size);
+    if (file == NULL) {
+        return -1;
+    }
+    memcpy(&file->stringtab_size, buf, size);
+    return unpack_bytefile(vm, file, size);
+}
+
+int lama_vm_load_file(lama_vm* vm, const char* path) {
+    if (check_not_paused(vm) != 0) {
+        return -1;
+    }
+    FILE* f = fopen(path, "rb");
+    long size;
+    bytefile* file;
+
+    if (f == 0) {
+        return vm_error(vm, "%s\n", strerror(errno));
+    }
+
+    if (fseek(f, 0, SEEK_END) == -1 || (size = ftell(f)) == -1) {
+        fclose(f);
+        return vm_error(vm, "%s\n", strerror(errno));
+    }
+
+    file = alloc_bytefile(vm, size);
+    if (file == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    // to the start of stream
+    rewind(f);
+
+    if (size != fread(&file->stringtab_size, 1, size, f)) {
+        fclose(f);
+        free(file);
+        return vm_error(vm, "%s\n", strerror(errno));
+    }
+
+    fclose(f);
+    return unpack_bytefile(vm, file, size);
+}
+
+int lama_vm_run(lama_vm* vm) {
+    if (check_not_paused(vm) != 0) {
+        return -1;
+    }
+    if (vm->bf == NULL) {
+        return vm_error(vm, "no bytecode file is loaded\n");
+    }
+    int status = 0;
+    running_vm = vm;
+    failure_handler = on_failure;
+    if (setjmp(vm->on_failure) == 0) {
+        interpret(vm);
+    } else {
+        // runtime functions that failed have left their roots
+        clear_extra_roots();
+        status = -1;
+    }
+    // the output of the run is complete when it returns
+    flush_output();
+    failure_handler = NULL;
+    running_vm = NULL;
+    if (vm->resume) {
+        paused_vm = vm;
+    } else {
+        end_pause(vm);
+    }
+    return status;
+}
+
+int lama_vm_run_prefix(lama_vm* vm) {
+    vm->stop_at_io = true;
+    int status = lama_vm_run(vm);
+    vm->stop_at_io = false;
+    return status;
+}
+
+const char* lama_vm_error(const lama_vm* vm) { return vm->error; }
+
+void lama_vm_destroy(lama_vm* vm) {
+    if (vm->bf != NULL) {
+        free(vm->bf);
+        literals_stale = true;
+    }
+    end_pause(vm);
+    free(vm->gc_handled_memory);
+    free(vm->call_stack);
+    free(vm);
+    if (--vms_count == 0) {
+        __shutdown();
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef __LAMA_ITERINTER__
+#define __LAMA_ITERINTER__
+
+#include <stddef.h>
+
+/*
+ * An instance of the interpreter (libiterinter): a loaded bytecode file, its
+ * operands and call stacks and its globals. An instance can run its program
+ * any number of times, every run starts with cleared globals and stacks.
+ * Objects are allocated on the heap of the runtime: the heap is created with
+ * the first instance and released with the last one, and the instances use it
+ * one at a time. With the runtime and the interpreter built with LAMA_ISOLATES
+ * every thread has a heap of its own, so instances made on different threads
+ * run at once (an instance is used by the thread that has made it).
+ *
+ * Failures of the program (`failure` of the runtime, FAIL instructions and
+ * failed checks of the interpreter) end the run with an error instead of
+ * the exit of the process. Exhaustion of the heap is still fatal.
+ */
+typedef struct lama_vm lama_vm;
+
+// returns NULL if there is no memory for the stacks
+lama_vm* lama_vm_create(void);
+
+// load a bytecode file from memory (the bytes are copied) or from the file
+// system, the program loaded before is replaced; return 0 or -1 on error
+int lama_vm_load(lama_vm* vm, const void* buf, size_t size);
+int lama_vm_load_file(lama_vm* vm, const char* path);
+
+// runs the loaded program from the beginning (or from where
+// `lama_vm_run_prefix` has stopped), returns 0 or -1 on failure
+int lama_vm_run(lama_vm* vm);
+
+// runs the program up to its first read or write, i.e. the part that does not
+// depend on the input, and stops there: the next `lama_vm_run` continues the
+// program, so processes forked after this call skip the prefix; returns 0 or
+// -1 on failure
+//
+// The objects of the paused program are reachable only from its instance, so
+// until it is run, loaded or destroyed the other instances of the thread are
+// not run or loaded: `lama_vm_run`, `lama_vm_run_prefix` and the loads fail
+// for them. They may be destroyed.
+int lama_vm_run_prefix(lama_vm* vm);
+
+// the message of the last error of `vm`
+const char* lama_vm_error(const lama_vm* vm);
+
+// writes the allocation profile (see LAMA_ALLOC_PROFILE in README.md)
+void lama_vm_write_alloc_profile(lama_vm* vm, const char* path);
+
+void lama_vm_destroy(lama_vm* vm);
+
+#endif
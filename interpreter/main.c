@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "driver.h"
+#include "iterinter.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr,
+                "*** FAILURE: Empty input! Specify the path to the bytecode "
+                "file!");
+        return 255;
+    }
+    if (strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "--serve") == 0) {
+        return run_server(argc - 2, argv + 2);
+    }
+    lama_vm* vm = lama_vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "*** FAILURE: unable to allocate memory.\n");
+        return 255;
+    }
+    int status = lama_vm_load_file(vm, argv[1]);
+    if (status == 0) {
+        status = lama_vm_run(vm);
+        const char* profile = getenv("LAMA_ALLOC_PROFILE");
+        if (profile != NULL) {
+            lama_vm_write_alloc_profile(vm, profile);
+        }
+    }
+    if (status != 0) {
+        fprintf(stderr, "*** FAILURE: %s", lama_vm_error(vm));
+        return 255;
+    }
+    // the instance is not destroyed: GC statistics are printed at exit and
+    // read the heap
+    return 0;
+}
@@ -0,0 +1,374 @@
+/*
+ * `iterinter --serve <file.bc> [-s <socket>] [-j <workers>] [-p]` runs one
+ * program for many requests. The bytecode is loaded once and, with `-p`, the
+ * program is run up to its first read or write (see `lama_vm_run_prefix`).
+ * Every request is then handled by a process forked from this image: the
+ * forked worker shares the loaded program and the heap with the server until
+ * it changes them, so a request costs a fork instead of the start of the
+ * interpreter and the load. Workers are forked before requests come, every
+ * worker handles one request and exits, and the server forks a new one in its
+ * place.
+ *
+ * With `-s` requests come to the Unix socket `<socket>`: a connection is one
+ * run of the program, it reads the connection and writes to it. `<workers>`
+ * workers (one per core by default) wait for connections at once.
+ *
+ * Without `-s` requests are read from stdin and answered on stdout one by
+ * one. A request is `<n>\n` followed by the `<n>` bytes of the input of the
+ * program, the answer is `<status> <n>\n` followed by the `<n>` bytes of the
+ * output. The status is `ok`, `failed` (the output ends with the message of
+ * the failure) or `crashed`. One spare worker is kept ready.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../lama-v1.20/runtime/runtime.h"
+#include "driver.h"
+#include "iterinter.h"
+
+// a worker as the server sees it, pipes are used without `-s`
+typedef struct {
+    pid_t pid;
+    // the stdin of the worker
+    int request;
+    // the stdout of the worker
+    int response;
+} worker;
+
+static lama_vm* vm;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int sig) { stop_requested = 1; }
+
+// runs the request with `in` and `out` as stdin and stdout and exits with 0,
+// 1 if the program has failed or 2 if the request could not be run
+static void serve_request(int in, int out) {
+    if (dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0) {
+        _exit(2);
+    }
+    if (in != STDIN_FILENO && in != out) {
+        close(in);
+    }
+    if (out != STDOUT_FILENO) {
+        close(out);
+    }
+    // the server may have read ahead from its own stdin
+    reset_input();
+    if (lama_vm_run(vm) != 0) {
+        printf("*** FAILURE: %s", lama_vm_error(vm));
+        fflush(stdout);
+        _exit(1);
+    }
+    fflush(stdout);
+    // the runtime is not shut down: the heap goes with the process
+    _exit(0);
+}
+
+static pid_t fork_worker(void) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ERROR: serve: unable to fork a worker\n");
+        exit(1);
+    }
+    if (pid == 0) {
+        // workers do not outlive the server
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+    }
+    return pid;
+}
+
+static void report_crash(pid_t pid, int status) {
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM) {
+        fprintf(stderr, "iterinter: worker %d is killed by signal %d\n",
+                (int)pid, WTERMSIG(status));
+    }
+}
+
+/*
+ * UNIX SOCKET
+ */
+
+static void socket_worker(int listen_fd) {
+    int conn;
+    while ((conn = accept(listen_fd, NULL, NULL)) < 0) {
+        if (errno != EINTR && errno != ECONNABORTED) {
+            _exit(2);
+        }
+    }
+    close(listen_fd);
+    serve_request(conn, conn);
+}
+
+static int listen_socket(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: serve: the socket path is too long\n");
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    // a socket left by a previous server
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        perror("ERROR: serve: unable to listen on the socket\n");
+        exit(1);
+    }
+    return fd;
+}
+
+static int serve_socket(const char* path, int workers) {
+    int listen_fd = listen_socket(path);
+    pid_t* pids = malloc(workers * sizeof(pid_t));
+    if (pids == NULL) {
+        perror("ERROR: serve: out of memory\n");
+        exit(1);
+    }
+    for (int w = 0; w < workers; w++) {
+        if ((pids[w] = fork_worker()) == 0) {
+            socket_worker(listen_fd);
+        }
+    }
+    while (!stop_requested) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        report_crash(pid, status);
+        for (int w = 0; w < workers; w++) {
+            if (pids[w] != pid) {
+                continue;
+            }
+            pids[w] = stop_requested ? -1 : fork_worker();
+            if (pids[w] == 0) {
+                socket_worker(listen_fd);
+            }
+        }
+    }
+    for (int w = 0; w < workers; w++) {
+        if (pids[w] > 0) {
+            kill(pids[w], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    close(listen_fd);
+    unlink(path);
+    free(pids);
+    return 0;
+}
+
+/*
+ * STDIN FRAMES
+ */
+
+// the worker with the request and the spare one
+static worker current = {-1, -1, -1}, spare = {-1, -1, -1};
+
+static void close_pipes(worker* w) {
+    if (w->request >= 0) {
+        close(w->request);
+    }
+    if (w->response >= 0) {
+        close(w->response);
+    }
+    w->request = w->response = -1;
+}
+
+static worker fork_pipe_worker(void) {
+    int request[2], response[2];
+    if (pipe(request) != 0 || pipe(response) != 0) {
+        perror("ERROR: serve: unable to create a pipe\n");
+        exit(1);
+    }
+    worker w = {fork_worker(), request[1], response[0]};
+    if (w.pid == 0) {
+        // the input of the other worker ends only when all its writers close
+        close_pipes(&current);
+        close_pipes(&spare);
+        close_pipes(&w);
+        serve_request(request[0], response[1]);
+    }
+    close(request[0]);
+    close(response[1]);
+    // the request is written while the output is read
+    fcntl(w.request, F_SETFL, O_NONBLOCK);
+    return w;
+}
+
+// reads `<n>\n` and the `n` bytes of a request, returns NULL at the end
+static char* read_request(size_t* size) {
+    if (scanf("%zu", size) != 1 || getchar() != '\n') {
+        if (!feof(stdin) && !stop_requested) {
+            fprintf(stderr, "ERROR: serve: malformed request\n");
+        }
+        return NULL;
+    }
+    char* request = malloc(*size + 1);
+    if (request == NULL || fread(request, 1, *size, stdin) != *size) {
+        fprintf(stderr, "ERROR: serve: the request is cut short\n");
+        free(request);
+        return NULL;
+    }
+    return request;
+}
+
+// writes the request to `w` and returns its output, `size` is set to its size
+static char* exchange(worker* w, const char* request, size_t request_size,
+                      size_t* size) {
+    size_t written = 0, capacity = 4096;
+    char* output = malloc(capacity);
+    if (output == NULL) {
+        perror("ERROR: serve: out of memory\n");
+        exit(1);
+    }
+    *size = 0;
+    if (request_size == 0) {
+        close(w->request);
+        w->request = -1;
+    }
+    while (w->response >= 0) {
+        struct pollfd fds[2] = {{w->response, POLLIN, 0},
+                                {w->request, POLLOUT, 0}};
+        if (poll(fds, w->request >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (w->request >= 0 && fds[1].revents != 0) {
+            ssize_t n = write(w->request, request + written,
+                              request_size - written);
+            // the worker may stop reading before the end of the input
+            if (n < 0 ? errno != EAGAIN : (written += n) == request_size) {
+                close(w->request);
+                w->request = -1;
+            }
+        }
+        if (fds[0].revents != 0) {
+            if (*size == capacity) {
+                char* grown = realloc(output, 2 * capacity);
+                if (grown == NULL) {
+                    free(output);
+                    perror("ERROR: serve: out of memory\n");
+                    exit(1);
+                }
+                output = grown;
+                capacity *= 2;
+            }
+            ssize_t n = read(w->response, output + *size, capacity - *size);
+            if (n > 0) {
+                *size += n;
+            } else if (n == 0 || errno != EINTR) {
+                close(w->response);
+                w->response = -1;
+            }
+        }
+    }
+    close_pipes(w);
+    return output;
+}
+
+// the status of the answer, see `serve_request` for the exit codes
+static const char* result_name(int status) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return "ok";
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 1) {
+        return "failed";
+    }
+    return "crashed";
+}
+
+static int serve_stdin(void) {
+    spare = fork_pipe_worker();
+    size_t request_size;
+    char* request;
+    while (!stop_requested && (request = read_request(&request_size)) != NULL) {
+        current = spare;
+        // the next request finds a worker ready while this one is running
+        spare = fork_pipe_worker();
+        size_t size;
+        char* output = exchange(&current, request, request_size, &size);
+        int status;
+        while (waitpid(current.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        report_crash(current.pid, status);
+        printf("%s %zu\n", result_name(status), size);
+        fwrite(output, 1, size, stdout);
+        fflush(stdout);
+        free(output);
+        free(request);
+    }
+    close_pipes(&spare);
+    kill(spare.pid, SIGTERM);
+    waitpid(spare.pid, NULL, 0);
+    return 0;
+}
+
+int run_server(int argc, char* argv[]) {
+    const char* socket_path = NULL;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool prefix = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            prefix = true;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc < 1) {
+        fprintf(stderr, "Usage: iterinter --serve <file.bc> [-s <socket>] "
+                        "[-j <workers>] [-p]\n");
+        return 1;
+    }
+
+    vm = lama_vm_create();
+    if (vm == NULL) {
+        fprintf(stderr, "*** FAILURE: unable to allocate memory.\n");
+        return 255;
+    }
+    if (lama_vm_load_file(vm, argv[0]) != 0 ||
+        (prefix && lama_vm_run_prefix(vm) != 0)) {
+        fprintf(stderr, "*** FAILURE: %s", lama_vm_error(vm));
+        return 255;
+    }
+
+    // a client that goes away fails the writes, not the process
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop = {.sa_handler = request_stop};
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    if (socket_path != NULL) {
+        return serve_socket(socket_path, workers < 1 ? 1 : workers);
+    }
+    return serve_stdin();
+}
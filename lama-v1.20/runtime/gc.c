@@ -3,40 +3,59 @@
 #include "gc.h"
 
 #include "runtime_common.h"
+#include "word_scan.h"
 
 #include <assert.h>
 #include <execinfo.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
 static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
 
 #ifdef DEBUG_VERSION
-size_t cur_id = 0;
+ISOLATE_LOCAL size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+ISOLATE_LOCAL extra_roots_pool extra_roots;
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+ISOLATE_LOCAL gc_algorithm_kind gc_algorithm = DEFAULT_GC_BACKEND;
+
+ISOLATE_LOCAL size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
-#ifdef DEBUG_VERSION
-memory_chunk heap;
-#else
-static memory_chunk heap;
-#endif
+// shared with mark_region.c
+ISOLATE_LOCAL memory_chunk heap;
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
 
+static ISOLATE_LOCAL bool incremental_mode = false;
+static void incremental_step (size_t words);
+static void *los_alloc (size_t words);
+static void  profile_allocation (size_t *header_ptr, size_t words);
+static void *bump_on_existing_heap (size_t size, bool zeroed);
+static void  update_bump_limit (void);
+static inline void push_mark_candidate (void *obj);
+static void push_mark_candidates (size_t *from, size_t *to);
+static void drain_mark_stack (void);
+#ifdef COMPACT_HEADERS
+static size_t compute_forwarding_table (size_t used);
+static void   release_mark_bitmap (void);
+#endif
+
 void handler (int sig) {
   void *array[10];
   int   size;
@@ -48,6 +67,28 @@ void handler (int sig) {
   exit(1);
 }
 
+// takes number of words, memory is zeroed only if `zeroed` is set
+static void *alloc_words (size_t size, bool zeroed) {
+  if (heap_census_requested || heap_snapshot_requested) {
+    heap_dump_safepoint();
+    update_bump_limit();
+  }
+  gc_allocated_words += size;
+  void *p;
+  if (gc_algorithm == GC_COMPACTING && size >= LARGE_OBJECT_MIN_WORDS) {
+    p = los_alloc(size);
+  } else {
+    if (incremental_mode) { incremental_step(size); }
+    p = gc_backend_in_use->alloc_on_existing_heap(size, zeroed);
+    if (!p) {
+      // not enough place in the heap, need to perform GC cycle
+      p = gc_alloc(size);
+    }
+  }
+  if (gc_alloc_profiling) { profile_allocation(p, size); }
+  return p;
+}
+
 void *alloc (size_t size) {
 #ifdef DEBUG_VERSION
   ++cur_id;
@@ -57,12 +98,17 @@ void *alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "allocation of size %zu words (%zu bytes): ", size, bytes_sz);
 #endif
-  void *p = gc_alloc_on_existing_heap(size);
-  if (!p) {
-    // not enough place in the heap, need to perform GC cycle
-    p = gc_alloc(size);
-  }
-  return p;
+  return alloc_words(size, true);
+}
+
+void *alloc_uninitialized (size_t words) {
+#ifdef DEBUG_VERSION
+  ++cur_id;
+#endif
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "uninitialized allocation of size %zu words: ", words);
+#endif
+  return alloc_words(words, false);
 }
 
 #ifdef FULL_INVARIANT_CHECKS
@@ -172,31 +218,703 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
-void *gc_alloc_on_existing_heap (size_t size) {
+// ============================================================================
+//                  Incremental marking and pause statistics
+// ============================================================================
+// In incremental mode (LAMA_GC_INCREMENTAL) marking is split into slices which
+// are run on allocation. The invariant is kept by a snapshot-at-the-beginning
+// barrier: a cycle starts by greying all roots, and every pointer overwritten in
+// a heap object while the cycle is running is greyed (see `gc_write_barrier`).
+// Objects allocated during the cycle are allocated black. Once there are no grey
+// objects left, every object reachable at the snapshot is marked, and the
+// compaction is deferred until the heap is exhausted.
+typedef enum { GC_IDLE, GC_MARKING, GC_MARKED } incremental_gc_state;
+
+ISOLATE_LOCAL bool                        gc_marking_in_progress = false;
+static ISOLATE_LOCAL incremental_gc_state incremental_state      = GC_IDLE;
+// value of the mark bit of freshly allocated objects
+ISOLATE_LOCAL size_t gc_allocation_color = 0;
+// marking starts when the heap current pointer reaches this point
+static ISOLATE_LOCAL size_t *marking_trigger = NULL;
+static ISOLATE_LOCAL size_t  allocated_since_slice = 0;
+static ISOLATE_LOCAL long    slice_budget_us       = INCREMENTAL_SLICE_BUDGET_US;
+
+static ISOLATE_LOCAL void  **grey_stack    = NULL;
+static ISOLATE_LOCAL size_t  grey_size     = 0;
+static ISOLATE_LOCAL size_t  grey_capacity = 0;
+
+static ISOLATE_LOCAL pause_histogram pauses;
+// exit handlers are registered once per process, the flags are shared by isolates
+static bool pause_histogram_printer_registered = false;
+
+static struct timespec current_time (void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t;
+}
+
+static long elapsed_us (struct timespec start) {
+  struct timespec now = current_time();
+  return (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void pause_end (struct timespec start) {
+  size_t us     = elapsed_us(start);
+  size_t bucket = 0;
+  while (bucket + 1 < PAUSE_HISTOGRAM_BUCKETS && (us >> bucket) != 0) { ++bucket; }
+  ++pauses.buckets[bucket];
+  ++pauses.count;
+  pauses.total_us += us;
+  pauses.max_us = MAX(pauses.max_us, us);
+}
+
+const pause_histogram *gc_pause_histogram (void) { return &pauses; }
+
+void print_pause_histogram (FILE *f) {
+  fprintf(f,
+          "GC pauses: %zu, total %zu us, max %zu us\n",
+          pauses.count,
+          pauses.total_us,
+          pauses.max_us);
+  for (size_t i = 0; i < PAUSE_HISTOGRAM_BUCKETS; ++i) {
+    if (pauses.buckets[i] == 0) { continue; }
+    fprintf(f, "  < %8zu us: %zu\n", (size_t)1 << i, pauses.buckets[i]);
+  }
+}
+
+static void print_pause_histogram_at_exit (void) { print_pause_histogram(stderr); }
+
+// ============================================================================
+//                            GC statistics
+// ============================================================================
+ISOLATE_LOCAL size_t               gc_allocated_words = 0;
+static ISOLATE_LOCAL gc_statistics stats;
+static ISOLATE_LOCAL bool          stats_json = false;
+static bool                        stats_printer_registered = false;
+static const char                 *gc_phase_names[GC_PHASES] = {
+    "mark", "compute_locations", "update_references", "physically_relocate", "mremap"};
+
+// page faults of the process at start-up
+static ISOLATE_LOCAL size_t initial_minor_faults = 0, initial_major_faults = 0;
+
+static void page_faults (size_t *minor, size_t *major) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  *minor = usage.ru_minflt;
+  *major = usage.ru_majflt;
+}
+
+static long elapsed_ns (struct timespec start) {
+  struct timespec now = current_time();
+  return (now.tv_sec - start.tv_sec) * 1000000000 + (now.tv_nsec - start.tv_nsec);
+}
+
+// adds the time since `*start` to the phase and restarts the clock for the next one
+static void phase_end (gc_phase phase, struct timespec *start) {
+  stats.phase_ns[phase] += elapsed_ns(*start);
+  *start = current_time();
+}
+
+void gc_stats_collection_done (size_t live_words) {
+  ++stats.collections;
+  stats.live_words     = live_words;
+  stats.max_live_words = MAX(stats.max_live_words, live_words);
+}
+
+size_t gc_heap_words_after_collection (size_t live_words, size_t request_words) {
+  // the free space left after the request is at least as large as the live data, so the next
+  // collection comes after at least as much allocation as it has to trace
+  return MAX(live_words * EXTRA_ROOM_HEAP_COEFFICIENT + request_words, MINIMUM_HEAP_CAPACITY);
+}
+
+const gc_statistics *gc_stats (void) {
+  stats.allocated_words = gc_allocated_words;
+  stats.heap_words      = heap.size;
+  stats.max_heap_words  = MAX(stats.max_heap_words, heap.size);
+  stats.pauses          = pauses;
+  page_faults(&stats.minor_faults, &stats.major_faults);
+  stats.minor_faults -= initial_minor_faults;
+  stats.major_faults -= initial_major_faults;
+  return &stats;
+}
+
+void print_gc_stats (FILE *f, bool json) {
+  const gc_statistics *s = gc_stats();
+  if (json) {
+    fprintf(f,
+            "{\"backend\": \"%s\", \"collections\": %zu, \"allocated_words\": %zu, "
+            "\"live_words\": %zu, \"max_live_words\": %zu, \"heap_words\": %zu, "
+            "\"max_heap_words\": %zu, \"minor_faults\": %zu, \"major_faults\": %zu, "
+            "\"gc_minor_faults\": %zu, \"gc_major_faults\": %zu, \"phase_ns\": {",
+            gc_backend_in_use->name,
+            s->collections,
+            s->allocated_words,
+            s->live_words,
+            s->max_live_words,
+            s->heap_words,
+            s->max_heap_words,
+            s->minor_faults,
+            s->major_faults,
+            s->gc_minor_faults,
+            s->gc_major_faults);
+    for (size_t i = 0; i < GC_PHASES; ++i) {
+      fprintf(f, "%s\"%s\": %zu", i == 0 ? "" : ", ", gc_phase_names[i], s->phase_ns[i]);
+    }
+    fprintf(f,
+            "}, \"pauses\": {\"count\": %zu, \"total_us\": %zu, \"max_us\": %zu, \"buckets\": [",
+            s->pauses.count,
+            s->pauses.total_us,
+            s->pauses.max_us);
+    for (size_t i = 0; i < PAUSE_HISTOGRAM_BUCKETS; ++i) {
+      fprintf(f, "%s%zu", i == 0 ? "" : ", ", s->pauses.buckets[i]);
+    }
+    fprintf(f, "]}}\n");
+    return;
+  }
+  fprintf(f, "GC backend: %s, collections: %zu\n", gc_backend_in_use->name, s->collections);
+  fprintf(f, "  allocated: %zu words\n", s->allocated_words);
+  fprintf(f, "  live after last GC: %zu words, max %zu words\n", s->live_words, s->max_live_words);
+  fprintf(f, "  heap: %zu words, max %zu words\n", s->heap_words, s->max_heap_words);
+  fprintf(f,
+          "  page faults: %zu minor, %zu major, of them in GC: %zu minor, %zu major\n",
+          s->minor_faults,
+          s->major_faults,
+          s->gc_minor_faults,
+          s->gc_major_faults);
+  for (size_t i = 0; i < GC_PHASES; ++i) {
+    fprintf(f, "  %-20s %10zu us\n", gc_phase_names[i], s->phase_ns[i] / 1000);
+  }
+  print_pause_histogram(f);
+}
+
+static void print_gc_stats_at_exit (void) { print_gc_stats(stderr, stats_json); }
+
+// ============================================================================
+//                       Allocation-site profiling
+// ============================================================================
+// Sites are found by an open addressing hash table of indices into `sites`.
+typedef struct {
+  size_t *header_ptr;
+  size_t  site_index;
+} alloc_record;
+
+ISOLATE_LOCAL bool   gc_alloc_profiling = false;
+ISOLATE_LOCAL size_t gc_alloc_site      = 0;
+
+static ISOLATE_LOCAL alloc_site_stats *sites            = NULL;
+static ISOLATE_LOCAL size_t            sites_count      = 0;
+static ISOLATE_LOCAL size_t           *site_slots       = NULL;   // index + 1, 0 is an empty slot
+static ISOLATE_LOCAL size_t            site_slots_count = 0;
+static ISOLATE_LOCAL alloc_site_stats *sorted_sites     = NULL;
+static ISOLATE_LOCAL alloc_record     *records          = NULL;
+static ISOLATE_LOCAL size_t            records_count    = 0;
+static ISOLATE_LOCAL size_t            records_capacity = 0;
+
+static inline size_t site_slot (size_t site) {
+  // multiplicative hashing, `site_slots_count` is a power of two
+  return (site * 2654435769u) & (site_slots_count - 1);
+}
+
+static void grow_site_slots (void) {
+  free(site_slots);
+  site_slots_count = MAX(2 * site_slots_count, 2 * ALLOC_PROFILE_INIT_SITES);
+  site_slots       = calloc(site_slots_count, sizeof(size_t));
+  sites            = realloc(sites, site_slots_count / 2 * sizeof(alloc_site_stats));
+  if (site_slots == NULL || sites == NULL) {
+    perror("ERROR: grow_site_slots: unable to grow the table of allocation sites\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < sites_count; ++i) {
+    size_t slot = site_slot(sites[i].site);
+    while (site_slots[slot] != 0) { slot = (slot + 1) & (site_slots_count - 1); }
+    site_slots[slot] = i + 1;
+  }
+}
+
+static size_t site_index (size_t site) {
+  // the table is kept at most half full
+  if (2 * (sites_count + 1) > site_slots_count) { grow_site_slots(); }
+  size_t slot = site_slot(site);
+  for (; site_slots[slot] != 0; slot = (slot + 1) & (site_slots_count - 1)) {
+    if (sites[site_slots[slot] - 1].site == site) { return site_slots[slot] - 1; }
+  }
+  sites[sites_count] = (alloc_site_stats){.site = site};
+  site_slots[slot]   = ++sites_count;
+  return sites_count - 1;
+}
+
+static void profile_allocation (size_t *header_ptr, size_t words) {
+  size_t i = site_index(gc_alloc_site);
+  ++sites[i].count;
+  sites[i].words += words;
+  // objects are followed through collections only by the compacting collector
+  if (gc_algorithm != GC_COMPACTING) { return; }
+  if (records_count == records_capacity) {
+    records_capacity = MAX(2 * records_capacity, ALLOC_PROFILE_INIT_RECORDS);
+    records          = realloc(records, records_capacity * sizeof(alloc_record));
+    if (records == NULL) {
+      perror("ERROR: profile_allocation: unable to grow the table of objects\n");
+      exit(1);
+    }
+  }
+  records[records_count++] = (alloc_record){.header_ptr = header_ptr, .site_index = i};
+}
+
+// called by the compacting collector after `mremap`, while marks and forward addresses are valid:
+// credits the sites of the marked objects and moves their records to the new locations
+static void profile_survivors (memory_chunk *old_heap) {
+  for (size_t i = 0; i < sites_count; ++i) { sites[i].live = 0; }
+  size_t kept = 0;
+  for (size_t i = 0; i < records_count; ++i) {
+    alloc_record r       = records[i];
+    bool         in_heap = r.header_ptr >= old_heap->begin && r.header_ptr < old_heap->current;
+    // the old mapping may be gone, objects of the heap are read at their place in the new one
+    if (in_heap) { r.header_ptr = heap.begin + (r.header_ptr - old_heap->begin); }
+    void *obj = get_object_content_ptr(r.header_ptr);
+    if (!is_marked(obj)) { continue; }
+    ++sites[r.site_index].survivals;
+    ++sites[r.site_index].live;
+    if (in_heap) {
+      r.header_ptr = heap.begin + ((size_t *)get_forward_address(obj) - old_heap->begin);
+    }
+    records[kept++] = r;
+  }
+  records_count = kept;
+}
+
+static int compare_sites_by_words (const void *a, const void *b) {
+  size_t wa = ((const alloc_site_stats *)a)->words, wb = ((const alloc_site_stats *)b)->words;
+  return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+const alloc_site_stats *gc_alloc_profile (size_t *count) {
+  sorted_sites = realloc(sorted_sites, MAX(sites_count, 1) * sizeof(alloc_site_stats));
+  if (sorted_sites == NULL) {
+    perror("ERROR: gc_alloc_profile: unable to allocate the report\n");
+    exit(1);
+  }
+  if (sites_count > 0) { memcpy(sorted_sites, sites, sites_count * sizeof(alloc_site_stats)); }
+  qsort(sorted_sites, sites_count, sizeof(alloc_site_stats), compare_sites_by_words);
+  *count = sites_count;
+  return sorted_sites;
+}
+
+static void init_alloc_profile (void) {
+  gc_alloc_profiling = getenv("LAMA_ALLOC_PROFILE") != NULL;
+}
+
+// LAMA_GC_STATS=text or LAMA_GC_STATS=json
+static void init_gc_stats (void) {
+  page_faults(&initial_minor_faults, &initial_major_faults);
+  char *env = getenv("LAMA_GC_STATS");
+  if (env == NULL) { return; }
+  if (strcmp(env, "json") != 0 && strcmp(env, "text") != 0) {
+    fprintf(stderr, "ERROR: unknown LAMA_GC_STATS value '%s'\n", env);
+    exit(1);
+  }
+  stats_json = strcmp(env, "json") == 0;
+  if (!__atomic_test_and_set(&stats_printer_registered, __ATOMIC_RELAXED)) {
+    atexit(print_gc_stats_at_exit);
+  }
+}
+
+static void grey_push (void *obj) {
+  if (grey_size == grey_capacity) {
+    grey_capacity = MAX(2 * grey_capacity, GREY_STACK_INIT_CAPACITY);
+    grey_stack    = realloc(grey_stack, grey_capacity * sizeof(void *));
+    if (grey_stack == NULL) {
+      perror("ERROR: grey_push: unable to grow the mark stack\n");
+      exit(1);
+    }
+  }
+  grey_stack[grey_size++] = obj;
+}
+
+void gc_shade (void *obj) {
+  if (!gc_marking_in_progress || !is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
+  mark_object(obj);
+  grey_push(obj);
+}
+
+// scans grey objects until there are none left or the time budget is exceeded,
+// returns whether marking is finished
+static bool incremental_mark (long budget_us) {
+  struct timespec start = current_time();
+  size_t          steps = 0;
+  while (grey_size > 0) {
+    void *obj = grey_stack[--grey_size];
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      gc_shade(*(void **)it.cur_field);
+    }
+    if (++steps % INCREMENTAL_STEPS_PER_CLOCK_CHECK == 0 && elapsed_us(start) >= budget_us) {
+      break;
+    }
+  }
+  if (grey_size == 0) {
+    // every object reachable at the snapshot is marked, barrier is not needed anymore
+    incremental_state      = GC_MARKED;
+    gc_marking_in_progress = false;
+    return true;
+  }
+  return false;
+}
+
+static void start_incremental_cycle (void) {
+  incremental_state      = GC_MARKING;
+  gc_marking_in_progress = true;
+  gc_allocation_color    = 1;
+  allocated_since_slice  = 0;
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    gc_shade(*(void **)p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) { gc_shade(*extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    gc_shade(*(void **)p);
+  }
+#endif
+}
+
+// called after each compaction: the next cycle starts once half of the free space is used
+static void finish_incremental_cycle (void) {
+  incremental_state      = GC_IDLE;
+  gc_marking_in_progress = false;
+  gc_allocation_color    = 0;
+  grey_size              = 0;
+  marking_trigger        = heap.current + (heap.end - heap.current) / 2;
+}
+
+static void incremental_step (size_t words) {
+  switch (incremental_state) {
+    case GC_IDLE:
+      if (heap.current + words >= marking_trigger) {
+        struct timespec start = current_time();
+        start_incremental_cycle();
+        pause_end(start);
+      }
+      break;
+    case GC_MARKING:
+      allocated_since_slice += words;
+      if (allocated_since_slice >= INCREMENTAL_SLICE_WORDS) {
+        struct timespec start = current_time();
+        allocated_since_slice = 0;
+        incremental_mark(slice_budget_us);
+        pause_end(start);
+      }
+      break;
+    case GC_MARKED: break;
+  }
+}
+
+static void init_incremental_mode (void) {
+  char *env        = getenv("LAMA_GC_INCREMENTAL");
+  // mark-region collector has no write barrier support
+  incremental_mode = env != NULL && atoi(env) != 0 && gc_algorithm == GC_COMPACTING;
+  env              = getenv("LAMA_GC_SLICE_US");
+  if (env != NULL) { slice_budget_us = MAX(atol(env), 1); }
+  if (getenv("LAMA_GC_PAUSE_HISTOGRAM") != NULL
+      && !__atomic_test_and_set(&pause_histogram_printer_registered, __ATOMIC_RELAXED)) {
+    atexit(print_pause_histogram_at_exit);
+  }
+  finish_incremental_cycle();
+}
+
+// ============================================================================
+//                          Heap memory backing
+// ============================================================================
+ISOLATE_LOCAL heap_pages_kind heap_pages    = HEAP_PAGES_SMALL;
+ISOLATE_LOCAL bool            heap_populate = false;
+
+static const char *heap_pages_names[] = {"small", "hugepage", "hugetlb"};
+
+size_t heap_round_words (size_t words) {
+  if (heap_pages == HEAP_PAGES_SMALL) { return words; }
+  size_t page_words = BYTES_TO_WORDS(HUGE_PAGE_BYTES);
+  return (words + page_words - 1) / page_words * page_words;
+}
+
+static size_t *map_anonymous (size_t bytes, int flags) {
+  size_t *p = mmap(NULL,
+                   bytes,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | flags,
+                   -1,
+                   0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+size_t *heap_map (size_t words) {
+  size_t  bytes    = WORDS_TO_BYTES(words);
+  int     populate = heap_populate ? MAP_POPULATE : 0;
+  size_t *p        = NULL;
+  if (heap_pages == HEAP_PAGES_HUGETLB) { p = map_anonymous(bytes, MAP_HUGETLB | populate); }
+  if (p == NULL && heap_pages != HEAP_PAGES_SMALL) {
+    // transparent huge pages are used only by 2MB-aligned ranges, so the mapping is trimmed
+    char *raw = (char *)map_anonymous(bytes + HUGE_PAGE_BYTES, 0);
+    if (raw != NULL) {
+      char *aligned = (char *)(((size_t)raw + HUGE_PAGE_BYTES - 1) & ~(size_t)(HUGE_PAGE_BYTES - 1));
+      if (aligned > raw) { munmap(raw, aligned - raw); }
+      munmap(aligned + bytes, raw + HUGE_PAGE_BYTES - aligned);
+      p = (size_t *)aligned;
+      heap_prepare_range(p, bytes);
+    }
+  } else if (p == NULL) {
+    p = map_anonymous(bytes, populate);
+  }
+  if (p == NULL) {
+    perror("ERROR: heap_map: mmap failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+void heap_prepare_range (void *begin, size_t bytes) {
+  if (bytes == 0) { return; }
+  if (heap_pages != HEAP_PAGES_SMALL) { madvise(begin, bytes, MADV_HUGEPAGE); }
+  if (!heap_populate) { return; }
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(begin, bytes, MADV_POPULATE_WRITE) == 0) { return; }
+#endif
+  // the range has never been used, so it is zero and writing zeroes keeps it intact
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (char *p = (char *)begin; p < (char *)begin + bytes; p += page) { *(volatile char *)p = 0; }
+}
+
+static void init_heap_pages (void) {
+  char *env  = getenv("LAMA_GC_PAGES");
+  heap_pages = HEAP_PAGES_SMALL;
+  if (env != NULL) {
+    size_t n = sizeof(heap_pages_names) / sizeof(heap_pages_names[0]), i = 0;
+    for (; i < n && strcmp(env, heap_pages_names[i]) != 0; ++i) { }
+    if (i == n) {
+      fprintf(stderr, "ERROR: unknown LAMA_GC_PAGES value '%s'\n", env);
+      exit(1);
+    }
+    heap_pages = (heap_pages_kind)i;
+  }
+  env           = getenv("LAMA_GC_POPULATE");
+  heap_populate = env != NULL && atoi(env) != 0;
+}
+
+// ============================================================================
+//                          Large object space
+// ============================================================================
+// Header pointers of large objects are kept sorted, so that a pointer can be
+// checked by a binary search. The range check in front of it rejects almost all
+// pointers that are not large objects.
+static ISOLATE_LOCAL size_t **large_objects          = NULL;
+static ISOLATE_LOCAL size_t   large_objects_count    = 0;
+static ISOLATE_LOCAL size_t   large_objects_capacity = 0;
+static ISOLATE_LOCAL size_t  *large_objects_min = NULL, *large_objects_max = NULL;
+static ISOLATE_LOCAL size_t   large_allocated_words = 0;
+static ISOLATE_LOCAL size_t   large_live_words      = 0;
+#ifdef COMPACT_HEADERS
+// large objects have no room for the mark bit as well, their marks are kept next to the table
+static ISOLATE_LOCAL bool *large_marks = NULL;
+#endif
+
+static inline size_t large_object_bytes (size_t *header_ptr) {
+  // the whole chunk is released, the object occupies its beginning
+  return WORDS_TO_BYTES(BYTES_TO_WORDS(obj_size_header_ptr(header_ptr)));
+}
+
+static size_t large_object_index (size_t *header_ptr) {
+  size_t lo = 0, hi = large_objects_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (large_objects[mid] < header_ptr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+bool is_large_object (const void *obj) {
+  size_t *header_ptr = (size_t *)((char *)obj - DATA_HEADER_SZ);
+  if (header_ptr < large_objects_min || header_ptr > large_objects_max) { return false; }
+  size_t i = large_object_index(header_ptr);
+  return i < large_objects_count && large_objects[i] == header_ptr;
+}
+
+#ifdef COMPACT_HEADERS
+static bool *large_object_mark (void *obj) {
+  return &large_marks[large_object_index((size_t *)TO_DATA(obj))];
+}
+#endif
+
+static void update_large_objects_range (void) {
+  large_objects_min = large_objects_count > 0 ? large_objects[0] : NULL;
+  large_objects_max = large_objects_count > 0 ? large_objects[large_objects_count - 1] : NULL;
+}
+
+static void *los_alloc (size_t words) {
+  // large objects do not fill the heap, so they have to trigger collections by themselves
+  if (large_allocated_words >= MAX(LARGE_OBJECT_GC_TRIGGER_WORDS, large_live_words)) {
+    gc_alloc(0);
+  }
+  size_t *p = mmap(NULL,
+                   WORDS_TO_BYTES(words),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                   -1,
+                   0);
+  if (p == MAP_FAILED) {
+    perror("ERROR: los_alloc: mmap failed\n");
+    exit(1);
+  }
+  if (large_objects_count == large_objects_capacity) {
+    large_objects_capacity = MAX(2 * large_objects_capacity, 16);
+    large_objects = realloc(large_objects, large_objects_capacity * sizeof(size_t *));
+#ifdef COMPACT_HEADERS
+    large_marks = realloc(large_marks, large_objects_capacity * sizeof(bool));
+    if (large_marks == NULL) {
+      perror("ERROR: los_alloc: unable to grow the table of large objects\n");
+      exit(1);
+    }
+#endif
+    if (large_objects == NULL) {
+      perror("ERROR: los_alloc: unable to grow the table of large objects\n");
+      exit(1);
+    }
+  }
+  size_t i = large_object_index(p);
+  memmove(large_objects + i + 1, large_objects + i, (large_objects_count - i) * sizeof(size_t *));
+  large_objects[i] = p;
+#ifdef COMPACT_HEADERS
+  memmove(large_marks + i + 1, large_marks + i, (large_objects_count - i) * sizeof(bool));
+  large_marks[i] = false;
+#endif
+  ++large_objects_count;
+  update_large_objects_range();
+  large_allocated_words += words;
+  // fresh mapping is already zeroed
+  return p;
+}
+
+// unmaps large objects that are not marked, unmarks the others
+static void los_sweep (void) {
+  size_t live = 0;
+  large_live_words = 0;
+  for (size_t i = 0; i < large_objects_count; ++i) {
+    size_t *header_ptr = large_objects[i];
+#ifdef COMPACT_HEADERS
+    // the table is being compacted, so the mark can't be looked up by the object address
+    bool marked = large_marks[i];
+#else
+    void *obj    = get_object_content_ptr(header_ptr);
+    bool  marked = is_marked(obj);
+    if (marked) { unmark_object(obj); }
+#endif
+    if (marked) {
+      large_live_words += BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+#ifdef COMPACT_HEADERS
+      large_marks[live] = false;
+#endif
+      large_objects[live++] = header_ptr;
+    } else {
+      munmap(header_ptr, large_object_bytes(header_ptr));
+    }
+  }
+  large_objects_count   = live;
+  large_allocated_words = 0;
+  update_large_objects_range();
+}
+
+static void los_release (void) {
+  for (size_t i = 0; i < large_objects_count; ++i) {
+    munmap(large_objects[i], large_object_bytes(large_objects[i]));
+  }
+  free(large_objects);
+#ifdef COMPACT_HEADERS
+  free(large_marks);
+  large_marks = NULL;
+#endif
+  large_objects          = NULL;
+  large_objects_count    = 0;
+  large_objects_capacity = 0;
+  large_allocated_words  = 0;
+  large_live_words       = 0;
+  update_large_objects_range();
+}
+
+// Memory above `heap.current` is zero up to the offset `heap_dirty_end` (in words): fresh pages of
+// mmap and mremap are zeroed by the kernel, so only the space that was used before has to be cleared.
+static ISOLATE_LOCAL size_t heap_dirty_end = 0;
+ISOLATE_LOCAL size_t       *gc_bump_limit  = NULL;
+
+#ifdef DEBUG_VERSION
+static ISOLATE_LOCAL bool inline_allocation_in_tests = false;
+#endif
+
+static void update_bump_limit (void) {
+#ifdef DEBUG_VERSION
+  // every allocation has to get an id, unless a test of the inline path asks for it
+  gc_bump_limit = inline_allocation_in_tests && gc_algorithm != GC_MARK_REGION ? heap.end : NULL;
+#else
+  // both the compacting and the semispace heaps are filled by a bump pointer up to `heap.end`
+  gc_bump_limit =
+      gc_algorithm != GC_MARK_REGION && !incremental_mode && !gc_alloc_profiling ? heap.end : NULL;
+#endif
+}
+
+static void *bump_on_existing_heap (size_t size, bool zeroed) {
   if (heap.current + size <= heap.end) {
-    void *p = (void *)heap.current;
+    size_t *p = heap.current;
     heap.current += size;
-    memset(p, 0, size * sizeof(size_t));
+    size_t *dirty_end = heap.begin + heap_dirty_end;
+    if (zeroed && p < dirty_end) { memset(p, 0, WORDS_TO_BYTES(MIN(size, dirty_end - p))); }
     return p;
   }
   return NULL;
 }
 
+void *gc_alloc_on_existing_heap (size_t size) { return bump_on_existing_heap(size, true); }
+
 void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
+  struct timespec pause_start = current_time();
+  size_t          minor_before, major_before, minor_after, major_after;
+  page_faults(&minor_before, &major_before);
+  void *p = gc_backend_in_use->collect_and_alloc(size);
+  page_faults(&minor_after, &major_after);
+  stats.gc_minor_faults += minor_after - minor_before;
+  stats.gc_major_faults += major_after - major_before;
+  update_bump_limit();
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "===============================GC cycle has finished\n");
+#endif
+  pause_end(pause_start);
+  return p;
+}
+
+static void *compacting_collect_and_alloc (size_t size) {
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_before = print_stack_content("stack-dump-before-compaction");
   FILE *heap_before  = print_objects_traversal("before-mark", 0);
   fclose(heap_before);
 #endif
-  mark_phase();
+  struct timespec mark_start = current_time();
+  switch (incremental_state) {
+    case GC_IDLE: mark_phase(); break;
+    // the rest of the marking work has to be done right now
+    case GC_MARKING: incremental_mark(LONG_MAX); break;
+    // marking has been finished by slices, only compaction was deferred
+    case GC_MARKED: break;
+  }
+  phase_end(GC_PHASE_MARK, &mark_start);
 #ifdef FULL_INVARIANT_CHECKS
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
   compact_phase(size);
+  los_sweep();
+  gc_stats_collection_done(heap.current - heap.begin + large_live_words);
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -216,16 +934,12 @@ void *gc_alloc (size_t size) {
   fclose(heap_before_compaction);
   fclose(heap_after_compaction);
 #endif
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "===============================GC cycle has finished\n");
-#endif
+  finish_incremental_cycle();
   return gc_alloc_on_existing_heap(size);
 }
 
 static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
-  }
+  push_mark_candidates((size_t *)(__gc_stack_top + 4), (size_t *)__gc_stack_bottom);
 }
 
 void mark_phase (void) {
@@ -251,17 +965,22 @@ void mark_phase (void) {
 #endif
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "scan_global_area has finished\n");
+#endif
+  // all roots are on the mark stack now
+  drain_mark_stack();
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has finished\n");
 #endif
 }
 
 void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
+  struct timespec phase_start = current_time();
+  size_t          live_size   = compute_locations();
+  phase_end(GC_PHASE_COMPUTE_LOCATIONS, &phase_start);
 
   // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
-  size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
+  size_t next_heap_size        = gc_heap_words_after_collection(live_size, additional_size);
+  size_t next_heap_pseudo_size = heap_round_words(MAX(next_heap_size, heap.size));
 
   memory_chunk old_heap = heap;
   heap.begin            = mremap(
@@ -273,22 +992,120 @@ void compact_phase (size_t additional_size) {
   heap.end     = heap.begin + next_heap_pseudo_size;
   heap.size    = next_heap_pseudo_size;
   heap.current = heap.begin + (old_heap.current - old_heap.begin);
+  heap_prepare_range(heap.begin + old_heap.size, WORDS_TO_BYTES(heap.size - old_heap.size));
+  phase_end(GC_PHASE_MREMAP, &phase_start);
+
+  if (gc_alloc_profiling) { profile_survivors(&old_heap); }
 
   update_references(&old_heap);
+  phase_end(GC_PHASE_UPDATE_REFERENCES, &phase_start);
   physically_relocate(&old_heap);
+  phase_end(GC_PHASE_RELOCATE, &phase_start);
+
+  // everything up to the old top of the heap may contain garbage now
+  heap_dirty_end = MAX(heap_dirty_end, (size_t)(old_heap.current - old_heap.begin));
+  heap.current   = heap.begin + live_size;
+  update_bump_limit();
+#ifdef COMPACT_HEADERS
+  resize_mark_bitmap(heap.size);
+#endif
+}
 
-  heap.current = heap.begin + live_size;
+// ============================================================================
+//                        Parallel compaction support
+// ============================================================================
+// The heap is split into regions that start at object boundaries. All offsets
+// are in words relative to the heap beginning, so regions stay meaningful after
+// `mremap` moves the heap. A region is compacted exactly as the sequential
+// algorithm would do it; the only difference is that its first live object is
+// placed at `dest` (the prefix sum of live words of all preceding regions)
+// instead of being found by a running pointer. Hence the result is identical
+// to the single-threaded one.
+typedef struct {
+  size_t       begin;   // offset of the first object header of the region
+  size_t       end;     // offset right after the last object of the region
+  size_t       live;    // number of live words in the region
+  size_t       dest;    // offset where the first live object of the region moves to
+  volatile int relocated;
+} compaction_region;
+
+static ISOLATE_LOCAL compaction_region regions[MAX_COMPACTION_REGIONS];
+static ISOLATE_LOCAL size_t            regions_count   = 1;
+static ISOLATE_LOCAL size_t            gc_threads      = 1;
+static ISOLATE_LOCAL size_t            parallel_min_sz = PARALLEL_COMPACTION_MIN_WORDS;
+
+typedef struct {
+  void (*process_region) (void *ctx, compaction_region *r);
+  void        *ctx;
+  volatile int next_region;
+} parallel_job;
+
+static void *parallel_worker (void *arg) {
+  parallel_job *job = (parallel_job *)arg;
+  while (true) {
+    int i = __atomic_fetch_add(&job->next_region, 1, __ATOMIC_RELAXED);
+    if (i >= (int)regions_count) { break; }
+    job->process_region(job->ctx, &regions[i]);
+  }
+  return NULL;
 }
 
-size_t compute_locations () {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC compute_locations started\n");
-#endif
-  size_t       *free_ptr  = heap.begin;
-  heap_iterator scan_iter = heap_begin_iterator();
+// runs `process_region` over all regions; regions are taken in increasing order, the calling thread
+// participates as well
+static void run_on_regions (void (*process_region) (void *, compaction_region *), void *ctx) {
+  parallel_job job = {.process_region = process_region, .ctx = ctx, .next_region = 0};
+  pthread_t    workers[GC_MAX_THREADS];
+  size_t       n_workers = MIN(gc_threads, regions_count) - 1, started = 0;
+
+  for (; started < n_workers; ++started) {
+    // if a thread cannot be created, the remaining work is simply done by fewer threads
+    if (pthread_create(&workers[started], NULL, parallel_worker, &job) != 0) { break; }
+  }
+  parallel_worker(&job);
+  for (size_t i = 0; i < started; ++i) { pthread_join(workers[i], NULL); }
+}
+
+// splits the heap into regions of roughly equal size and counts live words in each of them,
+// returns total number of live words
+static size_t partition_heap (size_t n_regions) {
+  size_t used   = heap.current - heap.begin;
+  size_t target = used / n_regions + 1;
+  size_t cur    = 0;
 
-  for (; !heap_is_done_iterator(&scan_iter); heap_next_obj_iterator(&scan_iter)) {
-    void *header_ptr  = scan_iter.current;
+  regions[0].begin = 0;
+  regions[0].live  = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    size_t offset = it.current - heap.begin;
+    if (offset >= (cur + 1) * target && cur + 1 < n_regions) {
+      regions[cur].end = offset;
+      ++cur;
+      regions[cur].begin = offset;
+      regions[cur].live  = 0;
+    }
+    void *obj_content = get_object_content_ptr(it.current);
+    if (is_marked(obj_content)) {
+      regions[cur].live += BYTES_TO_WORDS(obj_size_header_ptr(it.current));
+    }
+  }
+  regions[cur].end = used;
+  regions_count    = cur + 1;
+
+  size_t live = 0;
+  for (size_t i = 0; i < regions_count; ++i) {
+    regions[i].dest      = live;
+    regions[i].relocated = 0;
+    live += regions[i].live;
+  }
+  return live;
+}
+
+static void compute_region_locations (void *ctx, compaction_region *r) {
+  size_t *heap_begin = (size_t *)ctx;
+  size_t *free_ptr   = heap_begin + r->dest;
+  for (heap_iterator it = {.current = heap_begin + r->begin}; it.current < heap_begin + r->end;
+       heap_next_obj_iterator(&it)) {
+    void *header_ptr  = it.current;
     void *obj_content = get_object_content_ptr(header_ptr);
     if (is_marked(obj_content)) {
       size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
@@ -297,31 +1114,88 @@ size_t compute_locations () {
       free_ptr += sz;
     }
   }
+  r->live = free_ptr - (heap_begin + r->dest);
+}
+
+static bool use_parallel_compaction (void) {
+  return gc_threads > 1 && (size_t)(heap.current - heap.begin) >= parallel_min_sz;
+}
+
+size_t compute_locations () {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC compute_locations started\n");
+#endif
+  size_t live_size;
+
+  if (use_parallel_compaction()) {
+    live_size = partition_heap(MIN(gc_threads * REGIONS_PER_THREAD, MAX_COMPACTION_REGIONS));
+#ifndef COMPACT_HEADERS
+    run_on_regions(compute_region_locations, heap.begin);
+#endif
+  } else {
+    // the whole heap is a single region, it is processed by the calling thread
+    regions_count        = 1;
+    regions[0].begin     = 0;
+    regions[0].end       = heap.current - heap.begin;
+    regions[0].dest      = 0;
+    regions[0].relocated = 0;
+#ifndef COMPACT_HEADERS
+    compute_region_locations(heap.begin, &regions[0]);
+    live_size = regions[0].live;
+#endif
+  }
+#ifdef COMPACT_HEADERS
+  // a sequential popcount over the bitmap is cheap compared to walking the objects
+  live_size = compute_forwarding_table(heap.current - heap.begin);
+  if (regions_count == 1) { regions[0].live = live_size; }
+#endif
 
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations finished\n");
 #endif
   // it will return number of words
-  return free_ptr - heap.begin;
+  return live_size;
+}
+
+static inline void fix_pointer (memory_chunk *old_heap, size_t *ptr) {
+  size_t ptr_value = *ptr;
+  // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
+  // heap
+  if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
+      && ptr_value <= (size_t)old_heap->current) {
+    void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
+    void *new_addr =
+        (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
+    size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
+    *(void **)ptr         = new_addr + content_offset;
+  }
+}
+
+// fixes every word of [start, end) that points to the old heap
+static void fix_pointers_in_range (memory_chunk *old_heap, size_t *start, size_t *end) {
+  size_t lo = (size_t)old_heap->begin, hi = (size_t)old_heap->current;
+  for (size_t *ptr = find_candidate_word(start, end, lo, hi); ptr < end;
+       ptr         = find_candidate_word(ptr + 1, end, lo, hi)) {
+    fix_pointer(old_heap, ptr);
+  }
+}
+
+// elements of an array are its contents, so they are fixed by the scanning kernel
+static inline bool fix_array_elements (memory_chunk *old_heap, void *header_ptr) {
+  int header = *(int *)header_ptr;
+  if (TAG(header) != ARRAY_TAG) { return false; }
+  if (!HAS_NO_POINTERS(header)) {
+    size_t *contents = (size_t *)((char *)header_ptr + DATA_HEADER_SZ);
+    fix_pointers_in_range(old_heap, contents, contents + LEN(header));
+  }
+  return true;
 }
 
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region started\n");
 #endif
-  for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
-    size_t ptr_value = *ptr;
-    // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
-    // heap
-    if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
-        && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
-    }
-  }
+  fix_pointers_in_range(old_heap, (size_t *)start, (size_t *)end);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region finished\n");
 #endif
@@ -398,44 +1272,74 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
-void update_references (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC update_references started\n");
-#endif
-  heap_iterator it = heap_begin_iterator();
-  while (!heap_is_done_iterator(&it)) {
-    if (is_marked(get_object_content_ptr(it.current))) {
-      for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
-           !field_is_done_iterator(&field_iter);
-           obj_next_ptr_field_iterator(&field_iter)) {
-
-        size_t *field_value = *(size_t **)field_iter.cur_field;
-        if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+// regions are processed over the heap after `mremap`, but forward addresses refer to the old heap
+typedef struct {
+  memory_chunk *old_heap;
+  size_t       *heap_begin;
+  size_t       *heap_current;
+} compaction_ctx;
+
+static void update_region_references (void *arg, compaction_region *r) {
+  compaction_ctx *ctx      = (compaction_ctx *)arg;
+  memory_chunk   *old_heap = ctx->old_heap;
+
+  for (heap_iterator it = {.current = ctx->heap_begin + r->begin};
+       it.current < ctx->heap_begin + r->end;
+       heap_next_obj_iterator(&it)) {
+    if (!is_marked(get_object_content_ptr(it.current))) { continue; }
+    if (fix_array_elements(old_heap, it.current)) { continue; }
+    for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
+         !field_is_done_iterator(&field_iter);
+         obj_next_ptr_field_iterator(&field_iter)) {
+
+      size_t *field_value = *(size_t **)field_iter.cur_field;
+      if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
+      // this pointer should also be modified according to old_heap->begin
+      void *field_obj_content_addr =
+          (void *)ctx->heap_begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
+      // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
+      void *new_addr =
+          ctx->heap_begin
+          + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
+      // update field reference to point to new_addr
+      // since, we want fields to point to an actual content, we need to add this extra content_offset
+      // because forward_address itself is a pointer to the object's header
+      size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+      if (new_addr + content_offset < (void *)ctx->heap_begin
+          || new_addr + content_offset > (void *)ctx->heap_current) {
 #  ifdef DEBUG_PRINT
-          fprintf(stderr,
-                  "ur: incorrect pointer assignment: on object with id %d",
-                  TO_DATA(get_object_content_ptr(it.current))->id);
+        fprintf(stderr,
+                "ur: incorrect pointer assignment: on object with id %d",
+                TO_DATA(get_object_content_ptr(it.current))->id);
 #  endif
-          exit(1);
-        }
-#endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
+        exit(1);
       }
+#endif
+      *(void **)field_iter.cur_field = new_addr + content_offset;
+    }
+  }
+}
+
+void update_references (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC update_references started\n");
+#endif
+  compaction_ctx ctx = {.old_heap = old_heap, .heap_begin = heap.begin, .heap_current = heap.current};
+  if (regions_count > 1) {
+    run_on_regions(update_region_references, &ctx);
+  } else {
+    update_region_references(&ctx, &regions[0]);
+  }
+  // fix pointers from live large objects, they stay where they are
+  for (size_t i = 0; i < large_objects_count; ++i) {
+    if (!is_marked(get_object_content_ptr(large_objects[i]))) { continue; }
+    if (fix_array_elements(old_heap, large_objects[i])) { continue; }
+    for (obj_field_iterator it = ptr_field_begin_iterator(large_objects[i]);
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      fix_pointer(old_heap, (size_t *)it.cur_field);
     }
-    heap_next_obj_iterator(&it);
   }
   // fix pointers from stack
   scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
@@ -452,98 +1356,143 @@ void update_references (memory_chunk *old_heap) {
 #endif
 }
 
-void physically_relocate (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC physically_relocate started\n");
-#endif
-  heap_iterator from_iter = heap_begin_iterator();
+// objects slide towards the heap beginning, so the destination of a region may overlap only with
+// the regions preceding it; the region is moved once all of them have moved out of the way
+static void wait_for_preceding_regions (compaction_region *r) {
+  for (size_t i = r - regions; i > 0 && regions[i - 1].end > r->dest; --i) {
+    while (!__atomic_load_n(&regions[i - 1].relocated, __ATOMIC_ACQUIRE)) { sched_yield(); }
+  }
+}
 
-  while (!heap_is_done_iterator(&from_iter)) {
+static void relocate_region (void *arg, compaction_region *r) {
+  compaction_ctx *ctx       = (compaction_ctx *)arg;
+  heap_iterator   from_iter = {.current = ctx->heap_begin + r->begin};
+
+  wait_for_preceding_regions(r);
+  while (from_iter.current < ctx->heap_begin + r->end) {
     void         *obj       = get_object_content_ptr(from_iter.current);
     heap_iterator next_iter = from_iter;
     heap_next_obj_iterator(&next_iter);
     if (is_marked(obj)) {
       // Move the object from its old location to its new location relative to
       // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
+      size_t *to =
+          ctx->heap_begin + ((size_t *)get_forward_address(obj) - (size_t *)ctx->old_heap->begin);
       memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
+      // with COMPACT_HEADERS the mark bitmap is cleared at once after relocation
+#ifndef COMPACT_HEADERS
       unmark_object(get_object_content_ptr(to));
+#endif
     }
     from_iter = next_iter;
   }
+  __atomic_store_n(&r->relocated, 1, __ATOMIC_RELEASE);
+}
+
+void physically_relocate (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC physically_relocate started\n");
+#endif
+  compaction_ctx ctx = {.old_heap = old_heap, .heap_begin = heap.begin, .heap_current = heap.current};
+  if (regions_count > 1) {
+    run_on_regions(relocate_region, &ctx);
+  } else {
+    relocate_region(&ctx, &regions[0]);
+  }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate finished\n");
 #endif
 }
 
+static inline bool is_in_heap (const size_t *p) {
+  // mark-region heap is not filled up to `heap.current`, any of its blocks may hold objects
+  const size_t *limit = gc_algorithm == GC_MARK_REGION ? heap.end : heap.current;
+  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)limit;
+}
+
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return is_in_heap(p) || (!UNBOXED(p) && is_large_object(p));
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
-static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
-  void *tail         = tail_iter->current;
-  void *tail_content = get_object_content_ptr(tail);
-  set_forward_address(tail_content, (size_t)obj);
-  make_enqueued(obj);
-  heap_next_obj_iterator(tail_iter);
+// Marking is done on pop: roots and fields are pushed to the mark stack (grey_stack) without
+// looking at the objects they point to, so an object may be pushed several times. Popped objects
+// pass through a FIFO of MARK_PREFETCH_DISTANCE entries: the header of an object is prefetched when
+// the object enters the FIFO and read when it leaves it, by then it is most likely in cache.
+// An object is scanned once, so every reference is pushed at most once: the stack is bounded by
+// the number of roots plus the number of pointer fields of live objects (edges, not objects).
+// Skipping marked objects on push would read the header of every target before it is prefetched.
+static inline void push_mark_candidate (void *obj) {
+  if (is_valid_heap_pointer(obj)) { grey_push(obj); }
+}
+
+// every valid heap pointer lies in the returned range, large objects included
+static void heap_pointer_range (size_t *lo, size_t *hi) {
+  *lo = (size_t)heap.begin;
+  *hi = (size_t)(gc_algorithm == GC_MARK_REGION ? heap.end : heap.current);
+  if (large_objects_count > 0) {
+    *lo = MIN(*lo, (size_t)large_objects_min + DATA_HEADER_SZ);
+    *hi = MAX(*hi, (size_t)large_objects_max + DATA_HEADER_SZ);
+  }
 }
 
-static inline void *queue_dequeue (heap_iterator *head_iter) {
-  void *head         = head_iter->current;
-  void *head_content = get_object_content_ptr(head);
-  void *value        = (void *)get_forward_address(head_content);
-  make_dequeued(value);
-  heap_next_obj_iterator(head_iter);
-  return value;
+static void push_mark_candidates (size_t *from, size_t *to) {
+  size_t lo, hi;
+  heap_pointer_range(&lo, &hi);
+  for (size_t *p = find_candidate_word(from, to, lo, hi); p < to;
+       p         = find_candidate_word(p + 1, to, lo, hi)) {
+    push_mark_candidate(*(void **)p);
+  }
 }
 
-void mark (void *obj) {
-  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
-
-  // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
-  // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
-  // iterator where we will write address of the element that is going to be enqueued
-  heap_iterator q_tail_iter = q_head_iter;
-  queue_enqueue(&q_tail_iter, obj);
-
-  // invariant: queue contains only objects that are valid heap pointers (each corresponding to content of unmarked
-  // object) also each object is in queue only once
-  while (q_head_iter.current != q_tail_iter.current) {
-    // while the queue is non-empty
-    void *cur_obj = queue_dequeue(&q_head_iter);
-    mark_object(cur_obj);
-    void *header_ptr = get_obj_header_ptr(cur_obj);
-    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
-         !field_is_done_iterator(&ptr_field_it);
-         obj_next_ptr_field_iterator(&ptr_field_it)) {
-      void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
-        continue;
-      }
-      // if we came to this point it must be true that field_value is unmarked and not currently in queue
-      // thus, we maintain the invariant
-      queue_enqueue(&q_tail_iter, field_value);
+static void scan_object (void *obj) {
+  int header = TO_DATA(obj)->data_header;
+  if (TAG(header) == ARRAY_TAG) {
+    if (!HAS_NO_POINTERS(header)) { push_mark_candidates((size_t *)obj, (size_t *)obj + LEN(header)); }
+    return;
+  }
+  for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+       !field_is_done_iterator(&it);
+       obj_next_ptr_field_iterator(&it)) {
+    push_mark_candidate(*(void **)it.cur_field);
+  }
+}
+
+static void drain_mark_stack (void) {
+  void  *fifo[MARK_PREFETCH_DISTANCE];
+  size_t fifo_head = 0, fifo_size = 0;
+  while (grey_size > 0 || fifo_size > 0) {
+    while (fifo_size < MARK_PREFETCH_DISTANCE && grey_size > 0) {
+      void *obj = grey_stack[--grey_size];
+      __builtin_prefetch((char *)obj - DATA_HEADER_SZ, 1);
+      fifo[(fifo_head + fifo_size++) % MARK_PREFETCH_DISTANCE] = obj;
     }
+    void *obj = fifo[fifo_head];
+    fifo_head = (fifo_head + 1) % MARK_PREFETCH_DISTANCE;
+    --fifo_size;
+    if (is_marked(obj)) { continue; }
+    mark_object(obj);
+    scan_object(obj);
   }
 }
 
+void mark (void *obj) {
+  push_mark_candidate(obj);
+  drain_mark_stack();
+}
+
 void scan_extra_roots (void) {
   for (int i = 0; i < extra_roots.current_free; ++i) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
-    mark(*extra_roots.roots[i]);
+    push_mark_candidate(*extra_roots.roots[i]);
   }
 }
 
 #ifdef LAMA_ENV
 void scan_global_area (void) {
   // __start_custom_data is pointing to beginning of global area, thus all dereferencings are safe
-  for (size_t *ptr = (size_t *)&__start_custom_data; ptr < (size_t *)&__stop_custom_data; ++ptr) {
-    mark(*(void **)ptr);
-  }
+  push_mark_candidates((size_t *)&__start_custom_data, (size_t *)&__stop_custom_data);
 }
 #endif
 
@@ -564,26 +1513,101 @@ void __gc_init (void) {
   __init();
 }
 
+// number of threads used by compaction: LAMA_GC_THREADS if it is set, otherwise number of online cores
+static void init_gc_threads (void) {
+#ifdef LAMA_ISOLATES
+  // helper threads do not see the thread-local heap, and the cores are busy with other isolates
+  gc_threads = 1;
+#else
+  char *env     = getenv("LAMA_GC_THREADS");
+  long  threads = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  gc_threads    = MIN(MAX(threads, 1), GC_MAX_THREADS);
+#endif
+}
+
+static void compacting_init (void) {
+  heap.size    = heap_round_words(INIT_HEAP_SIZE);
+  heap.begin   = heap_map(heap.size);
+  heap.end     = heap.begin + heap.size;
+  heap.current = heap.begin;
+}
+
+static void compacting_shutdown (void) { munmap(heap.begin, WORDS_TO_BYTES(heap.size)); }
+
+static void *mr_collect_and_alloc (size_t size) {
+  mr_collect();
+  return mr_alloc_after_collection(size);
+}
+
+// indexed by gc_algorithm_kind
+static const gc_backend gc_backends[] = {
+    {.kind                   = GC_COMPACTING,
+     .name                   = "compacting",
+     .init                   = compacting_init,
+     .shutdown               = compacting_shutdown,
+     .alloc_on_existing_heap = bump_on_existing_heap,
+     .collect_and_alloc      = compacting_collect_and_alloc},
+    {.kind                   = GC_MARK_REGION,
+     .name                   = "mark-region",
+     .init                   = mr_init,
+     .shutdown               = mr_shutdown,
+     .alloc_on_existing_heap = mr_alloc_on_existing_heap,
+     .collect_and_alloc      = mr_collect_and_alloc},
+    {.kind                   = GC_SEMISPACE,
+     .name                   = "semispace",
+     .init                   = ss_init,
+     .shutdown               = ss_shutdown,
+     .alloc_on_existing_heap = ss_alloc_on_existing_heap,
+     .collect_and_alloc      = ss_collect_and_alloc},
+};
+
+ISOLATE_LOCAL const gc_backend *gc_backend_in_use = &gc_backends[DEFAULT_GC_BACKEND];
+
+static void init_gc_algorithm (void) {
+  char  *env = getenv("LAMA_GC");
+  size_t n   = sizeof(gc_backends) / sizeof(gc_backends[0]);
+  size_t i   = DEFAULT_GC_BACKEND;
+  if (env != NULL) {
+    for (i = 0; i < n && strcmp(env, gc_backends[i].name) != 0; ++i) { }
+    if (i == n) {
+      fprintf(stderr, "ERROR: unknown LAMA_GC value '%s'\n", env);
+      exit(1);
+    }
+  }
+  gc_backend_in_use = &gc_backends[i];
+  gc_algorithm      = gc_backend_in_use->kind;
+}
+
 void __init (void) {
   signal(SIGSEGV, handler);
-  size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
+  init_gc_threads();
+  init_gc_algorithm();
+  init_heap_pages();
 
   srandom(time(NULL));
 
-  heap.begin = mmap(
-      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: __init: mmap failed\n");
-    exit(1);
-  }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
+  gc_backend_in_use->init();
+  heap_dirty_end = 0;
+#ifdef COMPACT_HEADERS
+  resize_mark_bitmap(heap.size);
+#endif
   clear_extra_roots();
+  init_incremental_mode();
+  init_gc_stats();
+  init_alloc_profile();
+  heap_dump_init();
+  update_bump_limit();
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
+  gc_backend_in_use->shutdown();
+  los_release();
+  // site counters are kept, the objects are gone
+  records_count = 0;
+#ifdef COMPACT_HEADERS
+  release_mark_bitmap();
+#endif
+  gc_bump_limit = NULL;
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
@@ -651,8 +1675,10 @@ void dump_heap () {
       case ARRAY: fprintf(stderr, "of kind ARRAY\n"); break;
       case CLOSURE: fprintf(stderr, "of kind CLOSURE\n"); break;
       case STRING: fprintf(stderr, "of kind STRING\n"); break;
+      case ROPE: fprintf(stderr, "of kind ROPE\n"); break;
       case SEXP:
-        fprintf(stderr, "of kind SEXP with tag %s\n", de_hash(TO_SEXP(content_ptr)->tag));
+      case SMALL_SEXP:
+        fprintf(stderr, "of kind SEXP with tag %s\n", de_hash(SEXP_TAG_HASH(d)));
         break;
     }
   }
@@ -663,15 +1689,125 @@ void set_stack (size_t stack_top, size_t stack_bottom) {
   __gc_stack_bottom = stack_bottom;
 }
 
+void set_compaction_threads (size_t threads, size_t min_heap_words) {
+  gc_threads      = MIN(MAX(threads, 1), GC_MAX_THREADS);
+  parallel_min_sz = min_heap_words;
+}
+
 void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr) {
   memcpy(extra_roots.roots, extra_roots_ptr, MIN(sizeof(extra_roots.roots), extra_roots_size));
   clear_extra_roots();
 }
 
+void start_incremental_marking (void) { start_incremental_cycle(); }
+
+void set_inline_allocation (bool enabled) {
+  inline_allocation_in_tests = enabled;
+  update_bump_limit();
+}
+
 #endif
 
 /* Utility functions */
 
+#ifdef COMPACT_HEADERS
+// ============================================================================
+//                    Mark bitmap and forwarding table
+// ============================================================================
+// A live object has the bits of all its words set in `mark_bitmap`. For each
+// block of FORWARDING_BLOCK_WORDS heap words `forwarding_table` keeps the offset
+// where the first live word of the block moves to, so the new location of an
+// object is this offset plus the number of live words preceding it in the block.
+// Offsets are relative to the heap, hence the tables stay valid after `mremap`.
+static ISOLATE_LOCAL uint32_t *mark_bitmap      = NULL;
+static ISOLATE_LOCAL size_t   *forwarding_table = NULL;
+static ISOLATE_LOCAL size_t    bitmap_blocks    = 0;
+// heap beginning at the moment forwarding addresses are computed, they point into this heap
+static ISOLATE_LOCAL size_t   *forwarding_base  = NULL;
+
+void resize_mark_bitmap (size_t words) {
+  size_t blocks = words / FORWARDING_BLOCK_WORDS + 1;
+  if (blocks > bitmap_blocks) {
+    mark_bitmap      = realloc(mark_bitmap, blocks * sizeof(uint32_t));
+    forwarding_table = realloc(forwarding_table, blocks * sizeof(size_t));
+    if (mark_bitmap == NULL || forwarding_table == NULL) {
+      perror("ERROR: resize_mark_bitmap: unable to allocate the mark bitmap\n");
+      exit(1);
+    }
+    bitmap_blocks = blocks;
+  }
+  clear_mark_bitmap();
+}
+
+void clear_mark_bitmap (void) { memset(mark_bitmap, 0, bitmap_blocks * sizeof(uint32_t)); }
+
+static void release_mark_bitmap (void) {
+  free(mark_bitmap);
+  free(forwarding_table);
+  mark_bitmap      = NULL;
+  forwarding_table = NULL;
+  bitmap_blocks    = 0;
+}
+
+static inline bool in_bitmap_range (void *header_ptr) {
+  return (size_t *)header_ptr >= heap.begin && (size_t *)header_ptr < heap.end;
+}
+
+static void set_bitmap_range (size_t first, size_t words, bool value) {
+  while (words > 0) {
+    size_t   bit   = first % FORWARDING_BLOCK_WORDS;
+    size_t   n     = MIN(words, FORWARDING_BLOCK_WORDS - bit);
+    uint32_t mask  = (n == FORWARDING_BLOCK_WORDS ? ~0u : ((1u << n) - 1)) << bit;
+    uint32_t *cell = &mark_bitmap[first / FORWARDING_BLOCK_WORDS];
+    *cell          = value ? *cell | mask : *cell & ~mask;
+    first += n;
+    words -= n;
+  }
+}
+
+static void set_object_marks (void *obj, bool value) {
+  void *header_ptr = TO_DATA(obj);
+  if (!in_bitmap_range(header_ptr)) {
+    *large_object_mark(obj) = value;
+    return;
+  }
+  set_bitmap_range((size_t *)header_ptr - heap.begin,
+                   BYTES_TO_WORDS(obj_size_header_ptr(header_ptr)),
+                   value);
+}
+
+// fills the forwarding table for the first `used` heap words, returns number of live words
+static size_t compute_forwarding_table (size_t used) {
+  size_t live = 0;
+  forwarding_base = heap.begin;
+  for (size_t b = 0; b * FORWARDING_BLOCK_WORDS < used; ++b) {
+    forwarding_table[b] = live;
+    live += __builtin_popcount(mark_bitmap[b]);
+  }
+  return live;
+}
+
+size_t get_forward_address (void *obj) {
+  size_t offset = (size_t *)TO_DATA(obj) - heap.begin;
+  size_t b = offset / FORWARDING_BLOCK_WORDS, bit = offset % FORWARDING_BLOCK_WORDS;
+  size_t preceding = __builtin_popcount(mark_bitmap[b] & ((1u << bit) - 1));
+  return (size_t)(forwarding_base + forwarding_table[b] + preceding);
+}
+
+// forwarding addresses are computed from the marks, so there is nothing to store
+void set_forward_address (void *obj, size_t addr) { }
+
+bool is_marked (void *obj) {
+  void *header_ptr = TO_DATA(obj);
+  if (!in_bitmap_range(header_ptr)) { return *large_object_mark(obj); }
+  size_t offset = (size_t *)header_ptr - heap.begin;
+  return (mark_bitmap[offset / FORWARDING_BLOCK_WORDS] >> (offset % FORWARDING_BLOCK_WORDS)) & 1;
+}
+
+void mark_object (void *obj) { set_object_marks(obj, true); }
+
+void unmark_object (void *obj) { set_object_marks(obj, false); }
+#else
 size_t get_forward_address (void *obj) {
   data *d = TO_DATA(obj);
   return GET_FORWARD_ADDRESS(d->forward_address);
@@ -698,20 +1834,7 @@ void unmark_object (void *obj) {
   RESET_MARK_BIT(d->forward_address);
 }
 
-bool is_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  return IS_ENQUEUED(d->forward_address) != 0;
-}
-
-void make_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_ENQUEUED(d->forward_address);
-}
-
-void make_dequeued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_DEQUEUED(d->forward_address);
-}
+#endif
 
 heap_iterator heap_begin_iterator () {
   heap_iterator it = {.current = heap.begin};
@@ -740,6 +1863,8 @@ lama_type get_type_header_ptr (void *ptr) {
     case STRING_TAG: return STRING;
     case CLOSURE_TAG: return CLOSURE;
     case SEXP_TAG: return SEXP;
+    case SMALL_SEXP_TAG: return SMALL_SEXP;
+    case ROPE_TAG: return ROPE;
     default: {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr, "ERROR: get_type_header_ptr: unknown object header, cur_id=%d", cur_id);
@@ -779,6 +1904,8 @@ size_t obj_size_header_ptr (void *ptr) {
     case STRING: return string_size(len);
     case CLOSURE: return closure_size(len);
     case SEXP: return sexp_size(len);
+    case SMALL_SEXP: return small_sexp_size(SMALL_SEXP_LEN(*(int *)ptr));
+    case ROPE: return rope_size();
     default: {
 #ifdef DEBUG_VERSION
       fprintf(stderr, "ERROR: obj_size_header_ptr: unknown object header, cur_id=%d", cur_id);
@@ -802,6 +1929,10 @@ size_t closure_size (size_t sz) { return get_header_size(CLOSURE) + MEMBER_SIZE
 
 size_t sexp_size (size_t members) { return get_header_size(SEXP) + MEMBER_SIZE * (members + 1); }
 
+size_t small_sexp_size (size_t members) { return get_header_size(SMALL_SEXP) + MEMBER_SIZE * members; }
+
+size_t rope_size (void) { return get_header_size(ROPE) + MEMBER_SIZE * 2; }
+
 obj_field_iterator field_begin_iterator (void *obj) {
   lama_type          type = get_type_header_ptr(obj);
   obj_field_iterator it = {.type = type, .obj_ptr = obj, .cur_field = get_object_content_ptr(obj)};
@@ -821,7 +1952,21 @@ obj_field_iterator field_begin_iterator (void *obj) {
 }
 
 obj_field_iterator ptr_field_begin_iterator (void *obj) {
+  int header = *(int *)obj;
+  if (TAG(header) == SMALL_SEXP_TAG) {
+    // cons cells are the most frequent objects: the fields are found without the generic size computation
+    int               *fields = (int *)((char *)obj + DATA_HEADER_SZ);
+    int                n      = SMALL_SEXP_LEN(header), i = 0;
+    obj_field_iterator it     = {.type = SMALL_SEXP, .obj_ptr = obj};
+    while (i < n && !is_valid_pointer((size_t *)fields[i])) { ++i; }
+    it.cur_field = fields + i;
+    return it;
+  }
   obj_field_iterator it = field_begin_iterator(obj);
+  if (HAS_NO_POINTERS(header)) {
+    it.cur_field = get_end_of_obj(obj);
+    return it;
+  }
   // corner case when obj has no fields
   if (field_is_done_iterator(&it)) { return it; }
   if (is_valid_pointer(*(size_t **)it.cur_field)) { return it; }
@@ -858,7 +2003,9 @@ size_t get_header_size (lama_type type) {
     case STRING:
     case CLOSURE:
     case ARRAY:
-    case SEXP: return DATA_HEADER_SZ;
+    case SEXP:
+    case SMALL_SEXP:
+    case ROPE: return DATA_HEADER_SZ;
     default: perror("ERROR: get_header_size: unknown object type\n");
 #ifdef DEBUG_VERSION
       raise(SIGINT);   // only for debug purposes
@@ -876,7 +2023,7 @@ void *alloc_string (int len) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
+  gc_color_new_object(obj);
   return obj;
 }
 
@@ -889,7 +2036,7 @@ void *alloc_array (int len) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
+  gc_color_new_object(obj);
   return obj;
 }
 
@@ -902,8 +2049,26 @@ void *alloc_sexp (int members) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
-  obj->tag             = 0;
+  gc_color_new_object((data *)obj);
+  obj->tag = 0;
+  return obj;
+}
+
+void *alloc_sexp_tagged (int members, int tag_hash) {
+  if (!IS_SMALL_SEXP(members, tag_hash)) {
+    sexp *obj = alloc_sexp(members);
+    obj->tag  = tag_hash;
+    return obj;
+  }
+  data *obj        = alloc(small_sexp_size(members));
+  obj->data_header = SMALL_SEXP_HEADER(members, tag_hash);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "%p, SMALL SEXP tag=%zu\n", obj, TAG(obj->data_header));
+#endif
+#ifdef DEBUG_VERSION
+  obj->id = cur_id;
+#endif
+  gc_color_new_object(obj);
   return obj;
 }
 
@@ -917,6 +2082,21 @@ void *alloc_closure (int captured) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
+  gc_color_new_object(obj);
+  return obj;
+}
+
+void *alloc_rope (int len) {
+  data *obj        = alloc(rope_size());
+  obj->data_header = ROPE_TAG | (len << 3);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "%p, [ROPE] tag=%zu\n", obj, TAG(obj->data_header));
+#endif
+#ifdef DEBUG_VERSION
+  obj->id = cur_id;
+#endif
+  gc_color_new_object(obj);
+  ((int *)obj->contents)[0] = BOX(0);
+  ((int *)obj->contents)[1] = BOX(0);
   return obj;
 }
@@ -11,12 +11,18 @@
 //  - void *gc_alloc (size_t): this function is basically called whenever we are
 // not able to allocate memory on the existing heap via simple bump allocator.
 //  - mark_phase(): this function will tell you everything you need to know
-// about marking. I would also recommend to pay attention to the fact that
-// marking is implemented without usage of any additional memory. Already
-// allocated space is sufficient (for details see 'void mark (void *obj)').
+// about marking. All roots are pushed to an explicit mark stack first, then
+// the stack is drained with the headers of the next objects being prefetched
+// (see 'drain_mark_stack').
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
 // functions used in there. It is basically an implementation of LISP2.
+// On large heaps each of the three LISP2 passes is run by several threads over
+// disjoint heap regions (see `compute_locations`), the result is the same as
+// the one of the sequential algorithm.
+// If the runtime is built with -DCOMPACT_HEADERS, objects have no forwarding
+// word: marks are kept in a bitmap with a bit per heap word, forwarding
+// addresses are computed from it and a table of per-block offsets.
 
 #ifndef __LAMA_GC__
 #define __LAMA_GC__
@@ -25,13 +31,9 @@
 
 #define GET_MARK_BIT(x) (((int)(x)) & 1)
 #define SET_MARK_BIT(x) (x = (((int)(x)) | 1))
-#define IS_ENQUEUED(x) (((int)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((int)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((int)(x)) & (~2)))
 #define RESET_MARK_BIT(x) (x = (((int)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
-// alignment we can expect that last 2 bits don't influence address (they
-// should always be zero)
+// since the last bit is used for mark-bit and due to correct alignment we can
+// expect that last 2 bits don't influence address (they should always be zero)
 #define GET_FORWARD_ADDRESS(x) (((size_t)(x)) & (~3))
 // take the last two bits as they are and make all others zero
 #define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((int)(addr))))
@@ -42,11 +44,24 @@
 #else
 #  define MINIMUM_HEAP_CAPACITY (1 << 2)
 #endif
-
+// compaction passes are split between several threads (see LAMA_GC_THREADS) only for heaps
+// of at least this number of words, for smaller heaps thread start-up costs more than it saves
+#define PARALLEL_COMPACTION_MIN_WORDS (1 << 18)
+#define GC_MAX_THREADS 16
+// the heap is split into more regions than threads to balance the load
+#define REGIONS_PER_THREAD 4
+#define MAX_COMPACTION_REGIONS (GC_MAX_THREADS * REGIONS_PER_THREAD)
+
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+
+#if defined(COMPACT_HEADERS) && defined(FULL_INVARIANT_CHECKS)
+#  error "FULL_INVARIANT_CHECKS keep traversal marks in object headers, they can't be used with COMPACT_HEADERS"
+#endif
 
-typedef enum { ARRAY, CLOSURE, STRING, SEXP } lama_type;
+typedef enum { ARRAY, CLOSURE, STRING, SEXP, SMALL_SEXP, ROPE } lama_type;
 
 typedef struct {
   size_t *current;
@@ -76,22 +91,309 @@ void *gc_alloc(size_t);
 void *gc_alloc_on_existing_heap(size_t);
 
 // specific for mark-and-compact_phase gc
+// number of popped objects whose headers are being prefetched while the current one is scanned
+#define MARK_PREFETCH_DISTANCE 8
 void mark (void *obj);
 void mark_phase (void);
-// marks each pointer from extra roots
+// pushes each pointer from extra roots to the mark stack
 void scan_extra_roots (void);
 #ifdef LAMA_ENV
-// marks each valid pointer from global area
+// pushes each valid pointer from global area to the mark stack
 void scan_global_area (void);
 #endif
 // takes number of words that are required to be allocated somewhere on the heap
 void compact_phase (size_t additional_size);
-// specific for Lisp-2 algorithm
+// specific for Lisp-2 algorithm, each pass is split between threads by heap regions
 size_t compute_locations ();
 void   update_references (memory_chunk *);
 void   physically_relocate (memory_chunk *);
 
 
+// ============================================================================
+//                          Incremental marking
+// ============================================================================
+// Enabled by LAMA_GC_INCREMENTAL=1. Marking is done by slices run on allocation,
+// each slice takes at most LAMA_GC_SLICE_US microseconds (plus scanning of one
+// object). Every store of a pointer into a heap object must be preceded by
+// `gc_write_barrier` applied to the value being overwritten.
+#define INCREMENTAL_SLICE_BUDGET_US 500
+// a slice is run each time this number of words is allocated
+#define INCREMENTAL_SLICE_WORDS (1 << 12)
+#define INCREMENTAL_STEPS_PER_CLOCK_CHECK 64
+#define GREY_STACK_INIT_CAPACITY 1024
+
+extern ISOLATE_LOCAL bool gc_marking_in_progress;
+
+// marks the object grey if it is a white heap object and marking is in progress
+void gc_shade (void *obj);
+
+static inline void gc_write_barrier (void *old_value) {
+  if (__builtin_expect(gc_marking_in_progress, 0)) { gc_shade(old_value); }
+}
+
+// Pause times of all GC activities (incremental slices included).
+// buckets[i] is the number of pauses shorter than 2^i microseconds and not shorter than 2^(i-1).
+// The histogram is printed to stderr at exit if LAMA_GC_PAUSE_HISTOGRAM is set.
+#define PAUSE_HISTOGRAM_BUCKETS 24
+
+typedef struct {
+  size_t count;
+  size_t total_us;
+  size_t max_us;
+  size_t buckets[PAUSE_HISTOGRAM_BUCKETS];
+} pause_histogram;
+
+const pause_histogram *gc_pause_histogram (void);
+void                   print_pause_histogram (FILE *f);
+
+
+// ============================================================================
+//                            GC statistics
+// ============================================================================
+// The counters are always kept, they cost an addition per allocation and two
+// clock readings per phase of a collection. LAMA_GC_STATS=text or
+// LAMA_GC_STATS=json prints them to stderr at exit. Phase times are collected
+// by the compacting collector only; other backends account the whole
+// collection as the pause.
+typedef enum {
+  GC_PHASE_MARK,
+  GC_PHASE_COMPUTE_LOCATIONS,
+  GC_PHASE_UPDATE_REFERENCES,
+  GC_PHASE_RELOCATE,
+  GC_PHASE_MREMAP,
+  GC_PHASES
+} gc_phase;
+
+typedef struct {
+  size_t          collections;
+  // words requested since start-up, large objects included
+  size_t          allocated_words;
+  // words occupied by live objects right after the last collection, and the maximum of it
+  size_t          live_words;
+  size_t          max_live_words;
+  size_t          heap_words;
+  size_t          max_heap_words;
+  // total wall time of each phase in nanoseconds
+  size_t          phase_ns[GC_PHASES];
+  // page faults of the process since start-up, and those of them taken by collections
+  size_t          minor_faults, major_faults;
+  size_t          gc_minor_faults, gc_major_faults;
+  pause_histogram pauses;
+} gc_statistics;
+
+extern ISOLATE_LOCAL size_t gc_allocated_words;
+
+// the returned statistics are updated by the next call
+const gc_statistics *gc_stats (void);
+void                 print_gc_stats (FILE *f, bool json);
+// called by the backends at the end of each collection
+void gc_stats_collection_done (size_t live_words);
+// the heap size in words every backend grows to after a collection that has left `live_words`
+// and has to satisfy an allocation of `request_words`
+size_t gc_heap_words_after_collection (size_t live_words, size_t request_words);
+
+
+// ============================================================================
+//                       Allocation-site profiling
+// ============================================================================
+// Enabled by LAMA_ALLOC_PROFILE. The embedder (e.g. the interpreter) keeps
+// `gc_alloc_site` equal to the bytecode offset of the instruction being executed,
+// and every allocation is accounted to that site. With the compacting collector
+// each object is also remembered in a side table, so that every collection
+// credits the sites of the objects that survived it. The bump allocation fast
+// path is disabled while profiling.
+#define ALLOC_PROFILE_INIT_SITES 256
+#define ALLOC_PROFILE_INIT_RECORDS 4096
+
+typedef struct {
+  size_t site;
+  size_t count;
+  size_t words;
+  // objects of the site that survived a collection, summed over all collections
+  size_t survivals;
+  // objects of the site that survived the last collection
+  size_t live;
+} alloc_site_stats;
+
+extern ISOLATE_LOCAL bool   gc_alloc_profiling;
+extern ISOLATE_LOCAL size_t gc_alloc_site;
+
+// all sites sorted by allocated words in descending order, the array is valid until the next call
+const alloc_site_stats *gc_alloc_profile (size_t *sites_count);
+
+
+// ============================================================================
+//                          Large object space
+// ============================================================================
+// Objects of at least LARGE_OBJECT_MIN_WORDS words are not placed in the heap
+// of the compacting collector: each of them gets its own mmapped chunk that is
+// never moved. Such objects are marked together with the heap ones, dead ones
+// are unmapped after compaction. A collection is also started once
+// LARGE_OBJECT_GC_TRIGGER_WORDS words (or as many as survived the previous
+// collection, if this is more) are allocated in large objects.
+#define LARGE_OBJECT_MIN_WORDS (1 << 14)
+#define LARGE_OBJECT_GC_TRIGGER_WORDS (1 << 22)
+
+// takes a pointer to an object content, returns whether it is a live large object
+bool is_large_object (const void *obj);
+
+
+// ============================================================================
+//                          Heap memory backing
+// ============================================================================
+// LAMA_GC_PAGES selects the pages of the heaps: `small` (default), `hugepage`
+// (transparent huge pages requested by madvise(MADV_HUGEPAGE)) or `hugetlb`
+// (MAP_HUGETLB, falls back to `hugepage` if there are no free huge pages).
+// With huge pages heap sizes are rounded up to HUGE_PAGE_BYTES and fresh
+// mappings are aligned by it. LAMA_GC_POPULATE=1 pre-faults every mapping and
+// every growth of a heap before it is used. The mark-region heap is a sparse
+// reservation, so it gets transparent huge pages in the `hugetlb` mode too.
+// Large objects always get small pages.
+#define HUGE_PAGE_BYTES (2u << 20)
+
+typedef enum { HEAP_PAGES_SMALL, HEAP_PAGES_HUGEPAGE, HEAP_PAGES_HUGETLB } heap_pages_kind;
+
+extern ISOLATE_LOCAL heap_pages_kind heap_pages;
+extern ISOLATE_LOCAL bool            heap_populate;
+
+// rounds a heap size in words up to the page size of the heap
+size_t  heap_round_words (size_t words);
+// maps `words` words of the heap memory in the low 4GB, exits on failure
+size_t *heap_map (size_t words);
+// advises and pre-faults a range that has just been added to a heap and was never used
+void    heap_prepare_range (void *begin, size_t bytes);
+
+
+// ============================================================================
+//                              GC backends
+// ============================================================================
+// The collector is chosen at start-up by LAMA_GC: `compacting` (LISP2),
+// `mark-region` or `semispace`; if LAMA_GC is not set, DEFAULT_GC_BACKEND is
+// used (it can be changed at build time, e.g. -DDEFAULT_GC_BACKEND=GC_SEMISPACE).
+// `alloc`, `gc_alloc`, `__init` and `__shutdown` go through the table of the
+// chosen backend. Roots (the stack, extra roots and the static area) and the
+// object layout are shared by all backends.
+typedef enum { GC_COMPACTING, GC_MARK_REGION, GC_SEMISPACE } gc_algorithm_kind;
+
+#ifndef DEFAULT_GC_BACKEND
+#  define DEFAULT_GC_BACKEND GC_COMPACTING
+#endif
+
+typedef struct {
+  gc_algorithm_kind kind;
+  const char       *name;   // value of LAMA_GC
+  // sets `heap` up
+  void (*init) (void);
+  void (*shutdown) (void);
+  // takes number of words, returns NULL if the object does not fit without a collection
+  void *(*alloc_on_existing_heap) (size_t words, bool zeroed);
+  // collects garbage, then allocates zeroed memory of the given number of words
+  void *(*collect_and_alloc) (size_t words);
+} gc_backend;
+
+extern ISOLATE_LOCAL gc_algorithm_kind gc_algorithm;
+extern ISOLATE_LOCAL const gc_backend *gc_backend_in_use;
+// value of the mark bit of newly allocated objects
+extern ISOLATE_LOCAL size_t gc_allocation_color;
+
+
+// ============================================================================
+//                     Mark-region collector (mark_region.c)
+// ============================================================================
+// Enabled by LAMA_GC=mark-region. Objects are not moved except when they are
+// evacuated from fragmented blocks. The heap is reserved at start-up, its size
+// in bytes is LAMA_GC_MAX_HEAP (MR_DEFAULT_RESERVED_BYTES by default).
+
+#define MR_LINE_WORDS 32
+#define MR_LINES_PER_BLOCK 256
+#define MR_BLOCK_WORDS (MR_LINE_WORDS * MR_LINES_PER_BLOCK)
+#define MR_DEFAULT_RESERVED_BYTES (512u << 20)
+#define MR_INITIAL_BLOCKS 4
+// one block of every MR_HEADROOM_RATIO is kept empty as a target of evacuation
+#define MR_HEADROOM_RATIO 16
+// blocks whose lines are less than 1/MR_FRAGMENTED_BLOCK_RATIO live are evacuated
+#define MR_FRAGMENTED_BLOCK_RATIO 4
+#define MR_MIN_EVACUATED_BLOCKS 2
+
+void  mr_init (void);
+void  mr_shutdown (void);
+void  mr_collect (void);
+// both take number of words, the first one returns NULL if there is no free space
+void *mr_alloc_on_existing_heap (size_t, bool zeroed);
+void *mr_alloc_after_collection (size_t);
+
+
+// ============================================================================
+//                   Cheney semispace collector (semispace.c)
+// ============================================================================
+// Enabled by LAMA_GC=semispace. Live objects are copied breadth-first into the
+// other half of the heap, so a collection costs time proportional to the live
+// data only. There is no large object space: large objects are copied as well.
+#ifdef DEBUG_VERSION
+#  define SS_INITIAL_SPACE_WORDS MINIMUM_HEAP_CAPACITY
+#else
+#  define SS_INITIAL_SPACE_WORDS (1 << 16)
+#endif
+
+void  ss_init (void);
+void  ss_shutdown (void);
+// takes number of words, returns NULL if there is no free space
+void *ss_alloc_on_existing_heap (size_t, bool zeroed);
+void *ss_collect_and_alloc (size_t);
+
+
+// ============================================================================
+//                 Heap census and snapshots (heap_census.c)
+// ============================================================================
+// Both walk the objects reachable from the roots in release builds as well and
+// keep their own tables, so the collector state is not touched and a census can
+// be taken at any allocation. If LAMA_HEAP_SIGNALS is set, SIGUSR1 prints a
+// census to stderr and SIGUSR2 writes a snapshot to lama-heap.<pid>.<n>.snapshot.
+// The handlers only set a flag, the work is done by the next allocation.
+// Snapshots are read by the offline `heap_analyser`, which computes dominators
+// and retained sizes.
+//
+// Snapshot format: the magic, then unsigned LEB128 numbers:
+//   version
+//   number of s-expression tags, then per tag: hash, name length, name bytes
+//   number of objects, then per object: lama_type (SMALL_SEXP is written as SEXP),
+//     tag hash (s-expressions only), size in bytes, number of references, referenced object ids
+//   number of roots, then root object ids
+// Object ids are indices in the object list.
+#define HEAP_SNAPSHOT_MAGIC "LAMAHEAP"
+#define HEAP_SNAPSHOT_VERSION 1
+
+typedef struct {
+  size_t count;
+  size_t bytes;
+} heap_census_entry;
+
+typedef struct {
+  int               tag_hash;
+  heap_census_entry total;
+} heap_census_tag;
+
+typedef struct {
+  heap_census_entry strings, arrays, closures, sexps;
+  size_t            sexp_tags_count;
+  // sorted by bytes in descending order
+  heap_census_tag  *sexp_tags;
+} heap_census_stats;
+
+// set by the signals of LAMA_HEAP_SIGNALS, with LAMA_ISOLATES in the thread that gets the signal
+extern ISOLATE_LOCAL volatile sig_atomic_t heap_census_requested, heap_snapshot_requested;
+
+// the returned census is valid until the next call
+const heap_census_stats *heap_take_census (void);
+void                     heap_census (FILE *f);
+// returns false if the file can't be written
+bool                     heap_snapshot (const char *path);
+// installs the signal handlers if LAMA_HEAP_SIGNALS is set
+void                     heap_dump_init (void);
+// does the work requested by the signals, called at allocation
+void                     heap_dump_safepoint (void);
+
+
 // ============================================================================
 //                            GC extra roots
 // ============================================================================
@@ -153,8 +455,19 @@ size_t objects_snapshot (int *object_ids_buf, size_t object_ids_buf_size);
 // essential function to mock program stack
 void set_stack (size_t stack_top, size_t stack_bottom);
 
+// forces number of compaction threads and minimal heap size (in words) for parallel compaction
+void set_compaction_threads (size_t threads, size_t min_heap_words);
+
 // function to mock extra roots (Lama specific)
 void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr);
+
+// greys the current roots as an incremental cycle does (compacting collector only),
+// the next collection finishes the marking
+void start_incremental_marking (void);
+
+// lets `alloc_uninitialized_*` bump objects inline, the objects get the id of the last
+// out-of-line allocation
+void set_inline_allocation (bool enabled);
 #endif
 
 
@@ -180,14 +493,13 @@ void mark_object (void *obj);
 // takes a pointer to an object content as an argument, marks the object as dead
 void unmark_object (void *obj);
 
-// takes a pointer to an object content as an argument, returns whether this object was enqueued to the queue (which is used in mark phase)
-bool is_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, marks object as enqueued
-void make_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, unmarks object as enqueued
-void make_dequeued (void *obj);
+#ifdef COMPACT_HEADERS
+// forwarding table has an entry per FORWARDING_BLOCK_WORDS heap words, a block is a word of the mark bitmap
+#  define FORWARDING_BLOCK_WORDS 32
+// makes the mark bitmap cover at least `words` heap words, all marks are cleared
+void resize_mark_bitmap (size_t words);
+void clear_mark_bitmap (void);
+#endif
 
 // returns iterator to an object with the lowest address
 heap_iterator heap_begin_iterator ();
@@ -219,6 +531,12 @@ size_t closure_size (size_t sz);
 // returns number of bytes that are required to allocate s-expression with 'members' fields (header included)
 size_t sexp_size (size_t members);
 
+// the same for a small s-expression, its tag is kept in the header
+size_t small_sexp_size (size_t members);
+
+// a rope has two fields whatever its length is
+size_t rope_size (void);
+
 // returns an iterator over object fields, obj is ptr to object header
 // (in case of s-exp, it is mandatory that obj ptr is very beginning of the object,
 // considering that now we store two versions of header in there)
@@ -246,6 +564,84 @@ void *get_end_of_obj (void *header_ptr);
 void *alloc_string (int len);
 void *alloc_array (int len);
 void *alloc_sexp (int members);
+// takes unboxed tag hash, allocates a small s-expression if it is possible (see IS_SMALL_SEXP)
+// and an ordinary one with the tag set otherwise
+void *alloc_sexp_tagged (int members, int tag_hash);
 void *alloc_closure (int captured);
+// both parts of the rope are BOX(0)
+void *alloc_rope (int len);
+
+
+// ============================================================================
+//                       Inline allocation fast path
+// ============================================================================
+// `alloc_uninitialized_*` write only the object header, the caller must store
+// every field before anything else is allocated. An object is bumped inline
+// while it fits below `gc_bump_limit`; the limit is NULL whenever allocations
+// have to go through the collector (incremental marking, mark-region heap,
+// debug builds), so the out-of-line `alloc_uninitialized` is called instead.
+extern ISOLATE_LOCAL memory_chunk heap;
+extern ISOLATE_LOCAL size_t      *gc_bump_limit;
+#ifdef DEBUG_VERSION
+extern ISOLATE_LOCAL size_t cur_id;
+#endif
+
+// takes number of words, returned memory is not zeroed
+void *alloc_uninitialized (size_t words);
+
+static inline void *gc_bump_alloc (size_t words) {
+  size_t *p = heap.current;
+  if (__builtin_expect(words < LARGE_OBJECT_MIN_WORDS && p + words <= gc_bump_limit, 1)) {
+    heap.current = p + words;
+    gc_allocated_words += words;
+    return p;
+  }
+  return alloc_uninitialized(words);
+}
+
+// gives a new object the mark it has to have, the header must be already written
+static inline void gc_color_new_object (data *obj) {
+#ifdef COMPACT_HEADERS
+  if (__builtin_expect(gc_allocation_color != 0, 0)) { mark_object(obj->contents); }
+#else
+  obj->forward_address = gc_allocation_color;
+#endif
+}
+
+static inline void *alloc_uninitialized_object (size_t bytes, int header) {
+  data *obj        = gc_bump_alloc(BYTES_TO_WORDS(bytes));
+  obj->data_header = header;
+#ifdef DEBUG_VERSION
+  obj->id = cur_id;
+#endif
+  gc_color_new_object(obj);
+  return obj;
+}
+
+static inline void *alloc_uninitialized_array (int len) {
+  return alloc_uninitialized_object(DATA_HEADER_SZ + MEMBER_SIZE * len, ARRAY_TAG | (len << 3));
+}
+
+// the tag of s-expression is not initialized as well
+static inline void *alloc_uninitialized_sexp (int members) {
+  return alloc_uninitialized_object(DATA_HEADER_SZ + MEMBER_SIZE * (members + 1),
+                                    SEXP_TAG | (members << 3));
+}
+
+// the fields are not initialized, the tag is set
+static inline void *alloc_uninitialized_sexp_tagged (int members, int tag_hash) {
+  if (IS_SMALL_SEXP(members, tag_hash)) {
+    return alloc_uninitialized_object(DATA_HEADER_SZ + MEMBER_SIZE * members,
+                                      SMALL_SEXP_HEADER(members, tag_hash));
+  }
+  sexp *obj = alloc_uninitialized_sexp(members);
+  obj->tag  = tag_hash;
+  return obj;
+}
+
+static inline void *alloc_uninitialized_closure (int captured) {
+  return alloc_uninitialized_object(DATA_HEADER_SZ + MEMBER_SIZE * captured,
+                                    CLOSURE_TAG | (captured << 3));
+}
 
 #endif
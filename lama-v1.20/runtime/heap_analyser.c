@@ -0,0 +1,282 @@
+// ============================================================================
+//                        Offline heap snapshot analyser
+// ============================================================================
+// Reads a snapshot written by `heap_snapshot` (see heap_census.c for the
+// format) and prints the objects with the largest retained sizes. The retained
+// size of an object is the total size of the objects it dominates, i.e. of the
+// objects that become unreachable if it does. Dominators are computed by the
+// iterative algorithm of Cooper, Harvey and Kennedy over a graph with a
+// virtual root that refers to all roots.
+//
+// Usage: heap_analyser <snapshot> [number of objects to print, 20 by default]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAP_SNAPSHOT_MAGIC "LAMAHEAP"
+#define HEAP_SNAPSHOT_VERSION 1
+#define DEFAULT_TOP_OBJECTS 20
+#define UNDEFINED ((size_t)-1)
+
+// the same as lama_type from gc.h
+enum { ARRAY, CLOSURE, STRING, SEXP };
+static const char *type_names[] = {"array", "closure", "string", "sexp"};
+
+typedef struct {
+  size_t hash;
+  char  *name;
+} tag_name;
+
+static FILE     *in;
+static size_t    tags_count;
+static tag_name *tags;
+
+// objects are nodes 0..n-1, the virtual root is node n
+static size_t  n;
+static size_t *type, *tag, *size;
+// references of node v are refs[first_ref[v] .. first_ref[v + 1])
+static size_t *first_ref, *refs;
+// predecessors in the same layout
+static size_t *first_pred, *preds;
+static size_t *rpo_number, *idom, *retained;
+
+static void *checked_calloc (size_t count, size_t sz) {
+  void *p = calloc(count == 0 ? 1 : count, sz);
+  if (p == NULL) {
+    perror("ERROR: heap_analyser: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static size_t get_number (void) {
+  size_t n = 0;
+  for (int shift = 0;; shift += 7) {
+    int c = fgetc(in);
+    if (c == EOF) {
+      fprintf(stderr, "ERROR: heap_analyser: unexpected end of the snapshot\n");
+      exit(1);
+    }
+    n |= (size_t)(c & 0x7F) << shift;
+    if ((c & 0x80) == 0) { return n; }
+  }
+}
+
+static const char *tag_of (size_t hash) {
+  for (size_t i = 0; i < tags_count; ++i) {
+    if (tags[i].hash == hash) { return tags[i].name; }
+  }
+  return "?";
+}
+
+static void read_snapshot (void) {
+  char magic[sizeof(HEAP_SNAPSHOT_MAGIC)] = {0};
+  if (fread(magic, 1, strlen(HEAP_SNAPSHOT_MAGIC), in) != strlen(HEAP_SNAPSHOT_MAGIC)
+      || strcmp(magic, HEAP_SNAPSHOT_MAGIC) != 0 || get_number() != HEAP_SNAPSHOT_VERSION) {
+    fprintf(stderr, "ERROR: heap_analyser: not a heap snapshot of a supported version\n");
+    exit(1);
+  }
+
+  tags_count = get_number();
+  tags       = checked_calloc(tags_count, sizeof(tag_name));
+  for (size_t i = 0; i < tags_count; ++i) {
+    tags[i].hash = get_number();
+    size_t len   = get_number();
+    tags[i].name = checked_calloc(len + 1, 1);
+    if (fread(tags[i].name, 1, len, in) != len) {
+      fprintf(stderr, "ERROR: heap_analyser: unexpected end of the snapshot\n");
+      exit(1);
+    }
+  }
+
+  n         = get_number();
+  type      = checked_calloc(n, sizeof(size_t));
+  tag       = checked_calloc(n, sizeof(size_t));
+  size      = checked_calloc(n + 1, sizeof(size_t));
+  first_ref = checked_calloc(n + 2, sizeof(size_t));
+  size_t refs_capacity = n + 1;
+  refs                 = checked_calloc(refs_capacity, sizeof(size_t));
+  size_t refs_count    = 0;
+  for (size_t v = 0; v <= n; ++v) {
+    first_ref[v] = refs_count;
+    // the virtual root is read last, its references are the roots
+    size_t count;
+    if (v < n) {
+      type[v] = get_number();
+      tag[v]  = type[v] == SEXP ? get_number() : 0;
+      size[v] = get_number();
+    }
+    count = get_number();
+    if (refs_count + count > refs_capacity) {
+      refs_capacity = 2 * (refs_count + count);
+      refs          = realloc(refs, refs_capacity * sizeof(size_t));
+      if (refs == NULL) {
+        perror("ERROR: heap_analyser: out of memory\n");
+        exit(1);
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      size_t w = get_number();
+      if (w >= n) {
+        fprintf(stderr, "ERROR: heap_analyser: reference to a missing object %zu\n", w);
+        exit(1);
+      }
+      refs[refs_count++] = w;
+    }
+  }
+  first_ref[n + 1] = refs_count;
+}
+
+static void build_predecessors (void) {
+  size_t edges = first_ref[n + 1];
+  first_pred   = checked_calloc(n + 2, sizeof(size_t));
+  preds        = checked_calloc(edges, sizeof(size_t));
+  for (size_t e = 0; e < edges; ++e) { ++first_pred[refs[e] + 1]; }
+  for (size_t v = 0; v <= n; ++v) { first_pred[v + 1] += first_pred[v]; }
+  size_t *fill = checked_calloc(n + 1, sizeof(size_t));
+  for (size_t v = 0; v <= n; ++v) {
+    for (size_t e = first_ref[v]; e < first_ref[v + 1]; ++e) {
+      size_t w                         = refs[e];
+      preds[first_pred[w] + fill[w]++] = v;
+    }
+  }
+  free(fill);
+}
+
+// numbers nodes in reverse postorder of a depth-first search from the virtual root,
+// returns nodes ordered by the number
+static size_t *reverse_postorder (void) {
+  size_t *order     = checked_calloc(n + 1, sizeof(size_t));
+  size_t *stack     = checked_calloc(n + 1, sizeof(size_t));
+  size_t *next_edge = checked_calloc(n + 1, sizeof(size_t));
+  char   *seen      = checked_calloc(n + 1, 1);
+  rpo_number        = checked_calloc(n + 1, sizeof(size_t));
+  size_t depth = 0, finished = 0;
+  stack[depth++] = n;
+  seen[n]        = 1;
+  next_edge[n]   = first_ref[n];
+  while (depth > 0) {
+    size_t v = stack[depth - 1];
+    if (next_edge[v] < first_ref[v + 1]) {
+      size_t w = refs[next_edge[v]++];
+      if (!seen[w]) {
+        seen[w]        = 1;
+        next_edge[w]   = first_ref[w];
+        stack[depth++] = w;
+      }
+    } else {
+      --depth;
+      order[finished++] = v;
+    }
+  }
+  for (size_t i = 0; i < finished / 2; ++i) {
+    size_t t                = order[i];
+    order[i]                = order[finished - 1 - i];
+    order[finished - 1 - i] = t;
+  }
+  for (size_t i = 0; i < finished; ++i) { rpo_number[order[i]] = i; }
+  for (size_t v = 0; v <= n; ++v) {
+    if (!seen[v]) { rpo_number[v] = UNDEFINED; }
+  }
+  free(stack);
+  free(next_edge);
+  free(seen);
+  return order;
+}
+
+static size_t intersect (size_t a, size_t b) {
+  while (a != b) {
+    while (rpo_number[a] > rpo_number[b]) { a = idom[a]; }
+    while (rpo_number[b] > rpo_number[a]) { b = idom[b]; }
+  }
+  return a;
+}
+
+static void compute_dominators (size_t *order, size_t reachable) {
+  idom = checked_calloc(n + 1, sizeof(size_t));
+  for (size_t v = 0; v <= n; ++v) { idom[v] = UNDEFINED; }
+  idom[n] = n;
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (size_t i = 1; i < reachable; ++i) {
+      size_t v        = order[i];
+      size_t new_idom = UNDEFINED;
+      for (size_t e = first_pred[v]; e < first_pred[v + 1]; ++e) {
+        size_t p = preds[e];
+        if (idom[p] == UNDEFINED) { continue; }
+        new_idom = new_idom == UNDEFINED ? p : intersect(p, new_idom);
+      }
+      if (idom[v] != new_idom) {
+        idom[v] = new_idom;
+        changed = 1;
+      }
+    }
+  }
+  // a node is dominated by nodes with smaller numbers, so the sizes are summed up in reverse order
+  retained = checked_calloc(n + 1, sizeof(size_t));
+  for (size_t i = reachable; i-- > 0;) {
+    size_t v = order[i];
+    retained[v] += size[v];
+    if (v != n) { retained[idom[v]] += retained[v]; }
+  }
+}
+
+static size_t *by_retained;
+
+static int compare_by_retained (const void *a, const void *b) {
+  size_t ra = retained[*(const size_t *)a], rb = retained[*(const size_t *)b];
+  return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+static void print_object (size_t v) {
+  printf("%10zu %12zu %10zu  %-8s %s",
+         v,
+         retained[v],
+         size[v],
+         type_names[type[v] & 3],
+         type[v] == SEXP ? tag_of(tag[v]) : "");
+  if (idom[v] == n) {
+    printf("  (no single dominator)\n");
+  } else {
+    printf("  (dominated by %zu)\n", idom[v]);
+  }
+}
+
+int main (int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <snapshot> [number of objects to print]\n", argv[0]);
+    return 1;
+  }
+  in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror("ERROR: heap_analyser: unable to open the snapshot\n");
+    return 1;
+  }
+  size_t top = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_TOP_OBJECTS;
+
+  read_snapshot();
+  fclose(in);
+  build_predecessors();
+  size_t *order     = reverse_postorder();
+  size_t  reachable = 0;
+  for (size_t v = 0; v <= n; ++v) { reachable += rpo_number[v] != UNDEFINED; }
+  compute_dominators(order, reachable);
+
+  size_t total = 0;
+  for (size_t v = 0; v < n; ++v) { total += size[v]; }
+  printf("%zu objects, %zu bytes, %zu roots\n", n, total, first_ref[n + 1] - first_ref[n]);
+  if (reachable != n + 1) {
+    printf("%zu objects are not reachable from the roots\n", n + 1 - reachable);
+  }
+
+  by_retained = checked_calloc(n, sizeof(size_t));
+  size_t count = 0;
+  for (size_t v = 0; v < n; ++v) {
+    if (idom[v] != UNDEFINED) { by_retained[count++] = v; }
+  }
+  qsort(by_retained, count, sizeof(size_t), compare_by_retained);
+  printf("%10s %12s %10s  %s\n", "object", "retained", "size", "type");
+  for (size_t i = 0; i < count && i < top; ++i) { print_object(by_retained[i]); }
+  return 0;
+}
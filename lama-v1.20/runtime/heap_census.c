@@ -0,0 +1,301 @@
+// ============================================================================
+//                        Heap census and snapshots
+// ============================================================================
+// Objects reachable from the roots are numbered in breadth-first order: the
+// list of found objects is also the queue of the traversal, as in the
+// semispace collector. A hash table maps object addresses to their numbers,
+// so the collector's mark bits are not used and may be in any state.
+#define _GNU_SOURCE 1
+
+#include "gc.h"
+
+#include "runtime_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern ISOLATE_LOCAL extra_roots_pool extra_roots;
+extern ISOLATE_LOCAL size_t           __gc_stack_top, __gc_stack_bottom;
+#ifdef LAMA_ENV
+extern const size_t __start_custom_data, __stop_custom_data;
+#endif
+extern char *de_hash (int);
+
+ISOLATE_LOCAL volatile sig_atomic_t heap_census_requested = 0, heap_snapshot_requested = 0;
+
+static ISOLATE_LOCAL size_t snapshots_written = 0;
+
+// reachable objects (content pointers), an object's index is its id
+static ISOLATE_LOCAL void  **objects          = NULL;
+static ISOLATE_LOCAL size_t  objects_count    = 0;
+static ISOLATE_LOCAL size_t  objects_capacity = 0;
+// open addressing table of object ids + 1, 0 is an empty slot
+static ISOLATE_LOCAL size_t *id_slots       = NULL;
+static ISOLATE_LOCAL size_t  id_slots_count = 0;
+
+static ISOLATE_LOCAL heap_census_stats census;
+
+static inline size_t id_slot (void *obj) {
+  // multiplicative hashing, `id_slots_count` is a power of two, low bits of addresses are zero
+  return (((size_t)obj >> 2) * 2654435769u) & (id_slots_count - 1);
+}
+
+// returns the id of the object or `objects_count` if it has not been found yet
+static size_t object_id (void *obj) {
+  if (id_slots_count == 0) { return objects_count; }
+  for (size_t slot = id_slot(obj); id_slots[slot] != 0; slot = (slot + 1) & (id_slots_count - 1)) {
+    if (objects[id_slots[slot] - 1] == obj) { return id_slots[slot] - 1; }
+  }
+  return objects_count;
+}
+
+static void insert_id (size_t id) {
+  size_t slot = id_slot(objects[id]);
+  while (id_slots[slot] != 0) { slot = (slot + 1) & (id_slots_count - 1); }
+  id_slots[slot] = id + 1;
+}
+
+static void grow_tables (void) {
+  objects_capacity = MAX(2 * objects_capacity, 1024);
+  objects          = realloc(objects, objects_capacity * sizeof(void *));
+  free(id_slots);
+  // the table is kept at most half full
+  id_slots_count = 2 * objects_capacity;
+  id_slots       = calloc(id_slots_count, sizeof(size_t));
+  if (objects == NULL || id_slots == NULL) {
+    perror("ERROR: heap census: unable to grow the table of objects\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < objects_count; ++i) { insert_id(i); }
+}
+
+static void visit (size_t word) {
+  void *obj = (void *)word;
+  if (!is_valid_heap_pointer(obj) || object_id(obj) < objects_count) { return; }
+  if (objects_count == objects_capacity) { grow_tables(); }
+  objects[objects_count] = obj;
+  insert_id(objects_count++);
+}
+
+static void scan_roots (void (*f)(size_t)) {
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) { f(*p); }
+  for (int i = 0; i < extra_roots.current_free; ++i) { f(*(size_t *)extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (const size_t *p = &__start_custom_data; p < &__stop_custom_data; ++p) { f(*p); }
+#endif
+}
+
+static void find_reachable_objects (void) {
+  objects_count = 0;
+  if (id_slots != NULL) { memset(id_slots, 0, id_slots_count * sizeof(size_t)); }
+  scan_roots(visit);
+  for (size_t scan = 0; scan < objects_count; ++scan) {
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(objects[scan]));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      visit(*(size_t *)it.cur_field);
+    }
+  }
+}
+
+static lama_type object_type (void *obj) {
+  lama_type t = get_type_row_ptr(obj);
+  return t == SMALL_SEXP ? SEXP : t == ROPE ? STRING : t;
+}
+
+static int object_tag_hash (void *obj) { return SEXP_TAG_HASH(TO_DATA(obj)); }
+
+static size_t object_bytes (void *obj) { return obj_size_row_ptr(obj); }
+
+// ============================================================================
+//                                Census
+// ============================================================================
+
+static void add_to_entry (heap_census_entry *e, size_t bytes) {
+  ++e->count;
+  e->bytes += bytes;
+}
+
+static void add_sexp_tag (int tag_hash, size_t bytes) {
+  // programs have few constructors, a linear search is enough
+  for (size_t i = 0; i < census.sexp_tags_count; ++i) {
+    if (census.sexp_tags[i].tag_hash == tag_hash) {
+      add_to_entry(&census.sexp_tags[i].total, bytes);
+      return;
+    }
+  }
+  census.sexp_tags =
+      realloc(census.sexp_tags, (census.sexp_tags_count + 1) * sizeof(heap_census_tag));
+  if (census.sexp_tags == NULL) {
+    perror("ERROR: heap census: unable to grow the table of tags\n");
+    exit(1);
+  }
+  census.sexp_tags[census.sexp_tags_count++] =
+      (heap_census_tag){.tag_hash = tag_hash, .total = {.count = 1, .bytes = bytes}};
+}
+
+static int compare_tags_by_bytes (const void *a, const void *b) {
+  size_t ba = ((const heap_census_tag *)a)->total.bytes;
+  size_t bb = ((const heap_census_tag *)b)->total.bytes;
+  return ba < bb ? 1 : ba > bb ? -1 : 0;
+}
+
+const heap_census_stats *heap_take_census (void) {
+  find_reachable_objects();
+  heap_census_tag *tags = census.sexp_tags;
+  census = (heap_census_stats){.sexp_tags = tags};
+  for (size_t i = 0; i < objects_count; ++i) {
+    void  *obj   = objects[i];
+    size_t bytes = object_bytes(obj);
+    switch (object_type(obj)) {
+      case STRING: add_to_entry(&census.strings, bytes); break;
+      case ARRAY: add_to_entry(&census.arrays, bytes); break;
+      case CLOSURE: add_to_entry(&census.closures, bytes); break;
+      default:
+        add_to_entry(&census.sexps, bytes);
+        add_sexp_tag(object_tag_hash(obj), bytes);
+        break;
+    }
+  }
+  qsort(census.sexp_tags, census.sexp_tags_count, sizeof(heap_census_tag), compare_tags_by_bytes);
+  return &census;
+}
+
+static void print_entry (FILE *f, const char *indent, const char *name, heap_census_entry e) {
+  fprintf(f, "%s%-*s %10zu objects %12zu bytes\n", indent, 18 - (int)strlen(indent), name, e.count, e.bytes);
+}
+
+void heap_census (FILE *f) {
+  const heap_census_stats *c = heap_take_census();
+  fprintf(f,
+          "Heap census: %zu reachable objects, %zu bytes\n",
+          c->strings.count + c->arrays.count + c->closures.count + c->sexps.count,
+          c->strings.bytes + c->arrays.bytes + c->closures.bytes + c->sexps.bytes);
+  print_entry(f, "  ", "strings", c->strings);
+  print_entry(f, "  ", "arrays", c->arrays);
+  print_entry(f, "  ", "closures", c->closures);
+  print_entry(f, "  ", "s-expressions", c->sexps);
+  for (size_t i = 0; i < c->sexp_tags_count; ++i) {
+    print_entry(f, "    ", de_hash(c->sexp_tags[i].tag_hash), c->sexp_tags[i].total);
+  }
+}
+
+// ============================================================================
+//                               Snapshots
+// ============================================================================
+
+static void put_number (FILE *f, size_t n) {
+  for (; n >= 0x80; n >>= 7) { fputc((int)(n & 0x7F) | 0x80, f); }
+  fputc((int)n, f);
+}
+
+// arguments of the root callbacks
+static ISOLATE_LOCAL FILE  *snapshot_file;
+static ISOLATE_LOCAL size_t roots_count;
+
+static void count_root (size_t word) { roots_count += is_valid_heap_pointer((void *)word); }
+
+static void put_root (size_t word) {
+  if (is_valid_heap_pointer((void *)word)) { put_number(snapshot_file, object_id((void *)word)); }
+}
+
+bool heap_snapshot (const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    perror("ERROR: heap_snapshot: unable to open the file\n");
+    return false;
+  }
+  const heap_census_stats *c = heap_take_census();
+
+  fwrite(HEAP_SNAPSHOT_MAGIC, 1, strlen(HEAP_SNAPSHOT_MAGIC), f);
+  put_number(f, HEAP_SNAPSHOT_VERSION);
+  put_number(f, c->sexp_tags_count);
+  for (size_t i = 0; i < c->sexp_tags_count; ++i) {
+    const char *name = de_hash(c->sexp_tags[i].tag_hash);
+    put_number(f, c->sexp_tags[i].tag_hash);
+    put_number(f, strlen(name));
+    fwrite(name, 1, strlen(name), f);
+  }
+
+  put_number(f, objects_count);
+  for (size_t i = 0; i < objects_count; ++i) {
+    void     *obj = objects[i];
+    lama_type t   = object_type(obj);
+    put_number(f, t);
+    if (t == SEXP) { put_number(f, object_tag_hash(obj)); }
+    put_number(f, object_bytes(obj));
+    size_t refs = 0;
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      refs += is_valid_heap_pointer(*(void **)it.cur_field);
+    }
+    put_number(f, refs);
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      void *field = *(void **)it.cur_field;
+      if (is_valid_heap_pointer(field)) { put_number(f, object_id(field)); }
+    }
+  }
+
+  roots_count = 0;
+  scan_roots(count_root);
+  put_number(f, roots_count);
+  snapshot_file = f;
+  scan_roots(put_root);
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    perror("ERROR: heap_snapshot: unable to write the file\n");
+    return false;
+  }
+  return true;
+}
+
+// ============================================================================
+//                                Signals
+// ============================================================================
+
+// the flags and the bump limit are those of the thread the signal is delivered to
+static void request_heap_dump (int sig) {
+  if (sig == SIGUSR1) {
+    heap_census_requested = 1;
+  } else {
+    heap_snapshot_requested = 1;
+  }
+  // the inline allocation path does not look at the flags, allocations are sent to `alloc_words`
+  gc_bump_limit = NULL;
+}
+
+void heap_dump_init (void) {
+  if (getenv("LAMA_HEAP_SIGNALS") == NULL) { return; }
+  signal(SIGUSR1, request_heap_dump);
+  signal(SIGUSR2, request_heap_dump);
+}
+
+void heap_dump_safepoint (void) {
+  if (heap_census_requested) {
+    heap_census_requested = 0;
+    heap_census(stderr);
+  }
+  if (heap_snapshot_requested) {
+    heap_snapshot_requested = 0;
+    char path[64];
+#ifdef LAMA_ISOLATES
+    // every isolate numbers its snapshots
+    snprintf(path,
+             sizeof(path),
+             "lama-heap.%d.%d.%zu.snapshot",
+             (int)getpid(),
+             (int)syscall(SYS_gettid),
+             snapshots_written++);
+#else
+    snprintf(path, sizeof(path), "lama-heap.%d.%zu.snapshot", (int)getpid(), snapshots_written++);
+#endif
+    if (heap_snapshot(path)) { fprintf(stderr, "heap snapshot is written to %s\n", path); }
+  }
+}
@@ -0,0 +1,426 @@
+// ============================================================================
+//                     Mark-region collector (Immix-style)
+// ============================================================================
+// Non-moving alternative to the LISP2 collector, selected by LAMA_GC=mark-region.
+// The heap is a contiguous reserved address range divided into blocks, each
+// block is divided into lines. Marking marks objects and all the lines they
+// cover; lines without marks are free. Allocation is a bump pointer over runs
+// of free lines, the runs are looked up lazily by the allocator itself from the
+// line marks of the last collection, so there is no sweep phase. Objects that
+// are longer than a line and do not fit into the current run go to a separate
+// "overflow" block. Objects are copied only out of blocks that the previous
+// collection found fragmented: they are evacuated into a headroom of empty
+// blocks while being marked, every reference to them is updated on the fly.
+#define _GNU_SOURCE 1
+
+#include "gc.h"
+
+#include "runtime_common.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+extern ISOLATE_LOCAL memory_chunk     heap;
+extern ISOLATE_LOCAL extra_roots_pool extra_roots;
+extern ISOLATE_LOCAL size_t           __gc_stack_top, __gc_stack_bottom;
+#ifdef LAMA_ENV
+extern const size_t __start_custom_data, __stop_custom_data;
+#endif
+
+// line states, a collection sets LINE_LIVE for every line covered by a live object
+enum { LINE_FREE = 0, LINE_LIVE = 1, LINE_CLAIMED = 2 };
+
+static ISOLATE_LOCAL size_t  *reserved_begin  = NULL;
+static ISOLATE_LOCAL size_t   reserved_bytes  = 0;
+static ISOLATE_LOCAL size_t   max_blocks      = 0;
+// blocks [0, used_blocks) are available to the allocator, next `headroom_blocks` blocks are
+// reserved as evacuation targets
+static ISOLATE_LOCAL size_t   used_blocks     = 0;
+static ISOLATE_LOCAL size_t   headroom_blocks = 0;
+static ISOLATE_LOCAL uint8_t *line_marks      = NULL;
+// number of lines marked in each block by the last collection
+static ISOLATE_LOCAL uint16_t *block_live_lines = NULL;
+static ISOLATE_LOCAL bool     *evacuate         = NULL;
+
+// value of the mark bit that means "marked" in the current collection, it flips every collection,
+// so marks of surviving objects do not have to be cleared
+static ISOLATE_LOCAL size_t mark_parity = 0;
+
+// lazy sweep position of the allocator and the end of the current run of free lines
+static ISOLATE_LOCAL size_t  alloc_block = 0;
+static ISOLATE_LOCAL size_t  alloc_line  = 0;
+static ISOLATE_LOCAL size_t *run_limit   = NULL;
+// bump area for objects longer than a line that do not fit into the current run
+static ISOLATE_LOCAL size_t *overflow_cursor = NULL;
+static ISOLATE_LOCAL size_t *overflow_limit  = NULL;
+// bump area in the headroom used for evacuation during a collection
+static ISOLATE_LOCAL size_t  evacuation_block  = 0;
+static ISOLATE_LOCAL size_t *evacuation_cursor = NULL;
+static ISOLATE_LOCAL size_t *evacuation_limit  = NULL;
+
+static ISOLATE_LOCAL void  **mark_stack          = NULL;
+static ISOLATE_LOCAL size_t  mark_stack_size     = 0;
+static ISOLATE_LOCAL size_t  mark_stack_capacity = 0;
+
+static inline size_t *block_begin (size_t b) { return heap.begin + b * MR_BLOCK_WORDS; }
+
+static inline size_t block_of (void *p) {
+  return ((size_t *)p - heap.begin) / MR_BLOCK_WORDS;
+}
+
+static inline size_t line_of (void *p) { return ((size_t *)p - heap.begin) / MR_LINE_WORDS; }
+
+#ifdef COMPACT_HEADERS
+// marks are kept in the bitmap of gc.c, it is cleared before each collection
+static inline bool mr_is_marked (void *obj) { return is_marked(obj); }
+
+static inline void mr_mark_object (void *obj) { mark_object(obj); }
+#else
+static inline bool mr_is_marked (void *obj) {
+  return (TO_DATA(obj)->forward_address & 1) == mark_parity;
+}
+
+static inline void mr_mark_object (void *obj) {
+  data *d            = TO_DATA(obj);
+  d->forward_address = (d->forward_address & ~(size_t)1) | mark_parity;
+}
+#endif
+
+// an evacuated object has the address of its copy's header in place of its own header
+static inline bool is_forwarded (void *header_ptr) { return (*(size_t *)header_ptr & 3) == 0; }
+
+// header size does not depend on the object type, so it can be found even if the header is overwritten
+static inline void *header_of (void *obj) { return (char *)obj - DATA_HEADER_SZ; }
+
+static inline size_t obj_words (void *header_ptr) {
+  return BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+}
+
+static void set_lines (void *header_ptr, size_t words, uint8_t state) {
+  size_t first = line_of(header_ptr), last = line_of((size_t *)header_ptr + words - 1);
+  memset(line_marks + first, state, last - first + 1);
+}
+
+static bool block_is_empty (size_t b) {
+  uint8_t *marks = line_marks + b * MR_LINES_PER_BLOCK;
+  for (size_t l = 0; l < MR_LINES_PER_BLOCK; ++l) {
+    if (marks[l] != LINE_FREE) { return false; }
+  }
+  return true;
+}
+
+static void mr_out_of_memory (void) {
+  fprintf(stderr, "ERROR: mark-region heap is exhausted (%zu bytes reserved)\n", reserved_bytes);
+  exit(1);
+}
+
+// makes `n` more blocks available to the allocator, the headroom moves right after them
+static bool grow_blocks (size_t n) {
+  if (used_blocks + n + headroom_blocks > max_blocks) { return false; }
+  size_t *old_end = heap.end;
+  used_blocks += n;
+  heap.end  = block_begin(used_blocks + headroom_blocks);
+  heap.size = heap.end - heap.begin;
+  // blocks past the end hold no objects, so they may be pre-faulted
+  if (heap.end > old_end) { heap_prepare_range(old_end, WORDS_TO_BYTES(heap.end - old_end)); }
+  return true;
+}
+
+// ============================================================================
+//                               Allocation
+// ============================================================================
+
+// moves the bump pointer to the next run of free lines, returns false when all blocks are passed
+static bool next_free_run (void) {
+  while (alloc_block < used_blocks) {
+    uint8_t *marks = line_marks + alloc_block * MR_LINES_PER_BLOCK;
+    while (alloc_line < MR_LINES_PER_BLOCK && marks[alloc_line] != LINE_FREE) { ++alloc_line; }
+    if (alloc_line < MR_LINES_PER_BLOCK) {
+      size_t first = alloc_line;
+      while (alloc_line < MR_LINES_PER_BLOCK && marks[alloc_line] == LINE_FREE) { ++alloc_line; }
+      heap.current = block_begin(alloc_block) + first * MR_LINE_WORDS;
+      run_limit    = block_begin(alloc_block) + alloc_line * MR_LINE_WORDS;
+      return true;
+    }
+    ++alloc_block;
+    alloc_line = 0;
+  }
+  return false;
+}
+
+// finds `n` contiguous empty blocks that the bump allocator has not reached yet and claims them
+static size_t *claim_free_blocks (size_t n) {
+  size_t run = 0;
+  for (size_t b = alloc_block + 1; b < used_blocks; ++b) {
+    run = block_is_empty(b) ? run + 1 : 0;
+    if (run == n) {
+      size_t first = b + 1 - n;
+      memset(line_marks + first * MR_LINES_PER_BLOCK, LINE_CLAIMED, n * MR_LINES_PER_BLOCK);
+      return block_begin(first);
+    }
+  }
+  return NULL;
+}
+
+static size_t *claim_or_grow (size_t n) {
+  size_t *p = claim_free_blocks(n);
+  if (p == NULL && grow_blocks(n)) { p = claim_free_blocks(n); }
+  return p;
+}
+
+static void *bump (size_t **cursor, size_t *limit, size_t words) {
+  if (*cursor == NULL || *cursor + words > limit) { return NULL; }
+  void *p = *cursor;
+  *cursor += words;
+  return p;
+}
+
+static void *try_alloc (size_t words) {
+  void *p;
+  if (words > MR_BLOCK_WORDS) {
+    // large objects get a run of whole blocks
+    return claim_or_grow((words - 1) / MR_BLOCK_WORDS + 1);
+  }
+  if ((p = bump(&heap.current, run_limit, words)) != NULL) { return p; }
+  if (words > MR_LINE_WORDS) {
+    // do not skip free runs just because a medium object does not fit in the current one
+    if ((p = bump(&overflow_cursor, overflow_limit, words)) != NULL) { return p; }
+    size_t *block = claim_or_grow(1);
+    if (block == NULL) { return NULL; }
+    overflow_cursor = block;
+    overflow_limit  = block + MR_BLOCK_WORDS;
+    return bump(&overflow_cursor, overflow_limit, words);
+  }
+  while (next_free_run()) {
+    if ((p = bump(&heap.current, run_limit, words)) != NULL) { return p; }
+  }
+  return NULL;
+}
+
+void *mr_alloc_on_existing_heap (size_t words, bool zeroed) {
+  void *p = try_alloc(words);
+  // free lines keep objects that died, so they are always dirty
+  if (p != NULL && zeroed) { memset(p, 0, WORDS_TO_BYTES(words)); }
+  return p;
+}
+
+void *mr_alloc_after_collection (size_t words) {
+  void *p = mr_alloc_on_existing_heap(words, true);
+  if (p == NULL) {
+    // the collection was not able to free enough lines for this object
+    if (!grow_blocks((words - 1) / MR_BLOCK_WORDS + 1)) { mr_out_of_memory(); }
+    p = mr_alloc_on_existing_heap(words, true);
+    if (p == NULL) { mr_out_of_memory(); }
+  }
+  return p;
+}
+
+// ============================================================================
+//                       Marking and evacuation
+// ============================================================================
+
+static void mark_stack_push (void *obj) {
+  if (mark_stack_size == mark_stack_capacity) {
+    mark_stack_capacity = MAX(2 * mark_stack_capacity, GREY_STACK_INIT_CAPACITY);
+    mark_stack          = realloc(mark_stack, mark_stack_capacity * sizeof(void *));
+    if (mark_stack == NULL) {
+      perror("ERROR: mark_stack_push: unable to grow the mark stack\n");
+      exit(1);
+    }
+  }
+  mark_stack[mark_stack_size++] = obj;
+}
+
+static void *evacuation_alloc (size_t words) {
+  void *p = bump(&evacuation_cursor, evacuation_limit, words);
+  while (p == NULL && words <= MR_BLOCK_WORDS && evacuation_block < headroom_blocks) {
+    evacuation_cursor = block_begin(used_blocks + evacuation_block++);
+    evacuation_limit  = evacuation_cursor + MR_BLOCK_WORDS;
+    p                 = bump(&evacuation_cursor, evacuation_limit, words);
+  }
+  return p;
+}
+
+// `slot` holds a reference to be traced, it is updated if the object is (or gets) evacuated
+static void process_slot (size_t *slot) {
+  void *obj = (void *)*slot;
+  if (!is_valid_heap_pointer(obj)) { return; }
+  void *header = header_of(obj);
+  if (is_forwarded(header)) {
+    *slot = *(size_t *)header + ((size_t)obj - (size_t)header);
+    return;
+  }
+  if (mr_is_marked(obj)) { return; }
+  size_t words = obj_words(header);
+  if (evacuate[block_of(header)]) {
+    void *copy = evacuation_alloc(words);
+    if (copy != NULL) {
+      memcpy(copy, header, WORDS_TO_BYTES(words));
+      *(size_t *)header = (size_t)copy;
+      obj               = (char *)copy + ((size_t)obj - (size_t)header);
+      header            = copy;
+      *slot             = (size_t)obj;
+    }
+  }
+  mr_mark_object(obj);
+  set_lines(header, words, LINE_LIVE);
+  mark_stack_push(obj);
+}
+
+static void drain_mark_stack (void) {
+  while (mark_stack_size > 0) {
+    void *obj = mark_stack[--mark_stack_size];
+    for (obj_field_iterator it = ptr_field_begin_iterator(header_of(obj));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      process_slot((size_t *)it.cur_field);
+    }
+  }
+}
+
+static void scan_roots (void) {
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    process_slot(p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) {
+    process_slot((size_t *)extra_roots.roots[i]);
+  }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    process_slot(p);
+  }
+#endif
+}
+
+// Blocks where the last collection found only a few live lines are evacuated, as long as their
+// live data fits into the headroom. When the live set is stable there are no such blocks and
+// nothing is copied.
+static void select_evacuation_candidates (void) {
+  size_t budget = headroom_blocks * MR_LINES_PER_BLOCK, fragmented = 0;
+  memset(evacuate, 0, used_blocks * sizeof(bool));
+  for (size_t b = 0; b < used_blocks; ++b) {
+    size_t live = block_live_lines[b];
+    if (live == 0 || live > MR_LINES_PER_BLOCK / MR_FRAGMENTED_BLOCK_RATIO) { continue; }
+    if (live > budget) { continue; }
+    evacuate[b] = true;
+    budget -= live;
+    ++fragmented;
+  }
+  if (fragmented < MR_MIN_EVACUATED_BLOCKS) { memset(evacuate, 0, used_blocks * sizeof(bool)); }
+}
+
+void mr_collect (void) {
+  select_evacuation_candidates();
+  memset(line_marks, 0, (used_blocks + headroom_blocks) * MR_LINES_PER_BLOCK);
+  mark_parity       = 1 - mark_parity;
+#ifdef COMPACT_HEADERS
+  clear_mark_bitmap();
+#endif
+  evacuation_block  = 0;
+  evacuation_cursor = evacuation_limit = NULL;
+
+  scan_roots();
+  drain_mark_stack();
+
+  // headroom blocks that received evacuated objects become ordinary blocks
+  used_blocks += evacuation_block;
+  headroom_blocks = MIN(headroom_blocks, max_blocks - used_blocks);
+  heap.end  = block_begin(used_blocks + headroom_blocks);
+  heap.size = heap.end - heap.begin;
+
+  size_t live_lines = 0;
+  for (size_t b = 0; b < used_blocks; ++b) {
+    uint8_t *marks = line_marks + b * MR_LINES_PER_BLOCK;
+    size_t   live  = 0;
+    for (size_t l = 0; l < MR_LINES_PER_BLOCK; ++l) { live += marks[l] != LINE_FREE; }
+    block_live_lines[b] = live;
+    live_lines += live;
+  }
+
+  gc_stats_collection_done(live_lines * MR_LINE_WORDS);
+
+  size_t wanted_words = gc_heap_words_after_collection(live_lines * MR_LINE_WORDS, 0);
+  size_t wanted       = (wanted_words - 1) / MR_BLOCK_WORDS + 1;
+  if (wanted > used_blocks) {
+    grow_blocks(MIN(wanted - used_blocks, max_blocks - used_blocks - headroom_blocks));
+  }
+
+  // start the lazy sweep over the heap from the beginning
+  alloc_block     = 0;
+  alloc_line      = 0;
+  heap.current    = run_limit = NULL;
+  overflow_cursor     = overflow_limit = NULL;
+#ifndef COMPACT_HEADERS
+  gc_allocation_color = mark_parity;
+#endif
+}
+
+// ============================================================================
+//                            Initialization
+// ============================================================================
+
+void mr_init (void) {
+  char *env      = getenv("LAMA_GC_MAX_HEAP");
+  reserved_bytes = env != NULL ? (size_t)atoll(env) : MR_DEFAULT_RESERVED_BYTES;
+  max_blocks     = MAX(reserved_bytes / WORDS_TO_BYTES(MR_BLOCK_WORDS), MR_INITIAL_BLOCKS + 2);
+  reserved_bytes = max_blocks * WORDS_TO_BYTES(MR_BLOCK_WORDS);
+
+  // blocks are aligned by their size (by a huge page if they are used), so the mapping is larger
+  // than needed
+  size_t align = heap_pages != HEAP_PAGES_SMALL ? MAX(HUGE_PAGE_BYTES, WORDS_TO_BYTES(MR_BLOCK_WORDS))
+                                                : WORDS_TO_BYTES(MR_BLOCK_WORDS);
+  size_t mapping_bytes = reserved_bytes + align;
+  char  *mapping       = mmap(NULL,
+                       mapping_bytes,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT,
+                       -1,
+                       0);
+  if (mapping == MAP_FAILED) {
+    perror("ERROR: mr_init: mmap failed\n");
+    exit(1);
+  }
+  if (heap_pages != HEAP_PAGES_SMALL) { madvise(mapping, mapping_bytes, MADV_HUGEPAGE); }
+  reserved_begin = (size_t *)mapping;
+  heap.begin     = (size_t *)(((size_t)mapping + align - 1) & ~(align - 1));
+  reserved_bytes = mapping_bytes;
+
+  line_marks       = calloc(max_blocks * MR_LINES_PER_BLOCK, sizeof(uint8_t));
+  block_live_lines = calloc(max_blocks, sizeof(uint16_t));
+  evacuate         = calloc(max_blocks, sizeof(bool));
+  if (line_marks == NULL || block_live_lines == NULL || evacuate == NULL) {
+    perror("ERROR: mr_init: unable to allocate block metadata\n");
+    exit(1);
+  }
+
+  used_blocks     = 0;
+  headroom_blocks = MAX(max_blocks / MR_HEADROOM_RATIO, 1);
+  grow_blocks(MR_INITIAL_BLOCKS);
+  alloc_block     = 0;
+  alloc_line      = 0;
+  heap.current    = run_limit = NULL;
+  overflow_cursor = overflow_limit = NULL;
+  // objects allocated between collections carry the mark of the previous collection,
+  // i.e. they are not marked from the point of view of the next one
+  mark_parity         = 0;
+  gc_allocation_color = mark_parity;
+#ifdef COMPACT_HEADERS
+  resize_mark_bitmap(max_blocks * MR_BLOCK_WORDS + MR_BLOCK_WORDS);
+#endif
+}
+
+void mr_shutdown (void) {
+  munmap(reserved_begin, reserved_bytes);
+  free(line_marks);
+  free(block_live_lines);
+  free(evacuate);
+  free(mark_stack);
+  line_marks       = NULL;
+  block_live_lines = NULL;
+  evacuate         = NULL;
+  mark_stack       = NULL;
+  mark_stack_size = mark_stack_capacity = 0;
+}
@@ -6,8 +6,9 @@
 
 #include "gc.h"
 #include "runtime_common.h"
+#include "word_scan.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern ISOLATE_LOCAL size_t __gc_stack_top, __gc_stack_bottom;
 
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
@@ -18,7 +19,20 @@ extern size_t __gc_stack_top, __gc_stack_bottom;
 #define POST_GC()                                                                                  \
   if (flag) { __gc_stack_top = 0; }
 
+typedef enum { IO_UNDECIDED, IO_INTERACTIVE, IO_BATCH } io_mode_kind;
+
+static ISOLATE_LOCAL io_mode_kind io_mode = IO_UNDECIDED;
+
+ISOLATE_LOCAL void (*failure_handler)(const char *message) = NULL;
+
 static void vfailure (char *s, va_list args) {
+  // whatever the program has written goes before the failure message
+  if (io_mode == IO_BATCH) { flush_output(); }
+  if (failure_handler != NULL) {
+    char message[FAILURE_MESSAGE_SIZE];
+    vsnprintf(message, sizeof(message), s, args);
+    failure_handler(message);
+  }
   fprintf(stderr, "*** FAILURE: ");
   vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
   exit(255);
@@ -50,22 +64,22 @@ void Lassert (void *f, char *s, ...) {
   while (0)
 #define ASSERT_STRING(memo, x)                                                                     \
   do                                                                                               \
-    if (!UNBOXED(x) && TAG(TO_DATA(x)->data_header) != STRING_TAG)                                 \
+    if (!UNBOXED(x) && KIND(TO_DATA(x)->data_header) != STRING_TAG)                                \
       failure("string value expected in %s\n", memo);                                              \
   while (0)
 
 extern void *Bsexp (int n, ...);
 extern int   LtagHash (char *);
 
-void *global_sysargs;
-void *global_stdout;
-void *global_stderr;
+ISOLATE_LOCAL void *global_sysargs;
+ISOLATE_LOCAL void *global_stdout;
+ISOLATE_LOCAL void *global_stderr;
 
 // Gets a raw data_header
 extern int LkindOf (void *p) {
   if (UNBOXED(p)) return UNBOXED_TAG;
 
-  return TAG(TO_DATA(p)->data_header);
+  return KIND(TO_DATA(p)->data_header);
 }
 
 // Compare s-exprs tags
@@ -78,8 +92,8 @@ extern int LcompareTags (void *p, void *q) {
   pd = TO_DATA(p);
   qd = TO_DATA(q);
 
-  if (TAG(pd->data_header) == SEXP_TAG && TAG(qd->data_header) == SEXP_TAG) {
-    return BOX((TO_SEXP(p)->tag) - (TO_SEXP(q)->tag));
+  if (KIND(pd->data_header) == SEXP_TAG && KIND(qd->data_header) == SEXP_TAG) {
+    return BOX(SEXP_TAG_HASH(pd) - SEXP_TAG_HASH(qd));
   } else {
     failure("not a sexpr in compareTags: %d, %d\n", TAG(pd->data_header), TAG(qd->data_header));
   }
@@ -208,7 +222,7 @@ int Ls__Infix_37 (void *p, void *q) {
 
 extern int Llength (void *p) {
   ASSERT_BOXED(".length", p);
-  return BOX(LEN(TO_DATA(p)->data_header));
+  return BOX(OBJ_LEN(TO_DATA(p)->data_header));
 }
 
 static char *chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
@@ -240,7 +254,7 @@ extern int LtagHash (char *s) {
 }
 
 char *de_hash (int n) {
-  static char buf[6] = {0, 0, 0, 0, 0, 0};
+  static ISOLATE_LOCAL char buf[6] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
   p                  = &buf[5];
 
@@ -260,24 +274,46 @@ typedef struct {
   int   len;
 } StringBuf;
 
-static StringBuf stringBuf;
+// The buffer is a scratch arena shared by all string building functions: it is allocated once
+// and reused, the result is copied to a heap string of the exact size by `stringBufToHeap`.
+// A buffer that has grown for a very long string is given back on the next use.
+static ISOLATE_LOCAL StringBuf stringBuf;
 
 #define STRINGBUF_INIT 128
+#define STRINGBUF_KEEP (1 << 20)
 
 static void createStringBuf () {
-  stringBuf.contents = (char *)malloc(STRINGBUF_INIT);
-  memset(stringBuf.contents, 0, STRINGBUF_INIT);
-  stringBuf.ptr = 0;
-  stringBuf.len = STRINGBUF_INIT;
+  if (stringBuf.len > STRINGBUF_KEEP) {
+    free(stringBuf.contents);
+    stringBuf.contents = NULL;
+  }
+  if (stringBuf.contents == NULL) {
+    stringBuf.contents = (char *)malloc(STRINGBUF_INIT);
+    stringBuf.len      = STRINGBUF_INIT;
+    if (stringBuf.contents == NULL) { failure("createStringBuf: out of memory\n"); }
+  }
+  stringBuf.contents[0] = 0;
+  stringBuf.ptr         = 0;
 }
 
-static void deleteStringBuf () { free(stringBuf.contents); }
-
 static void extendStringBuf () {
   int len = stringBuf.len << 1;
 
   stringBuf.contents = (char *)realloc(stringBuf.contents, len);
   stringBuf.len      = len;
+  if (stringBuf.contents == NULL) { failure("extendStringBuf: out of memory\n"); }
+}
+
+// copies the buffer to a new heap string, `root` is kept alive over the allocation
+static void *stringBufToHeap (void **root) {
+  data *r;
+
+  push_extra_root(root);
+  r = (data *)alloc_string(stringBuf.ptr);
+  pop_extra_root(root);
+  memcpy(r->contents, stringBuf.contents, stringBuf.ptr + 1);
+
+  return r->contents;
 }
 
 static void vprintStringBuf (char *fmt, va_list args) {
@@ -310,6 +346,260 @@ static void printStringBuf (char *fmt, ...) {
   vprintStringBuf(fmt, args);
 }
 
+static void appendStringBuf (char *s, int len) {
+  while (stringBuf.ptr + len >= stringBuf.len) { extendStringBuf(); }
+  memcpy(&stringBuf.contents[stringBuf.ptr], s, len);
+  stringBuf.ptr += len;
+  stringBuf.contents[stringBuf.ptr] = 0;
+}
+
+/* Ropes */
+// `++` of strings of ROPE_MIN_LENGTH bytes or more makes a rope: an object with the two parts in
+// place of the copied bytes, so a string built by `++` in a loop costs linear time. The parts are
+// ropes and strings that belong to ropes only, so they never change. Where the bytes have to be
+// contiguous a rope is flattened (`Bflatten`): the flat copy is kept in the first field and the
+// second one becomes BOX(0). Printing, comparison and hashing walk the parts instead.
+// The flat copy may be read by ropes that have this rope as a part, so `Bsta` on a rope changes
+// a private copy kept in the first field, the shared one is moved to the second field, and
+// ROPE_MUTATED_FLAG is set. Such a rope is copied, not shared, when it is concatenated.
+// A flat rope also stands for a string literal, its flat copy is then outside the heap.
+#define ROPE_MIN_LENGTH 256
+#define ROPE_MUTATED_FLAG 0x80000000
+#define ROPE_CURSOR_INIT_DEPTH 64
+
+#define ROPE_LEFT(d) (((int *)(d)->contents)[0])
+#define ROPE_RIGHT(d) (((int *)(d)->contents)[1])
+#define IS_ROPE(p) (!UNBOXED(p) && TAG(TO_DATA(p)->data_header) == ROPE_TAG)
+#define IS_MUTATED_ROPE(d) ((d)->data_header & ROPE_MUTATED_FLAG)
+#define IS_FLAT_ROPE(d) (IS_MUTATED_ROPE(d) || ROPE_RIGHT(d) == BOX(0))
+
+// walks the bytes of a string or a rope piece by piece, nothing may be allocated meanwhile
+typedef struct {
+  void **stack;   // parts to visit, the next one is on the top
+  int    depth, capacity;
+  void  *init_stack[ROPE_CURSOR_INIT_DEPTH];
+} rope_cursor;
+
+static void rope_cursor_push (rope_cursor *c, void *p) {
+  if (c->depth == c->capacity) {
+    void **stack = malloc(2 * c->capacity * sizeof(void *));
+    if (stack == NULL) { failure("rope: out of memory\n"); }
+    memcpy(stack, c->stack, c->capacity * sizeof(void *));
+    if (c->stack != c->init_stack) { free(c->stack); }
+    c->stack = stack;
+    c->capacity *= 2;
+  }
+  c->stack[c->depth++] = p;
+}
+
+static void rope_cursor_init (rope_cursor *c, void *p) {
+  c->stack    = c->init_stack;
+  c->depth    = 0;
+  c->capacity = ROPE_CURSOR_INIT_DEPTH;
+  // a changed rope is seen by its parents as it was, and by itself as it is
+  if (IS_ROPE(p) && IS_MUTATED_ROPE(TO_DATA(p))) { p = (void *)ROPE_LEFT(TO_DATA(p)); }
+  rope_cursor_push(c, p);
+}
+
+// gives the next non-empty piece, returns false at the end
+static bool rope_cursor_next (rope_cursor *c, char **piece, int *len) {
+  while (c->depth > 0) {
+    data *d = TO_DATA(c->stack[--c->depth]);
+    if (TAG(d->data_header) == ROPE_TAG) {
+      if (IS_MUTATED_ROPE(d)) {
+        rope_cursor_push(c, (void *)ROPE_RIGHT(d));
+      } else if (IS_FLAT_ROPE(d)) {
+        rope_cursor_push(c, (void *)ROPE_LEFT(d));
+      } else {
+        rope_cursor_push(c, (void *)ROPE_RIGHT(d));
+        rope_cursor_push(c, (void *)ROPE_LEFT(d));
+      }
+    } else if (LEN(d->data_header) > 0) {
+      *piece = d->contents;
+      *len   = LEN(d->data_header);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void rope_cursor_free (rope_cursor *c) {
+  if (c->stack != c->init_stack) { free(c->stack); }
+}
+
+static void copy_string_bytes (char *dst, void *p) {
+  rope_cursor c;
+  char       *piece;
+  int         len;
+
+  rope_cursor_init(&c, p);
+  while (rope_cursor_next(&c, &piece, &len)) {
+    memcpy(dst, piece, len);
+    dst += len;
+  }
+  rope_cursor_free(&c);
+}
+
+static void appendStringBytes (void *p) {
+  rope_cursor c;
+  char       *piece;
+  int         len;
+
+  rope_cursor_init(&c, p);
+  while (rope_cursor_next(&c, &piece, &len)) { appendStringBuf(piece, len); }
+  rope_cursor_free(&c);
+}
+
+// compares strings or ropes as strcmp does
+static int compare_string_bytes (void *p, void *q) {
+  rope_cursor cp, cq;
+  char       *sp = NULL, *sq = NULL;
+  int         lp = 0, lq = 0, result = 0;
+
+  rope_cursor_init(&cp, p);
+  rope_cursor_init(&cq, q);
+  for (;;) {
+    if (lp == 0 && !rope_cursor_next(&cp, &sp, &lp)) {
+      result = lq > 0 || rope_cursor_next(&cq, &sq, &lq) ? -(unsigned char)*sq : 0;
+      break;
+    }
+    if (lq == 0 && !rope_cursor_next(&cq, &sq, &lq)) {
+      result = (unsigned char)*sp;
+      break;
+    }
+    int n = MIN(lp, lq);
+    if ((result = memcmp(sp, sq, n)) != 0) { break; }
+    sp += n;
+    sq += n;
+    lp -= n;
+    lq -= n;
+  }
+  rope_cursor_free(&cp);
+  rope_cursor_free(&cq);
+  return result;
+}
+
+// a new string with the bytes of the string or the rope
+static void *copy_string (void *p) {
+  int   n = LEN(TO_DATA(p)->data_header);
+  data *s;
+
+  push_extra_root(&p);
+  s = (data *)alloc_string(n);
+  pop_extra_root(&p);
+  copy_string_bytes(s->contents, p);
+  s->contents[n] = 0;
+
+  return s->contents;
+}
+
+// returns the contents of the string or the flat copy of the rope
+extern void *Bflatten (void *p) {
+  data *d;
+  void *s;
+
+  if (!IS_ROPE(p)) return p;
+
+  d = TO_DATA(p);
+  if (IS_FLAT_ROPE(d)) return (void *)ROPE_LEFT(d);
+
+  PRE_GC();
+
+  push_extra_root(&p);
+  s = copy_string(p);
+  pop_extra_root(&p);
+
+  d = TO_DATA(p);
+  gc_write_barrier((void *)ROPE_LEFT(d));
+  gc_write_barrier((void *)ROPE_RIGHT(d));
+  ROPE_LEFT(d)  = (int)s;
+  ROPE_RIGHT(d) = BOX(0);
+
+  POST_GC();
+
+  return s;
+}
+
+// the flat copy that only this rope has
+static char *rope_mutable_contents (void *p) {
+  data *d = TO_DATA(p);
+  void *s;
+
+  if (IS_MUTATED_ROPE(d)) return (char *)ROPE_LEFT(d);
+
+  PRE_GC();
+
+  push_extra_root(&p);
+  s = copy_string(Bflatten(p));
+  pop_extra_root(&p);
+
+  d = TO_DATA(p);
+  gc_write_barrier((void *)ROPE_LEFT(d));
+  ROPE_RIGHT(d) = ROPE_LEFT(d);
+  ROPE_LEFT(d)  = (int)s;
+  d->data_header |= ROPE_MUTATED_FLAG;
+
+  POST_GC();
+
+  return s;
+}
+
+// `a` and `b` are strings or ropes of ROPE_MIN_LENGTH bytes or more in total
+static void *make_rope (void *a, void *b) {
+  data *d     = TO_DATA(a);
+  int   la    = LEN(d->data_header), lb = LEN(TO_DATA(b)->data_header);
+  void *left  = (void *)BOX(0);
+  void *right = (void *)BOX(0);
+
+  push_extra_root(&a);
+  push_extra_root(&b);
+  push_extra_root(&left);
+  push_extra_root(&right);
+  if (TAG(d->data_header) == ROPE_TAG && !IS_FLAT_ROPE(d) && !IS_ROPE(ROPE_RIGHT(d))
+      && LEN(TO_DATA(ROPE_RIGHT(d))->data_header) + lb < ROPE_MIN_LENGTH) {
+    // strings appended one by one would make a rope per string, instead the short last part of
+    // `a` is copied together with `b`
+    int   lr = LEN(TO_DATA(ROPE_RIGHT(d))->data_header);
+    data *r  = (data *)alloc_string(lr + lb);
+    d        = TO_DATA(a);
+    memcpy(r->contents, (char *)ROPE_RIGHT(d), lr);
+    copy_string_bytes(r->contents + lr, b);
+    r->contents[lr + lb] = 0;
+    left  = (void *)ROPE_LEFT(d);
+    right = r->contents;
+  } else {
+    // strings may change and so do ropes with ROPE_MUTATED_FLAG, they are copied
+    left  = IS_ROPE(a) && !IS_MUTATED_ROPE(TO_DATA(a)) ? a : copy_string(a);
+    right = IS_ROPE(b) && !IS_MUTATED_ROPE(TO_DATA(b)) ? b : copy_string(b);
+  }
+  d = (data *)alloc_rope(la + lb);
+  pop_extra_root(&right);
+  pop_extra_root(&left);
+  pop_extra_root(&b);
+  pop_extra_root(&a);
+
+  ROPE_LEFT(d)  = (int)left;
+  ROPE_RIGHT(d) = (int)right;
+
+  return d->contents;
+}
+
+// the same as Bflatten for two strings, each is kept alive while the other one is flattened
+static void flatten_strings (void **x, void **y) {
+  if (!IS_ROPE(*x) && !IS_ROPE(*y)) return;
+
+  PRE_GC();
+
+  push_extra_root(y);
+  *x = Bflatten(*x);
+  pop_extra_root(y);
+  push_extra_root(x);
+  *y = Bflatten(*y);
+  pop_extra_root(x);
+
+  POST_GC();
+}
+
 static void printValue (void *p) {
   data *a = (data *)BOX(NULL);
   int   i = BOX(0);
@@ -323,8 +613,14 @@ static void printValue (void *p) {
 
     a = TO_DATA(p);
 
-    switch (TAG(a->data_header)) {
-      case STRING_TAG: printStringBuf("\"%s\"", a->contents); break;
+    switch (KIND(a->data_header)) {
+      case STRING_TAG:
+        if (TAG(a->data_header) == ROPE_TAG) {
+          printStringBuf("\"");
+          appendStringBytes(p);
+          printStringBuf("\"");
+        } else printStringBuf("\"%s\"", a->contents);
+        break;
 
       case CLOSURE_TAG: {
 
@@ -348,28 +644,27 @@ static void printValue (void *p) {
       }
 
       case SEXP_TAG: {
-        sexp *sa  = (sexp *)a;
-        char *tag = de_hash(sa->tag);
+        char *tag = de_hash(SEXP_TAG_HASH(a));
         if (strcmp(tag, "cons") == 0) {
-          sexp *sb = sa;
+          data *sb = a;
           printStringBuf("{");
-          while (LEN(sb->data_header)) {
-            printValue((void *)((int *)sb->contents)[0]);
-            int list_next = ((int *)sb->contents)[1];
+          while (OBJ_LEN(sb->data_header)) {
+            printValue((void *)SEXP_FIELDS(sb)[0]);
+            int list_next = SEXP_FIELDS(sb)[1];
             if (!UNBOXED(list_next)) {
               printStringBuf(", ");
-              sb = TO_SEXP(list_next);
+              sb = TO_DATA(list_next);
             } else break;
           }
           printStringBuf("}");
         } else {
           printStringBuf("%s", tag);
-          sexp *sexp_a = (sexp *)a;
-          if (LEN(a->data_header)) {
+          int n = OBJ_LEN(a->data_header);
+          if (n) {
             printStringBuf(" (");
-            for (i = 0; i < LEN(sexp_a->data_header); i++) {
-              printValue((void *)((int *)sexp_a->contents)[i]);
-              if (i != LEN(sexp_a->data_header) - 1) printStringBuf(", ");
+            for (i = 0; i < n; i++) {
+              printValue((void *)SEXP_FIELDS(a)[i]);
+              if (i != n - 1) printStringBuf(", ");
             }
             printStringBuf(")");
           }
@@ -390,20 +685,23 @@ static void stringcat (void *p) {
   else {
     a = TO_DATA(p);
 
-    switch (TAG(a->data_header)) {
-      case STRING_TAG: printStringBuf("%s", a->contents); break;
+    switch (KIND(a->data_header)) {
+      case STRING_TAG:
+        if (TAG(a->data_header) == ROPE_TAG) appendStringBytes(p);
+        else printStringBuf("%s", a->contents);
+        break;
 
       case SEXP_TAG: {
-        char *tag = de_hash(TO_SEXP(p)->tag);
+        char *tag = de_hash(SEXP_TAG_HASH(a));
 
         if (strcmp(tag, "cons") == 0) {
-          sexp *b = (sexp *)a;
+          data *b = a;
 
-          while (LEN(b->data_header)) {
-            stringcat((void *)((int *)b->contents)[0]);
-            int next_b = ((int *)b->contents)[1];
+          while (OBJ_LEN(b->data_header)) {
+            stringcat((void *)SEXP_FIELDS(b)[0]);
+            int next_b = SEXP_FIELDS(b)[1];
             if (!UNBOXED(next_b)) {
-              b = TO_SEXP(next_b);
+              b = TO_DATA(next_b);
             } else break;
           }
         } else printStringBuf("*** non-list data_header: %s ***", tag);
@@ -425,13 +723,17 @@ extern int Llowercase (void *v) {
 }
 
 extern int LmatchSubString (char *subj, char *patt, int pos) {
-  data *p = TO_DATA(patt), *s = TO_DATA(subj);
+  data *p, *s;
   int   n;
 
   ASSERT_STRING("matchSubString:1", subj);
   ASSERT_STRING("matchSubString:2", patt);
   ASSERT_UNBOXED("matchSubString:3", pos);
 
+  flatten_strings((void **)&subj, (void **)&patt);
+  p = TO_DATA(patt);
+  s = TO_DATA(subj);
+
   n = LEN(p->data_header);
 
   if (n + UNBOX(pos) > LEN(s->data_header)) return BOX(0);
@@ -440,13 +742,16 @@ extern int LmatchSubString (char *subj, char *patt, int pos) {
 }
 
 extern void *Lsubstring (void *subj, int p, int l) {
-  data *d  = TO_DATA(subj);
+  data *d;
   int   pp = UNBOX(p), ll = UNBOX(l);
 
   ASSERT_STRING("substring:1", subj);
   ASSERT_UNBOXED("substring:2", p);
   ASSERT_UNBOXED("substring:3", l);
 
+  subj = Bflatten(subj);
+  d    = TO_DATA(subj);
+
   if (pp + ll <= LEN(d->data_header)) {
     data *r;
 
@@ -473,6 +778,8 @@ extern void *Lsubstring (void *subj, int p, int l) {
 extern struct re_pattern_buffer *Lregexp (char *regexp) {
   regex_t *b = (regex_t *)malloc(sizeof(regex_t));
 
+  regexp = Bflatten(regexp);
+
   /* printf ("regexp: %s,\t%x\n", regexp, b); */
 
   memset(b, 0, sizeof(regex_t));
@@ -491,6 +798,8 @@ extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
   ASSERT_STRING("regexpMatch:2", s);
   ASSERT_UNBOXED("regexpMatch:3", pos);
 
+  s = Bflatten(s);
+
   res = re_match(b, s, LEN(TO_DATA(s)->data_header), UNBOX(pos), 0);
 
   /* printf ("regexpMatch %x: %s, res=%d\n", b, s+UNBOX(pos), res); */
@@ -513,28 +822,42 @@ void *Lclone (void *p) {
 
   data *a = TO_DATA(p);
   int   t = TAG(a->data_header), l = LEN(a->data_header);
+  int   no_pointers = a->data_header & NO_POINTERS_FLAG;
 
+  // only contents are copied: the header of the clone (in particular its mark bit) is set by
+  // the allocator
   push_extra_root(&p);
   switch (t) {
     case STRING_TAG: res = Bstring(TO_DATA(p)->contents); break;
 
+    case ROPE_TAG: res = copy_string(p); break;
+
     case ARRAY_TAG:
       obj = (data *)alloc_array(l);
-      memcpy(obj, TO_DATA(p), array_size(l));
+      memcpy(obj->contents, p, array_size(l) - DATA_HEADER_SZ);
+      obj->data_header |= no_pointers;
       res = (void *)obj->contents;
       break;
     case CLOSURE_TAG:
       obj = (data *)alloc_closure(l);
-      memcpy(obj, TO_DATA(p), closure_size(l));
+      memcpy(obj->contents, p, closure_size(l) - DATA_HEADER_SZ);
       res = (void *)(obj->contents);
       break;
 
     case SEXP_TAG:
       obj = (data *)alloc_sexp(l);
-      memcpy(obj, TO_DATA(p), sexp_size(l));
+      memcpy(obj->contents, p, sexp_size(l) - DATA_HEADER_SZ);
       res = (void *)obj->contents;
       break;
 
+    case SMALL_SEXP_TAG: {
+      int n = SMALL_SEXP_LEN(a->data_header), hash = SMALL_SEXP_HASH(a->data_header);
+      obj   = (data *)alloc_sexp_tagged(n, hash);
+      memcpy(obj->contents, p, small_sexp_size(n) - DATA_HEADER_SZ);
+      res = (void *)obj->contents;
+      break;
+    }
+
     default: failure("invalid data_header %d in clone *****\n", t);
   }
   pop_extra_root(&p);
@@ -543,65 +866,117 @@ void *Lclone (void *p) {
   return res;
 }
 
-#define HASH_DEPTH 3
+/* Structural hash and comparison */
+// Both walk the objects with an explicit stack of field ranges instead of the C stack. A range is
+// popped before its last field is visited, so a walk along a list takes constant space. Nothing is
+// allocated on the heap meanwhile. The hash takes the first HASH_VALUES values in depth-first
+// order into account.
+#define HASH_VALUES 256
 #define HASH_APPEND(acc, x)                                                                        \
   (((acc + (unsigned)x) << (WORD_SIZE / 2)) | ((acc + (unsigned)x) >> (WORD_SIZE / 2)))
+#define WALK_INIT_DEPTH 64
 
-int inner_hash (int depth, unsigned acc, void *p) {
-  if (depth > HASH_DEPTH) return acc;
+typedef struct {
+  int *a, *b;   // the next fields of one or two objects
+  int  n;       // the number of fields left
+} walk_frame;
 
-  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer(p)) {
-    data *a = TO_DATA(p);
-    int   t = TAG(a->data_header), l = LEN(a->data_header), i;
+typedef struct {
+  walk_frame *frames;
+  int         depth, capacity;
+  walk_frame  init_frames[WALK_INIT_DEPTH];
+} walk_stack;
+
+static void walk_init (walk_stack *w) {
+  w->frames   = w->init_frames;
+  w->depth    = 0;
+  w->capacity = WALK_INIT_DEPTH;
+}
+
+static void walk_push (walk_stack *w, int *a, int *b, int n) {
+  if (n <= 0) return;
+  if (w->depth == w->capacity) {
+    walk_frame *frames = malloc(2 * w->capacity * sizeof(walk_frame));
+    if (frames == NULL) { failure("walk_push: out of memory\n"); }
+    memcpy(frames, w->frames, w->capacity * sizeof(walk_frame));
+    if (w->frames != w->init_frames) { free(w->frames); }
+    w->frames = frames;
+    w->capacity *= 2;
+  }
+  w->frames[w->depth++] = (walk_frame){.a = a, .b = b, .n = n};
+}
 
-    acc = HASH_APPEND(acc, t);
-    acc = HASH_APPEND(acc, l);
+static void walk_free (walk_stack *w) {
+  if (w->frames != w->init_frames) { free(w->frames); }
+}
 
-    switch (t) {
-      case STRING_TAG: {
-        char *p = a->contents;
+// hashes the value without its fields, they are pushed to be hashed next
+static unsigned hash_value (unsigned acc, void *p, walk_stack *w) {
+  if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
+  if (!is_valid_heap_pointer(p)) return HASH_APPEND(acc, p);
 
-        while (*p) {
-          int n = (int)*p++;
-          acc   = HASH_APPEND(acc, n);
-        }
+  data *a      = TO_DATA(p);
+  int   t      = KIND(a->data_header), l = OBJ_LEN(a->data_header);
+  int  *fields = (int *)a->contents;
+
+  acc = HASH_APPEND(acc, t);
+  acc = HASH_APPEND(acc, l);
 
-        return acc;
+  switch (t) {
+    case STRING_TAG: {
+      rope_cursor c;
+      char       *piece;
+      int         len;
+
+      rope_cursor_init(&c, p);
+      while (rope_cursor_next(&c, &piece, &len)) {
+        while (len--) acc = HASH_APPEND(acc, (int)*piece++);
       }
+      rope_cursor_free(&c);
+      break;
+    }
 
-      case CLOSURE_TAG:
-        acc = HASH_APPEND(acc, ((void **)a->contents)[0]);
-        i   = 1;
-        break;
+    case CLOSURE_TAG:
+      acc = HASH_APPEND(acc, fields[0]);
+      walk_push(w, fields + 1, NULL, l - 1);
+      break;
 
-      case ARRAY_TAG: i = 0; break;
+    case ARRAY_TAG: walk_push(w, fields, NULL, l); break;
 
-      case SEXP_TAG: {
-        int ta = TO_SEXP(p)->tag;
-        acc    = HASH_APPEND(acc, ta);
-        i      = 1;
-        ++l;
-        break;
-      }
+    case SEXP_TAG:
+      acc = HASH_APPEND(acc, SEXP_TAG_HASH(a));
+      walk_push(w, SEXP_FIELDS(a), NULL, l);
+      break;
 
-      default: failure("invalid data_header %d in hash *****\n", t);
-    }
+    default: failure("invalid data_header %d in hash *****\n", t);
+  }
+  return acc;
+}
+
+extern int Lhash (void *p) {
+  walk_stack w;
+  unsigned   acc;
 
-    for (; i < l; i++) acc = inner_hash(depth + 1, acc, ((void **)a->contents)[i]);
+  walk_init(&w);
+  acc = hash_value(0, p, &w);
+  for (int values = 1; values < HASH_VALUES && w.depth > 0; ++values) {
+    walk_frame *f = &w.frames[w.depth - 1];
+    void       *q = (void *)*f->a++;
+    if (--f->n == 0) w.depth--;
+    acc = hash_value(acc, q, &w);
+  }
+  walk_free(&w);
 
-    return acc;
-  } else return HASH_APPEND(acc, p);
+  return BOX(0x3fffff & acc);
 }
 
 extern void *LstringInt (char *b) {
   int n;
+  b = Bflatten(b);
   sscanf(b, "%d", &n);
   return (void *)BOX(n);
 }
 
-extern int Lhash (void *p) { return BOX(0x3fffff & inner_hash(0, 0, p)); }
-
 extern int LflatCompare (void *p, void *q) {
   if (UNBOXED(p)) {
     if (UNBOXED(q)) { return BOX(UNBOX(p) - UNBOX(q)); }
@@ -612,7 +987,9 @@ extern int LflatCompare (void *p, void *q) {
   } else BOX(1);
 }
 
-extern int Lcompare (void *p, void *q) {
+// compares the values without their fields: returns the result if they differ, otherwise returns
+// BOX(0) and pushes the fields to be compared next
+static int compare_value (void *p, void *q, walk_stack *w) {
 #define COMPARE_AND_RETURN(x, y)                                                                   \
   do                                                                                               \
     if (x != y) return BOX(x - y);                                                                 \
@@ -628,48 +1005,77 @@ extern int Lcompare (void *p, void *q) {
     if (is_valid_heap_pointer(p)) {
       if (is_valid_heap_pointer(q)) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
-        int   ta = TAG(a->data_header), tb = TAG(b->data_header);
-        int   la = LEN(a->data_header), lb = LEN(b->data_header);
-        int   i;
-        int   shift = 0;
+        int   ta = KIND(a->data_header), tb = KIND(b->data_header);
+        int   la = OBJ_LEN(a->data_header), lb = OBJ_LEN(b->data_header);
+        int  *fa = (int *)a->contents, *fb = (int *)b->contents;
+        int   c;
 
         COMPARE_AND_RETURN(ta, tb);
 
         switch (ta) {
-          case STRING_TAG: return BOX(strcmp(a->contents, b->contents));
+          case STRING_TAG:
+            if (TAG(a->data_header) == ROPE_TAG || TAG(b->data_header) == ROPE_TAG) {
+              c = compare_string_bytes(p, q);
+            } else {
+              c = memcmp(a->contents, b->contents, MIN(la, lb));
+              if (c == 0) return BOX(la - lb);
+            }
+            return BOX(c < 0 ? -1 : c > 0);
 
           case CLOSURE_TAG:
             COMPARE_AND_RETURN(((void **)a->contents)[0], ((void **)b->contents)[0]);
             COMPARE_AND_RETURN(la, lb);
-            i = 1;
+            walk_push(w, fa + 1, fb + 1, la - 1);
             break;
 
           case ARRAY_TAG:
             COMPARE_AND_RETURN(la, lb);
-            i = 0;
+            walk_push(w, fa, fb, la);
             break;
 
           case SEXP_TAG: {
-            int tag_a = TO_SEXP(p)->tag, tag_b = TO_SEXP(q)->tag;
+            int tag_a = SEXP_TAG_HASH(a), tag_b = SEXP_TAG_HASH(b);
             COMPARE_AND_RETURN(tag_a, tag_b);
             COMPARE_AND_RETURN(la, lb);
-            i     = 0;
-            shift = 1;
+            walk_push(w, SEXP_FIELDS(a), SEXP_FIELDS(b), la);
             break;
           }
 
           default: failure("invalid data_header %d in compare *****\n", ta);
         }
-
-        for (; i < la; i++) {
-          int c = Lcompare(((void **)a->contents)[i + shift], ((void **)b->contents)[i + shift]);
-          if (c != BOX(0)) return c;
-        }
         return BOX(0);
       } else return BOX(-1);
     } else if (is_valid_heap_pointer(q)) return BOX(1);
     else return BOX(p - q);
   }
+#undef COMPARE_AND_RETURN
+}
+
+extern int Lcompare (void *p, void *q) {
+  walk_stack w;
+  int        result;
+
+  walk_init(&w);
+  result = compare_value(p, q, &w);
+  while (result == BOX(0) && w.depth > 0) {
+    walk_frame *f = &w.frames[w.depth - 1];
+    // equal words are equal values, they are skipped several at a time
+    int i = (int)find_mismatch_word((size_t *)f->a, (size_t *)f->b, f->n);
+    if (i == f->n) {
+      w.depth--;
+      continue;
+    }
+    p = (void *)f->a[i];
+    q = (void *)f->b[i];
+    f->a += i + 1;
+    f->b += i + 1;
+    f->n -= i + 1;
+    if (f->n == 0) w.depth--;
+    result = compare_value(p, q, &w);
+  }
+  walk_free(&w);
+
+  return result;
 }
 
 extern void *Belem (void *p, int i) {
@@ -683,24 +1089,27 @@ extern void *Belem (void *p, int i) {
 
   switch (TAG(a->data_header)) {
     case STRING_TAG: return (void *)BOX(a->contents[i]);
+    case ROPE_TAG: return (void *)BOX(((char *)Bflatten(p))[i]);
     case SEXP_TAG: return (void *)((int *)a->contents)[i + 1];
+    // small s-expressions, arrays and closures keep elements right at the contents
     default: return (void *)((int *)a->contents)[i];
   }
 }
 
 extern void *LmakeArray (int length) {
   data *r;
-  int   n, *p;
+  int   n;
 
   ASSERT_UNBOXED("makeArray:1", length);
 
   PRE_GC();
 
   n = UNBOX(length);
-  r = (data *)alloc_array(n);
+  // the elements are written once, the allocator does not zero them
+  r = (data *)alloc_uninitialized_array(n);
+  r->data_header |= NO_POINTERS_FLAG;
 
-  p = (int *)r->contents;
-  while (n--) *p++ = BOX(0);
+  fill_words((size_t *)r->contents, BOX(0), n);
 
   POST_GC();
 
@@ -731,13 +1140,125 @@ extern void *Bstring (void *p) {
   push_extra_root(&p);
   s = LmakeString(BOX(n));
   pop_extra_root(&p);
-  strncpy((char *)&TO_DATA(s)->contents, p, n + 1);   // +1 because of '\0' in the end of C-strings
+  memcpy((char *)&TO_DATA(s)->contents, p, n + 1);   // +1 because of '\0' in the end of C-strings
 
   POST_GC();
 
   return s;
 }
 
+/* Literals */
+// A string literal is materialised once, as a string in the constant area: memory that the
+// collectors do not manage, so the string is never moved and never freed. Each evaluation of the
+// literal gives a new flat rope with the shared string as its flat copy (see "Ropes"): it costs an
+// allocation of a constant size instead of a copy, and `Bsta` copies the bytes only when the
+// program changes them. Literals not longer than such a rope are copied as by `Bstring`.
+// Shared strings have LITERAL_FLAG in the header and are never changed.
+#define LITERAL_FLAG 0x80000000
+#define CONSTANT_AREA_CHUNK (1 << 16)
+#define LITERALS_INIT_SLOTS 256
+
+typedef struct {
+  const char *key;   // the address of the literal in the program
+  data       *obj;
+} literal_slot;
+
+// chunks are linked through their first words, the last one is the head
+static ISOLATE_LOCAL void         *constant_area_chunks = NULL;
+static ISOLATE_LOCAL char         *constant_area_ptr = NULL, *constant_area_end = NULL;
+static ISOLATE_LOCAL literal_slot *literals          = NULL;
+static ISOLATE_LOCAL size_t        literals_count = 0, literals_slots = 0;
+
+static void *constant_area_alloc (size_t bytes) {
+  bytes = WORDS_TO_BYTES(BYTES_TO_WORDS(bytes));
+  if (constant_area_ptr == NULL || constant_area_ptr + bytes > constant_area_end) {
+    size_t chunk = MAX(bytes + sizeof(void *), CONSTANT_AREA_CHUNK);
+    void **c     = calloc(chunk, 1);
+    if (c == NULL) { failure("literal: out of memory\n"); }
+    *c                   = constant_area_chunks;
+    constant_area_chunks = c;
+    constant_area_ptr    = (char *)(c + 1);
+    constant_area_end    = (char *)c + chunk;
+  }
+  void *p = constant_area_ptr;
+  constant_area_ptr += bytes;
+  return p;
+}
+
+static inline size_t literal_slot_of (const char *key) {
+  // `literals_slots` is a power of two
+  return (((size_t)key >> 2) * 2654435769u) & (literals_slots - 1);
+}
+
+static void grow_literals (void) {
+  literal_slot *old   = literals;
+  size_t        slots = literals_slots;
+
+  literals_slots = slots == 0 ? LITERALS_INIT_SLOTS : 2 * slots;
+  literals       = calloc(literals_slots, sizeof(literal_slot));
+  if (literals == NULL) { failure("literal: out of memory\n"); }
+  for (size_t i = 0; i < slots; i++) {
+    if (old[i].key == NULL) continue;
+    size_t j = literal_slot_of(old[i].key);
+    while (literals[j].key != NULL) { j = (j + 1) & (literals_slots - 1); }
+    literals[j] = old[i];
+  }
+  free(old);
+}
+
+// the shared string of the literal at `p`, `p` stays the same while the program runs
+static data *literal_object (const char *p) {
+  size_t i;
+
+  // the table is kept at most half full
+  if (2 * (literals_count + 1) > literals_slots) { grow_literals(); }
+  for (i = literal_slot_of(p); literals[i].key != NULL; i = (i + 1) & (literals_slots - 1)) {
+    if (literals[i].key == p) return literals[i].obj;
+  }
+
+  int   n = strlen(p);
+  data *d = constant_area_alloc(string_size(n));
+  d->data_header = STRING_TAG | (n << 3) | LITERAL_FLAG;
+  memcpy(d->contents, p, n + 1);
+  literals[i] = (literal_slot){.key = p, .obj = d};
+  literals_count++;
+  return d;
+}
+
+void release_literals (void) {
+  free(literals);
+  literals       = NULL;
+  literals_count = literals_slots = 0;
+  // the current chunk is the last one, the others are reached through their first word
+  while (constant_area_chunks != NULL) {
+    void *next = *(void **)constant_area_chunks;
+    free(constant_area_chunks);
+    constant_area_chunks = next;
+  }
+  constant_area_ptr = constant_area_end = NULL;
+}
+
+extern void *Bliteral (void *p) {
+  data *lit = literal_object(p);
+  int   n   = LEN(lit->data_header);
+  data *d;
+
+  PRE_GC();
+
+  if (string_size(n) <= rope_size()) {
+    d = (data *)alloc_string(n);
+    memcpy(d->contents, lit->contents, n + 1);
+  } else {
+    d             = (data *)alloc_rope(n);
+    ROPE_LEFT(d)  = (int)lit->contents;
+    ROPE_RIGHT(d) = BOX(0);
+  }
+
+  POST_GC();
+
+  return d->contents;
+}
+
 extern void *Lstringcat (void *p) {
   void *s;
 
@@ -748,11 +1269,7 @@ extern void *Lstringcat (void *p) {
   createStringBuf();
   stringcat(p);
 
-  push_extra_root(&p);
-  s = Bstring(stringBuf.contents);
-  pop_extra_root(&p);
-
-  deleteStringBuf();
+  s = stringBufToHeap(&p);
 
   POST_GC();
 
@@ -767,11 +1284,7 @@ extern void *Lstring (void *p) {
   createStringBuf();
   printValue(p);
 
-  push_extra_root(&p);
-  s = Bstring(stringBuf.contents);
-  pop_extra_root(&p);
-
-  deleteStringBuf();
+  s = stringBufToHeap(&p);
 
   POST_GC();
 
@@ -791,7 +1304,7 @@ extern void *Bclosure (int bn, void *entry, ...) {
   argss = (ebp + 12);
   for (i = 0; i < n; i++, argss++) { push_extra_root((void **)argss); }
 
-  r = (data *)alloc_closure(n + 1);
+  r = (data *)alloc_uninitialized_closure(n + 1);
   push_extra_root((void **)&r);
   ((void **)r->contents)[0] = entry;
 
@@ -814,29 +1327,26 @@ extern void *Bclosure (int bn, void *entry, ...) {
 
 extern void *Barray (int bn, ...) {
   va_list args;
-  int     i, ai;
   data   *r;
   int     n = UNBOX(bn);
 
   PRE_GC();
 
-  r = (data *)alloc_array(n);
+  r = (data *)alloc_uninitialized_array(n);
 
   va_start(args, bn);
-
-  for (i = 0; i < n; i++) {
-    ai                      = va_arg(args, int);
-    ((int *)r->contents)[i] = ai;
-  }
-
+  // the arguments lie in memory one after another, as fix_unboxed assumes
+  memcpy(r->contents, (size_t *)args, n * sizeof(int));
   va_end(args);
 
+  if (find_boxed_word((size_t *)r->contents, n) == n) r->data_header |= NO_POINTERS_FLAG;
+
   POST_GC();
   return r->contents;
 }
 
 #ifdef DEBUG_VERSION
-extern memory_chunk heap;
+extern ISOLATE_LOCAL memory_chunk heap;
 #endif
 
 extern void *Bsexp (int bn, ...) {
@@ -849,19 +1359,24 @@ extern void *Bsexp (int bn, ...) {
 
   PRE_GC();
 
-  int fields_cnt   = n - 1;
-  r                = (data *)alloc_sexp(fields_cnt);
-  ((sexp *)r)->tag = 0;
+  int fields_cnt = n - 1;
+  int tag;
 
+  // the tag goes last, but it decides the representation of the s-expression
   va_start(args, bn);
+  for (i = 1; i < n; i++) va_arg(args, int);
+  tag = UNBOX(va_arg(args, int));
+  va_end(args);
 
-  for (i = 1; i < n; i++) {
-    ai                      = va_arg(args, int);
-    p                       = (size_t *)ai;
-    ((int *)r->contents)[i] = ai;
-  }
+  r = (data *)alloc_uninitialized_sexp_tagged(fields_cnt, tag);
 
-  ((sexp *)r)->tag = UNBOX(va_arg(args, int));
+  va_start(args, bn);
+
+  for (i = 0; i < fields_cnt; i++) {
+    ai                = va_arg(args, int);
+    p                 = (size_t *)ai;
+    SEXP_FIELDS(r)[i] = ai;
+  }
 
   va_end(args);
 
@@ -875,6 +1390,10 @@ extern int Btag (void *d, int t, int n) {
   if (UNBOXED(d)) return BOX(0);
   else {
     r = TO_DATA(d);
+    // a small s-expression matches iff its header is exactly the one it would be built with
+    if (TAG(r->data_header) == SMALL_SEXP_TAG)
+      return BOX(IS_SMALL_SEXP(UNBOX(n), UNBOX(t))
+                 && r->data_header == SMALL_SEXP_HEADER(UNBOX(n), UNBOX(t)));
     return BOX(TAG(r->data_header) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t)
                && LEN(r->data_header) == UNBOX(n));
   }
@@ -904,7 +1423,11 @@ extern int Bstring_patt (void *x, void *y) {
     rx = TO_DATA(x);
     ry = TO_DATA(y);
 
-    if (TAG(rx->data_header) != STRING_TAG) return BOX(0);
+    if (KIND(rx->data_header) != STRING_TAG) return BOX(0);
+
+    if (TAG(rx->data_header) == ROPE_TAG || TAG(ry->data_header) == ROPE_TAG) {
+      return BOX(LEN(rx->data_header) == LEN(ry->data_header) && compare_string_bytes(x, y) == 0);
+    }
 
     return BOX(strcmp(rx->contents, ry->contents) == 0 ? 1 : 0);
   }
@@ -929,13 +1452,13 @@ extern int Barray_tag_patt (void *x) {
 extern int Bstring_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == STRING_TAG);
+  return BOX(KIND(TO_DATA(x)->data_header) == STRING_TAG);
 }
 
 extern int Bsexp_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == SEXP_TAG);
+  return BOX(KIND(TO_DATA(x)->data_header) == SEXP_TAG);
 }
 
 extern void *Bsta (void *v, int i, void *x) {
@@ -945,24 +1468,84 @@ extern void *Bsta (void *v, int i, void *x) {
 
     switch (TAG(d->data_header)) {
       case STRING_TAG: {
+        if (d->data_header & LITERAL_FLAG) { failure(".sta: shared literal %p is changed\n", x); }
         ((char *)x)[UNBOX(i)] = (char)UNBOX(v);
         break;
       }
+      case ROPE_TAG: {
+        rope_mutable_contents(x)[UNBOX(i)] = (char)UNBOX(v);
+        break;
+      }
       case SEXP_TAG: {
+        gc_write_barrier((void *)((int *)x)[UNBOX(i) + 1]);
         ((int *)x)[UNBOX(i) + 1] = (int)v;
         break;
       }
+      case ARRAY_TAG: {
+        gc_write_barrier((void *)((int *)x)[UNBOX(i)]);
+        ((int *)x)[UNBOX(i)] = (int)v;
+        if (!UNBOXED(v)) d->data_header &= ~NO_POINTERS_FLAG;
+        break;
+      }
       default: {
+        gc_write_barrier((void *)((int *)x)[UNBOX(i)]);
         ((int *)x)[UNBOX(i)] = (int)v;
       }
     }
   } else {
+    gc_write_barrier(*(void **)x);
     *(void **)x = v;
   }
 
   return v;
 }
 
+// ropes among the format and the "%s" arguments are flattened, all of them are kept alive meanwhile
+static void flatten_format_args (char **fmt, va_list va) {
+  size_t *p     = (size_t *)va;
+  bool    ropes = IS_ROPE(*fmt);
+  int     n     = 0, i;
+  char   *s;
+
+  // the format is read from a copy, it may be a rope
+  createStringBuf();
+  appendStringBytes(*fmt);
+  for (s = stringBuf.contents; *s; s++) {
+    if (*s == '%') {
+      if (s[1] == 's' && is_valid_heap_pointer((size_t *)p[n]) && IS_ROPE(p[n])) ropes = true;
+      n++;
+    }
+  }
+  if (!ropes) return;
+
+  PRE_GC();
+
+  push_extra_root((void **)fmt);
+  for (s = stringBuf.contents, i = 0; *s; s++) {
+    if (*s == '%' && s[1] == 's' && is_valid_heap_pointer((size_t *)p[i])) {
+      push_extra_root((void **)&p[i]);
+    }
+    if (*s == '%') i++;
+  }
+  *fmt = Bflatten(*fmt);
+  for (s = stringBuf.contents, i = 0; *s; s++) {
+    if (*s == '%' && s[1] == 's' && is_valid_heap_pointer((size_t *)p[i])) {
+      p[i] = (size_t)Bflatten((void *)p[i]);
+    }
+    if (*s == '%') i++;
+  }
+  // the extra roots are popped in the reverse order
+  while (s-- != stringBuf.contents) {
+    if (*s == '%') i--;
+    if (*s == '%' && s[1] == 's' && is_valid_heap_pointer((size_t *)p[i])) {
+      pop_extra_root((void **)&p[i]);
+    }
+  }
+  pop_extra_root((void **)fmt);
+
+  POST_GC();
+}
+
 static void fix_unboxed (char *s, va_list va) {
   size_t *p = (size_t *)va;
   int     i = 0;
@@ -981,6 +1564,7 @@ extern void Lfailure (char *s, ...) {
   va_list args;
 
   va_start(args, s);
+  flatten_format_args(&s, args);
   fix_unboxed(s, args);
   vfailure(s, args);
 }
@@ -1008,6 +1592,13 @@ extern void * /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
 
   PRE_GC();
 
+  // shorter strings are made flat, the operands may still be ropes of literals
+  if (LEN(da->data_header) + LEN(db->data_header) >= ROPE_MIN_LENGTH) {
+    void *r = make_rope(a, b);
+    POST_GC();
+    return r;
+  }
+
   push_extra_root(&a);
   push_extra_root(&b);
   d = alloc_string(LEN(da->data_header) + LEN(db->data_header));
@@ -1017,8 +1608,8 @@ extern void * /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
   da = TO_DATA(a);
   db = TO_DATA(b);
 
-  strncpy(d->contents, da->contents, LEN(da->data_header));
-  strncpy(d->contents + LEN(da->data_header), db->contents, LEN(db->data_header));
+  copy_string_bytes(d->contents, a);
+  copy_string_bytes(d->contents + LEN(da->data_header), b);
   d->contents[LEN(da->data_header) + LEN(db->data_header)] = 0;
 
   POST_GC();
@@ -1033,6 +1624,7 @@ extern void *Lsprintf (char *fmt, ...) {
   ASSERT_STRING("sprintf:1", fmt);
 
   va_start(args, fmt);
+  flatten_format_args(&fmt, args);
   fix_unboxed(fmt, args);
 
   createStringBuf();
@@ -1041,19 +1633,15 @@ extern void *Lsprintf (char *fmt, ...) {
 
   PRE_GC();
 
-  push_extra_root((void **)&fmt);
-  s = Bstring(stringBuf.contents);
-  pop_extra_root((void **)&fmt);
+  s = stringBufToHeap((void **)&fmt);
 
   POST_GC();
 
-  deleteStringBuf();
-
   return s;
 }
 
 extern void *LgetEnv (char *var) {
-  char *e = getenv(var);
+  char *e = getenv(Bflatten(var));
   void *s;
 
   if (e == NULL) return (void *)BOX(0);
@@ -1067,15 +1655,17 @@ extern void *LgetEnv (char *var) {
   return s;
 }
 
-extern int Lsystem (char *cmd) { return BOX(system(cmd)); }
+extern int Lsystem (char *cmd) { return BOX(system(Bflatten(cmd))); }
 
 extern void Lfprintf (FILE *f, char *s, ...) {
   va_list args = (va_list)BOX(NULL);
 
   ASSERT_BOXED("fprintf:1", f);
   ASSERT_STRING("fprintf:2", s);
+  if (f == stdout && io_mode == IO_BATCH) { flush_output(); }
 
   va_start(args, s);
+  flatten_format_args(&s, args);
   fix_unboxed(s, args);
 
   if (vfprintf(f, s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
@@ -1085,8 +1675,10 @@ extern void Lprintf (char *s, ...) {
   va_list args = (va_list)BOX(NULL);
 
   ASSERT_STRING("printf:1", s);
+  if (io_mode == IO_BATCH) { flush_output(); }
 
   va_start(args, s);
+  flatten_format_args(&s, args);
   fix_unboxed(s, args);
 
   if (vprintf(s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
@@ -1100,6 +1692,8 @@ extern FILE *Lfopen (char *f, char *m) {
   ASSERT_STRING("fopen:1", f);
   ASSERT_STRING("fopen:2", m);
 
+  flatten_strings((void **)&f, (void **)&m);
+
   h = fopen(f, m);
 
   if (h) return h;
@@ -1113,9 +1707,140 @@ extern void Lfclose (FILE *f) {
   fclose(f);
 }
 
+/* Buffered I/O of "read", "write" and readLine */
+// In the interactive mode "read" prints a prompt and every written value is flushed at once.
+// The batch mode is for programs that read and write many numbers: there are no prompts, numbers
+// are parsed and formatted by hand in large buffers of stdin and stdout, and the output is flushed
+// at exit, on failure, before printf and before the input is refilled, i.e. before a read may
+// block. LAMA_IO=interactive or LAMA_IO=batch selects the mode, by default the batch one is used
+// if neither stdin nor stdout is a terminal.
+#define LAMA_IO_BUFFER_SIZE (1 << 16)
+
+static ISOLATE_LOCAL char   input_buffer[LAMA_IO_BUFFER_SIZE];
+static ISOLATE_LOCAL size_t input_pos = 0, input_len = 0;
+static ISOLATE_LOCAL char   output_buffer[LAMA_IO_BUFFER_SIZE];
+static ISOLATE_LOCAL size_t output_len = 0;
+
+// the exit handler is registered once per process, the flag is shared by isolates
+static bool flush_registered = false;
+
+void flush_output (void) {
+  // something may have been written by stdio before
+  fflush(stdout);
+  size_t len = output_len;
+  output_len = 0;
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(STDOUT_FILENO, output_buffer + done, len - done);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { failure("write (): %s\n", strerror(errno)); }
+    done += n;
+  }
+}
+
+static io_mode_kind get_io_mode (void) {
+  if (io_mode != IO_UNDECIDED) { return io_mode; }
+  char *env = getenv("LAMA_IO");
+  if (env == NULL) {
+    io_mode = !isatty(STDIN_FILENO) && !isatty(STDOUT_FILENO) ? IO_BATCH : IO_INTERACTIVE;
+  } else if (strcmp(env, "batch") == 0) {
+    io_mode = IO_BATCH;
+  } else if (strcmp(env, "interactive") == 0) {
+    io_mode = IO_INTERACTIVE;
+  } else {
+    failure("unknown LAMA_IO value '%s'\n", env);
+  }
+  if (io_mode == IO_BATCH && !__atomic_test_and_set(&flush_registered, __ATOMIC_RELAXED)) {
+    atexit(flush_output);
+  }
+  return io_mode;
+}
+
+void reset_input (void) {
+  input_pos = input_len = 0;
+  __fpurge(stdin);
+  clearerr(stdin);
+}
+
+// returns the next input character without consuming it, EOF at the end of the input
+static int peek_input (void) {
+  if (input_pos < input_len) { return (unsigned char)input_buffer[input_pos]; }
+  // the program may be waiting for an answer to what it has written
+  flush_output();
+  ssize_t n;
+  do { n = read(STDIN_FILENO, input_buffer, LAMA_IO_BUFFER_SIZE); } while (n < 0 && errno == EINTR);
+  if (n < 0) { failure("read (): %s\n", strerror(errno)); }
+  input_pos = 0;
+  input_len = n;
+  return n == 0 ? EOF : (unsigned char)input_buffer[0];
+}
+
+// the same as scanf("%d"): `*result` is not changed if there is no number
+static void read_int_batch (int *result) {
+  int c;
+  while ((c = peek_input()) != EOF && isspace(c)) { ++input_pos; }
+  bool negative = c == '-';
+  if (c == '-' || c == '+') {
+    ++input_pos;
+    c = peek_input();
+  }
+  if (c == EOF || !isdigit(c)) { return; }
+  unsigned value = 0;
+  for (; c != EOF && isdigit(c); c = peek_input()) {
+    value = value * 10 + (c - '0');
+    ++input_pos;
+  }
+  // -2147483648 is negated as unsigned, it is out of the range of int
+  *result = negative ? (int)(0u - value) : (int)value;
+}
+
+static void write_int_batch (int n) {
+  // sign, ten digits and a newline
+  if (output_len + 12 > LAMA_IO_BUFFER_SIZE) { flush_output(); }
+  char     digits[10];
+  int      len   = 0;
+  unsigned value = n < 0 ? -(unsigned)n : (unsigned)n;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  if (n < 0) { output_buffer[output_len++] = '-'; }
+  while (len > 0) { output_buffer[output_len++] = digits[--len]; }
+  output_buffer[output_len++] = '\n';
+}
+
+// the same as the interactive readLine: an empty line or the end of the input gives 0 and the
+// line break is not consumed
+static void *read_line_batch (void) {
+  int c = peek_input();
+  if (c == EOF || c == '\n') { return (void *)BOX(0); }
+  size_t len = 0, capacity = 64;
+  char  *buf = malloc(capacity);
+  if (buf == NULL) { failure("readLine (): %s\n", strerror(errno)); }
+  for (; c != EOF && c != '\n'; c = peek_input()) {
+    if (len + 1 == capacity) {
+      char *grown = realloc(buf, capacity *= 2);
+      // `failure` may return to the interpreter instead of exiting
+      if (grown == NULL) {
+        free(buf);
+        failure("readLine (): %s\n", strerror(errno));
+      }
+      buf = grown;
+    }
+    buf[len++] = c;
+    ++input_pos;
+  }
+  buf[len] = 0;
+  if (c == '\n') { ++input_pos; }
+  void *s = Bstring(buf);
+  free(buf);
+  return s;
+}
+
 extern void *LreadLine () {
   char *buf;
 
+  if (get_io_mode() == IO_BATCH) { return read_line_batch(); }
+
   if (scanf("%m[^\n]", &buf) == 1) {
     void *s = Bstring(buf);
 
@@ -1135,6 +1860,8 @@ extern void *Lfread (char *fname) {
 
   ASSERT_STRING("fread", fname);
 
+  fname = Bflatten(fname);
+
   f = fopen(fname, "r");
 
   if (f && fseek(f, 0l, SEEK_END) >= 0) {
@@ -1158,6 +1885,8 @@ extern void Lfwrite (char *fname, char *contents) {
   ASSERT_STRING("fwrite:1", fname);
   ASSERT_STRING("fwrite:2", contents);
 
+  flatten_strings((void **)&fname, (void **)&contents);
+
   f = fopen(fname, "w");
 
   if (f && !(fprintf(f, "%s", contents) < 0)) {
@@ -1172,6 +1901,8 @@ extern void *Lfexists (char *fname) {
 
   ASSERT_STRING("fexists", fname);
 
+  fname = Bflatten(fname);
+
   f = fopen(fname, "r");
 
   if (f) return (void *)BOX(1);
@@ -1191,6 +1922,11 @@ extern void *Ltl (void *v) { return Belem(v, BOX(1)); }
 extern int Lread () {
   int result = BOX(0);
 
+  if (get_io_mode() == IO_BATCH) {
+    read_int_batch(&result);
+    return BOX(result);
+  }
+
   printf("> ");
   fflush(stdout);
   scanf("%d", &result);
@@ -1210,6 +1946,11 @@ extern int Lbinoperror2 (void) {
 
 /* Lwrite is an implementation of the "write" construct */
 extern int Lwrite (int n) {
+  if (get_io_mode() == IO_BATCH) {
+    write_int_batch(UNBOX(n));
+    return 0;
+  }
+
   printf("%d\n", UNBOX(n));
   fflush(stdout);
 
@@ -1241,6 +1982,8 @@ extern void set_args (int argc, char *argv[]) {
   PRE_GC();
 
   p = LmakeArray(BOX(n));
+  // the array is filled with strings bypassing Bsta
+  TO_DATA(p)->data_header &= ~NO_POINTERS_FLAG;
   push_extra_root((void **)&p);
 
   for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
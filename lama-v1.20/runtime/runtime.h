@@ -8,13 +8,33 @@
 #include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "runtime_common.h"
 
 #define WORD_SIZE (CHAR_BIT * sizeof(int))
 
+#define FAILURE_MESSAGE_SIZE 1024
+
 void failure (char *s, ...);
 
+// if it is set, `failure` passes the message to it instead of printing the message and exiting,
+// the handler must not return (an embedding program longjmps to its own error path)
+extern ISOLATE_LOCAL void (*failure_handler)(const char *message);
+
+// writes what the batch mode (LAMA_IO) keeps in the output buffer, it is done at exit as well
+void flush_output (void);
+
+// drops the input read ahead by the batch mode and by stdio: stdin is about to be replaced
+void reset_input (void);
+
+// forgets the shared strings of literals (see Bliteral): the program that has them is unloaded,
+// and no object that refers to them is reachable
+void release_literals (void);
+
 #endif
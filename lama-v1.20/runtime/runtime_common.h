@@ -6,21 +6,67 @@
 //#define DEBUG_VERSION
 //#define FULL_INVARIANT_CHECKS
 
+// LAMA_ISOLATES builds the runtime for several programs running at once in one process, one per
+// thread (an isolate): the heap, the roots and the rest of the runtime state are thread-local,
+// so allocation takes no locks and a collection stops only its own thread
+#ifdef LAMA_ISOLATES
+#  define ISOLATE_LOCAL __thread
+#else
+#  define ISOLATE_LOCAL
+#endif
+
 #define STRING_TAG 0x00000001
 #define ARRAY_TAG 0x00000003
 #define SEXP_TAG 0x00000005
 #define CLOSURE_TAG 0x00000007
+// a long string made by `++` of two parts, strings or ropes, see "Ropes" in runtime.c;
+// LEN of the header is the length of the string
+#define ROPE_TAG 0x00000006
 #define UNBOXED_TAG 0x00000009   // Not actually a data_header; used to return from LkindOf
 
-#define LEN(x) ((x & 0xFFFFFFF8) >> 3)
+#define LEN(x) ((x & 0x7FFFFFF8) >> 3)
 #define TAG(x) (x & 0x00000007)
 
+// the highest header bit of an array says that none of its elements is a heap pointer, so the
+// collector does not look at them; LmakeArray and Barray set it, Bsta clears it on a pointer store.
+// Hence lengths of all objects are limited to 28 bits
+#define NO_POINTERS_FLAG 0x80000000
+#define HAS_NO_POINTERS(x) (((x) & (NO_POINTERS_FLAG | 0x00000007)) == (NO_POINTERS_FLAG | ARRAY_TAG))
+
+// S-expressions of 1 to SMALL_SEXP_MAX_FIELDS fields whose tag hash fits into
+// SMALL_SEXP_HASH_BITS bits (`cons` in particular) have no separate tag word:
+// the number of fields and the tag hash are packed into the header next to
+// SMALL_SEXP_TAG. KIND, OBJ_LEN, SEXP_TAG_HASH and SEXP_FIELDS hide the
+// difference from the code that does not care about it.
+#define SMALL_SEXP_TAG 0x00000002
+#define SMALL_SEXP_MAX_FIELDS 3
+#define SMALL_SEXP_HASH_BITS 27
+#define IS_SMALL_SEXP(n, hash)                                                                     \
+  ((n) >= 1 && (n) <= SMALL_SEXP_MAX_FIELDS && (unsigned)(hash) < (1u << SMALL_SEXP_HASH_BITS))
+#define SMALL_SEXP_HEADER(n, hash) ((int)(SMALL_SEXP_TAG | ((n) << 3) | ((unsigned)(hash) << 5)))
+#define SMALL_SEXP_LEN(x) (((x) >> 3) & 3)
+#define SMALL_SEXP_HASH(x) ((int)((unsigned)(x) >> 5))
+
+// kind of an object as Lama programs see it: small s-expressions are s-expressions, ropes are strings
+#define KIND(x)                                                                                    \
+  (TAG(x) == SMALL_SEXP_TAG ? SEXP_TAG : TAG(x) == ROPE_TAG ? STRING_TAG : TAG(x))
+// number of elements of any object
+#define OBJ_LEN(x) (TAG(x) == SMALL_SEXP_TAG ? SMALL_SEXP_LEN(x) : LEN(x))
+
 #define SEXP_ONLY_HEADER_SZ (sizeof(int))
 
+// with COMPACT_HEADERS objects have no forwarding word, marks and forwarding addresses are kept
+// by GC in side tables
+#ifdef COMPACT_HEADERS
+#  define FORWARD_WORD_SZ 0
+#else
+#  define FORWARD_WORD_SZ sizeof(size_t)
+#endif
+
 #ifndef DEBUG_VERSION
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (FORWARD_WORD_SZ + sizeof(int))
 #else
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (FORWARD_WORD_SZ + sizeof(size_t) + sizeof(int))
 #endif
 
 #define MEMBER_SIZE sizeof(int)
@@ -48,9 +94,11 @@ typedef struct {
   size_t id;
 #endif
 
+#ifndef COMPACT_HEADERS
   // last bit is used as MARK-BIT, the rest are used to store address where object should move
   // last bit can be used because due to alignment we can assume that last two bits are always 0's
   size_t forward_address;
+#endif
   char   contents[0];
 } data;
 
@@ -63,11 +111,19 @@ typedef struct {
   size_t id;
 #endif
 
+#ifndef COMPACT_HEADERS
   // last bit is used as MARK-BIT, the rest are used to store address where object should move
   // last bit can be used because due to alignment we can assume that last two bits are always 0's
   size_t forward_address;
+#endif
   int    tag;
   int    contents[0];
 } sexp;
 
+// take a pointer to the header of an s-expression of any form
+#define SEXP_TAG_HASH(d)                                                                           \
+  (TAG((d)->data_header) == SMALL_SEXP_TAG ? SMALL_SEXP_HASH((d)->data_header) : ((sexp *)(d))->tag)
+#define SEXP_FIELDS(d)                                                                             \
+  (TAG((d)->data_header) == SMALL_SEXP_TAG ? (int *)(d)->contents : ((sexp *)(d))->contents)
+
 #endif
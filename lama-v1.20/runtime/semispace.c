@@ -0,0 +1,178 @@
+// ============================================================================
+//                       Cheney semispace collector
+// ============================================================================
+// Copying alternative to the LISP2 collector, selected by LAMA_GC=semispace.
+// The heap is one of two spaces of equal size. A collection copies the objects
+// referenced by the roots into the other space, then scans the copies in order
+// and copies the objects they reference: the copied objects themselves are the
+// queue of the breadth-first traversal. Then the spaces swap roles. A copied
+// object has the address of its copy's header in place of its own header.
+// If less free space than the live data is left after a collection, both
+// spaces grow and the live objects are copied once more.
+#define _GNU_SOURCE 1
+
+#include "gc.h"
+
+#include "runtime_common.h"
+#include "word_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+extern ISOLATE_LOCAL memory_chunk     heap;
+extern ISOLATE_LOCAL extra_roots_pool extra_roots;
+extern ISOLATE_LOCAL size_t           __gc_stack_top, __gc_stack_bottom;
+#ifdef LAMA_ENV
+extern const size_t __start_custom_data, __stop_custom_data;
+#endif
+
+// the space the next collection copies to, it is as large as the heap
+static ISOLATE_LOCAL size_t *spare_space = NULL;
+// memory of a space above its "dirty end" has never been used, so it is zeroed by the kernel
+static ISOLATE_LOCAL size_t *heap_dirty_end  = NULL;
+static ISOLATE_LOCAL size_t *spare_dirty_end = NULL;
+
+// the space being evacuated and the end of the copied objects during a collection
+static ISOLATE_LOCAL size_t *from_begin  = NULL;
+static ISOLATE_LOCAL size_t *from_end    = NULL;
+static ISOLATE_LOCAL size_t *copy_cursor = NULL;
+
+// a copied object has the address of its copy's header in place of its own header
+static inline bool is_forwarded (void *header_ptr) { return (*(size_t *)header_ptr & 3) == 0; }
+
+static inline void *header_of (void *obj) { return (char *)obj - DATA_HEADER_SZ; }
+
+// ============================================================================
+//                               Copying
+// ============================================================================
+
+// `slot` holds a reference, it is redirected to the copy of the object
+static void copy_slot (size_t *slot) {
+  size_t *obj = (size_t *)*slot;
+  if (UNBOXED(obj) || obj < from_begin || obj >= from_end) { return; }
+  void *header = header_of(obj);
+  if (!is_forwarded(header)) {
+    size_t words = BYTES_TO_WORDS(obj_size_header_ptr(header));
+    memcpy(copy_cursor, header, WORDS_TO_BYTES(words));
+    *(size_t *)header = (size_t)copy_cursor;
+    copy_cursor += words;
+  }
+  *slot = *(size_t *)header + ((size_t)obj - (size_t)header);
+}
+
+static void copy_range (size_t *begin, size_t *end) {
+  size_t lo = (size_t)from_begin, hi = (size_t)from_end - 1;
+  for (size_t *p = find_candidate_word(begin, end, lo, hi); p < end;
+       p         = find_candidate_word(p + 1, end, lo, hi)) {
+    copy_slot(p);
+  }
+}
+
+static void scan_copied_object (void *header_ptr) {
+  int header = *(int *)header_ptr;
+  if (TAG(header) == ARRAY_TAG) {
+    if (!HAS_NO_POINTERS(header)) {
+      size_t *contents = (size_t *)((char *)header_ptr + DATA_HEADER_SZ);
+      copy_range(contents, contents + LEN(header));
+    }
+    return;
+  }
+  for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr);
+       !field_is_done_iterator(&it);
+       obj_next_ptr_field_iterator(&it)) {
+    copy_slot((size_t *)it.cur_field);
+  }
+}
+
+// copies everything reachable from the roots out of the heap to `to`,
+// returns the end of the copied objects
+static size_t *evacuate_heap (size_t *to) {
+  from_begin  = heap.begin;
+  from_end    = heap.current;
+  copy_cursor = to;
+
+  copy_range((size_t *)(__gc_stack_top + 4), (size_t *)__gc_stack_bottom);
+  for (int i = 0; i < extra_roots.current_free; ++i) {
+    copy_slot((size_t *)extra_roots.roots[i]);
+  }
+#ifdef LAMA_ENV
+  copy_range((size_t *)&__start_custom_data, (size_t *)&__stop_custom_data);
+#endif
+
+  for (size_t *scan = to; scan < copy_cursor; scan += BYTES_TO_WORDS(obj_size_header_ptr(scan))) {
+    scan_copied_object(scan);
+  }
+  return copy_cursor;
+}
+
+// the heap becomes the spare space and `to` (of `words` words) becomes the heap
+static void flip (size_t *to, size_t words, size_t *to_dirty_end, size_t *live_end) {
+  spare_space     = heap.begin;
+  spare_dirty_end = MAX(heap_dirty_end, heap.current);
+  heap.begin      = to;
+  heap.end        = to + words;
+  heap.size       = words;
+  heap.current    = live_end;
+  heap_dirty_end  = MAX(to_dirty_end, live_end);
+}
+
+// ============================================================================
+//                      Allocation and collection
+// ============================================================================
+
+void *ss_alloc_on_existing_heap (size_t words, bool zeroed) {
+  if (heap.current + words > heap.end) { return NULL; }
+  size_t *p = heap.current;
+  heap.current += words;
+  if (zeroed && p < heap_dirty_end) {
+    memset(p, 0, WORDS_TO_BYTES(MIN(words, (size_t)(heap_dirty_end - p))));
+  }
+  return p;
+}
+
+void *ss_collect_and_alloc (size_t words) {
+  flip(spare_space, heap.size, spare_dirty_end, evacuate_heap(spare_space));
+
+  size_t live = heap.current - heap.begin;
+  gc_stats_collection_done(live);
+  size_t wanted = gc_heap_words_after_collection(live, words);
+  if (heap.size < wanted) {
+    size_t old_words = heap.size;
+    size_t grown     = heap_round_words(wanted);
+    munmap(spare_space, WORDS_TO_BYTES(old_words));
+    size_t *to = heap_map(grown);
+    flip(to, grown, to, evacuate_heap(to));
+    munmap(spare_space, WORDS_TO_BYTES(old_words));
+    spare_space     = heap_map(grown);
+    spare_dirty_end = spare_space;
+  }
+
+  void *p = ss_alloc_on_existing_heap(words, true);
+  if (p == NULL) {
+    fprintf(stderr, "ERROR: semispace: no room for %zu words after collection\n", words);
+    exit(1);
+  }
+  return p;
+}
+
+// ============================================================================
+//                            Initialization
+// ============================================================================
+
+void ss_init (void) {
+  heap.size       = heap_round_words(SS_INITIAL_SPACE_WORDS);
+  heap.begin      = heap_map(heap.size);
+  heap.end        = heap.begin + heap.size;
+  heap.current    = heap.begin;
+  heap_dirty_end  = heap.begin;
+  spare_space     = heap_map(heap.size);
+  spare_dirty_end = spare_space;
+}
+
+void ss_shutdown (void) {
+  munmap(heap.begin, WORDS_TO_BYTES(heap.size));
+  munmap(spare_space, WORDS_TO_BYTES(heap.size));
+  spare_space = spare_dirty_end = heap_dirty_end = NULL;
+}
@@ -1,10 +1,13 @@
 #include "gc.h"
 #include "runtime_common.h"
+#include "word_scan.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #ifdef DEBUG_VERSION
 
@@ -12,11 +15,25 @@
 extern int LtagHash (char *s);
 
 extern void *Bsexp (int n, ...);
+extern int   Btag (void *d, int t, int n);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
+extern void *Bliteral (void *);
 extern void *Bclosure (int bn, void *entry, ...);
-
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern void *LmakeArray (int length);
+extern void *Bsta (void *v, int i, void *x);
+extern void *Belem (void *p, int i);
+extern int   Llength (void *p);
+extern int   Lcompare (void *p, void *q);
+extern int   Lhash (void *p);
+extern void *Li__Infix_4343 (void *a, void *b);
+extern int   Lread ();
+extern int   Lwrite (int n);
+extern void *LreadLine ();
+extern void  flush_output (void);
+extern void  reset_input (void);
+
+extern ISOLATE_LOCAL size_t __gc_stack_top, __gc_stack_bottom;
 
 void test_correct_structure_sizes (void) {
   // something like induction base
@@ -32,9 +49,79 @@ void test_correct_structure_sizes (void) {
     assert((sexp_size(k) == get_header_size(SEXP) + MEMBER_SIZE * (k + 1)));
     assert((closure_size(k) == get_header_size(CLOSURE) + MEMBER_SIZE * k));
   }
+  for (int k = 1; k <= SMALL_SEXP_MAX_FIELDS; ++k) {
+    assert((small_sexp_size(k) == get_header_size(SMALL_SEXP) + MEMBER_SIZE * k));
+  }
 }
 
-void no_gc_tests (void) { test_correct_structure_sizes(); }
+void test_word_scan_kernel (void) {
+  enum { N = 37 };
+  size_t words[N];
+  size_t lo = 0x1000, hi = 0x2000;
+  for (int pos = 0; pos <= N; ++pos) {
+    // odd words and words out of range around the only candidate
+    for (int i = 0; i < N; ++i) { words[i] = i % 3 == 0 ? BOX(i) : (i % 3 == 1 ? lo - 4 : hi + 4); }
+    if (pos < N) { words[pos] = pos % 2 ? lo : hi; }
+    for (int from = 0; from <= N; ++from) {
+      size_t *expected = words + (pos >= from ? pos : N);
+      assert((find_candidate_word(words + from, words + N, lo, hi) == expected));
+    }
+  }
+}
+
+// every length from 0 to N covers the empty range, ranges shorter than a vector and all tails
+void test_bulk_kernels (void) {
+  enum { N = 37 };
+  size_t a[N + 1], b[N + 1];
+  for (size_t n = 0; n <= N; ++n) {
+    // the word after the range is never touched
+    a[n] = b[n] = 0xDEAD;
+
+    fill_words(a, BOX(7), n);
+    for (size_t i = 0; i < n; ++i) { assert((a[i] == BOX(7))); }
+    assert((a[n] == 0xDEAD));
+
+    for (size_t i = 0; i < n; ++i) { a[i] = BOX(i); }
+    copy_words_reversed(b, a, n);
+    for (size_t i = 0; i < n; ++i) { assert((b[i] == a[n - 1 - i])); }
+    assert((n == 0 || (b[0] == a[n - 1] && b[n - 1] == a[0])));
+    assert((b[n] == 0xDEAD));
+
+    assert((find_boxed_word(a, n) == n));
+    assert((find_mismatch_word(a, a, n) == n));
+    for (size_t pos = 0; pos < n; ++pos) {
+      // the only boxed word, the last ones are in the scalar tail
+      a[pos] = 0x1000;
+      assert((find_boxed_word(a, n) == pos));
+      a[pos] = BOX(pos);
+
+      for (size_t i = 0; i < n; ++i) { b[i] = a[i]; }
+      b[pos] = BOX(N + 1);
+      assert((find_mismatch_word(a, b, n) == pos));
+    }
+  }
+}
+
+void test_heap_pages (void) {
+  size_t page_words = BYTES_TO_WORDS(HUGE_PAGE_BYTES);
+  assert((heap_round_words(5) == 5));
+  heap_pages = HEAP_PAGES_HUGEPAGE;
+  assert((heap_round_words(5) == page_words));
+  assert((heap_round_words(page_words + 1) == 2 * page_words));
+  size_t *p = heap_map(page_words);
+  assert(((size_t)p % HUGE_PAGE_BYTES == 0));
+  // the whole mapping is usable and zeroed
+  assert((p[0] == 0 && p[page_words - 1] == 0));
+  munmap(p, HUGE_PAGE_BYTES);
+  heap_pages = HEAP_PAGES_SMALL;
+}
+
+void no_gc_tests (void) {
+  test_correct_structure_sizes();
+  test_word_scan_kernel();
+  test_bulk_kernels();
+  test_heap_pages();
+}
 
 // unfortunately there is no generic function pointer that can hold pointer to function with arbitrary signature
 extern size_t call_runtime_function (void *virt_stack_pointer, void *function_pointer,
@@ -167,6 +254,144 @@ void test_alive_are_not_reclaimed (void) {
   cleanup_test(st);
 }
 
+void test_snapshot_barrier (void) {
+  virt_stack *st = init_test();
+  // the other backends have no incremental mode
+  if (gc_algorithm != GC_COMPACTING) {
+    cleanup_test(st);
+    return;
+  }
+  // garbage the cycle has to reclaim
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "target"));
+  size_t arr = call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), vstack_kth_from_start(st, 0));
+  // the array is the only root, the target is reachable through it
+  vstack_pop(st);
+  vstack_push(st, arr);
+
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  start_incremental_marking();
+  __gc_stack_top = 0;
+  assert((gc_marking_in_progress));
+
+  // the mutator moves the only pointer to the target from the array (not scanned yet) to the
+  // stack (already scanned), the barrier has to grey the overwritten value
+  vstack_push(st, ((size_t *)arr)[0]);
+  Bsta((void *)BOX(0), BOX(0), (void *)arr);
+
+  // finishes the marking and compacts
+  force_gc_cycle(st);
+  assert((!gc_marking_in_progress));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 2));
+  assert((strcmp(TO_DATA(vstack_kth_from_start(st, 1))->contents, "target") == 0));
+  assert((((size_t *)vstack_kth_from_start(st, 0))[0] == BOX(0)));
+
+  cleanup_test(st);
+}
+
+// a chain of arrays where every array refers to the previous one twice, so the previous one is
+// pushed to the mark stack twice, and the objects are many more than the prefetch FIFO holds
+void test_shared_structure_is_marked (void) {
+  enum { LEVELS = 4 * MARK_PREFETCH_DISTANCE };
+  virt_stack *st = init_test();
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "base"));
+  char name[16];
+  for (int k = 1; k <= LEVELS; ++k) {
+    snprintf(name, sizeof(name), "level %d", k);
+    vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, name));
+    size_t prev = vstack_kth_from_start(st, 2 * k - 2);
+    vstack_push(st,
+                call_runtime_function(vstack_top(st) - 4,
+                                      Barray,
+                                      4,
+                                      BOX(3),
+                                      prev,
+                                      prev,
+                                      vstack_kth_from_start(st, 2 * k - 1)));
+  }
+  // only the last array is a root
+  size_t top = vstack_kth_from_start(st, 2 * LEVELS);
+  while (vstack_size(st) > 0) { vstack_pop(st); }
+  vstack_push(st, top);
+
+  force_gc_cycle(st);
+
+  const int N = 4 * LEVELS;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 2 * LEVELS + 1));
+  size_t *level = (size_t *)vstack_kth_from_start(st, 0);
+  for (int k = LEVELS; k >= 1; --k) {
+    snprintf(name, sizeof(name), "level %d", k);
+    assert((level[0] == level[1]));
+    assert((strcmp(TO_DATA(level[2])->contents, name) == 0));
+    level = (size_t *)level[0];
+  }
+  assert((strcmp(TO_DATA(level)->contents, "base") == 0));
+
+  cleanup_test(st);
+}
+
+// a chain of arrays allocated by `alloc_uninitialized_array`: some of them are bumped inline,
+// the others find the heap exhausted and collect it on the out-of-line path
+void test_inline_allocation (void) {
+  enum { ARRAYS = 200, FIELDS = 5 };
+  virt_stack *st = init_test();
+  // the mark-region heap is never bumped inline
+  if (gc_algorithm == GC_MARK_REGION) {
+    cleanup_test(st);
+    return;
+  }
+  set_inline_allocation(true);
+
+  size_t words       = BYTES_TO_WORDS(DATA_HEADER_SZ + MEMBER_SIZE * FIELDS);
+  size_t bumped      = 0;
+  size_t collections = 0;
+  for (int i = 0; i < ARRAYS; ++i) {
+    size_t *current = heap.current;
+    bool    fits    = current + words <= gc_bump_limit;
+    __gc_stack_top  = (size_t)vstack_top(st) - 4;
+    data *r         = alloc_uninitialized_array(FIELDS);
+    __gc_stack_top  = 0;
+    if (fits) {
+      assert(((size_t *)r == current && heap.current == current + words));
+      ++bumped;
+    } else {
+      ++collections;
+    }
+    // the header is written whichever path the object has come from
+    assert((TAG(r->data_header) == ARRAY_TAG && LEN(r->data_header) == FIELDS));
+    // the previous arrays are alive and have been moved by the collections
+    ((size_t *)r->contents)[0] = i == 0 ? BOX(0) : vstack_kth_from_start(st, i - 1);
+    for (int f = 1; f < FIELDS; ++f) { ((size_t *)r->contents)[f] = BOX(i); }
+    vstack_push(st, (size_t)r->contents);
+  }
+  assert((bumped > 0 && collections > 0));
+
+  force_gc_cycle(st);
+
+  int    ids[ARRAYS + 1];
+  size_t alive = objects_snapshot(ids, ARRAYS + 1);
+  assert((alive == ARRAYS));
+  size_t *a = (size_t *)vstack_kth_from_start(st, ARRAYS - 1);
+  for (int i = ARRAYS - 1; i >= 0; --i) {
+    assert((LEN(TO_DATA(a)->data_header) == FIELDS));
+    for (int f = 1; f < FIELDS; ++f) { assert((a[f] == BOX(i))); }
+    a = (size_t *)a[0];
+  }
+  assert(((size_t)a == BOX(0)));
+
+  set_inline_allocation(false);
+  cleanup_test(st);
+}
+
 void test_small_tree_compaction (void) {
   virt_stack *st = init_test();
   // this one will increase heap size
@@ -193,7 +418,378 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
-extern size_t cur_id;
+void test_small_sexp_survives_compaction (void) {
+  virt_stack *st = init_test();
+  // garbage to make compaction actually move the s-expressions
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "aaaaaaaaaaaaaaaaaaaaaa");
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "head"));
+  // cons fits into the header, the 5-letter tag hash does not
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Bsexp,
+                                    4,
+                                    BOX(3),
+                                    vstack_kth_from_start(st, 0),
+                                    BOX(0),
+                                    LtagHash("cons")));
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Bsexp,
+                                    3,
+                                    BOX(2),
+                                    vstack_kth_from_start(st, 1),
+                                    LtagHash("Node5")));
+  assert((TAG(TO_DATA(vstack_kth_from_start(st, 1))->data_header) == SMALL_SEXP_TAG));
+  assert((TAG(TO_DATA(vstack_kth_from_start(st, 2))->data_header) == SEXP_TAG));
+  force_gc_cycle(st);
+
+  size_t cons = vstack_kth_from_start(st, 1), node = vstack_kth_from_start(st, 2);
+  assert((Btag((void *)cons, LtagHash("cons"), BOX(2)) == BOX(1)));
+  assert((Btag((void *)cons, LtagHash("cons"), BOX(3)) == BOX(0)));
+  assert((Btag((void *)node, LtagHash("Node5"), BOX(1)) == BOX(1)));
+  assert((SEXP_FIELDS(TO_DATA(cons))[0] == vstack_kth_from_start(st, 0)));
+  assert((SEXP_FIELDS(TO_DATA(node))[0] == cons));
+  assert((strcmp((char *)SEXP_FIELDS(TO_DATA(cons))[0], "head") == 0));
+
+  const int SZ = 10;
+  int       ids[SZ];
+  assert((objects_snapshot(ids, SZ) == 3));
+  cleanup_test(st);
+}
+
+void test_pointer_free_arrays (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(10)));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 3, BOX(2), BOX(1), BOX(2)));
+  assert((HAS_NO_POINTERS(TO_DATA(vstack_kth_from_start(st, 0))->data_header)));
+  assert((HAS_NO_POINTERS(TO_DATA(vstack_kth_from_start(st, 1))->data_header)));
+  assert((LEN(TO_DATA(vstack_kth_from_start(st, 0))->data_header) == 10));
+
+  // storing a number keeps the flag, storing a pointer drops it
+  Bsta((void *)BOX(7), BOX(1), (void *)vstack_kth_from_start(st, 0));
+  assert((HAS_NO_POINTERS(TO_DATA(vstack_kth_from_start(st, 0))->data_header)));
+  Bsta((void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, "elem"),
+       BOX(3),
+       (void *)vstack_kth_from_start(st, 0));
+  assert((!HAS_NO_POINTERS(TO_DATA(vstack_kth_from_start(st, 0))->data_header)));
+
+  force_gc_cycle(st);
+
+  size_t str = ((size_t *)vstack_kth_from_start(st, 0))[3];
+  assert((strcmp(TO_DATA(str)->contents, "elem") == 0));
+  assert((((size_t *)vstack_kth_from_start(st, 0))[1] == BOX(7)));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 3));
+
+  cleanup_test(st);
+}
+
+void test_large_objects_are_not_moved (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(LARGE_OBJECT_MIN_WORDS)));
+  size_t kept = vstack_kth_from_start(st, 0);
+  size_t dropped =
+      call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(LARGE_OBJECT_MIN_WORDS));
+  // this string is reachable only from the large object
+  Bsta((void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, "inside"), BOX(0), (void *)kept);
+
+  force_gc_cycle(st);
+
+  assert((vstack_kth_from_start(st, 0) == kept));
+  assert((is_large_object((void *)kept)));
+  assert((!is_large_object((void *)dropped)));
+  size_t str = ((size_t *)kept)[0];
+  assert((TAG(TO_DATA(str)->data_header) == STRING_TAG));
+  assert((strcmp(TO_DATA(str)->contents, "inside") == 0));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  cleanup_test(st);
+}
+
+void test_gc_stats (void) {
+  virt_stack *st = init_test();
+  gc_statistics before = *gc_stats();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  force_gc_cycle(st);
+
+  const gc_statistics *after = gc_stats();
+  assert((after->collections == before.collections + 1));
+  assert((after->allocated_words > before.allocated_words));
+  // only the first string survives
+  assert((after->live_words == BYTES_TO_WORDS(string_size(strlen("alive")))));
+  assert((after->heap_words == heap.size));
+  assert((after->pauses.count == before.pauses.count + 1));
+
+  cleanup_test(st);
+}
+
+static const alloc_site_stats *find_alloc_site (size_t site) {
+  size_t                  n;
+  const alloc_site_stats *sites = gc_alloc_profile(&n);
+  for (size_t i = 0; i < n; ++i) {
+    if (sites[i].site == site) { return &sites[i]; }
+  }
+  return NULL;
+}
+
+void test_alloc_profile_survivors (void) {
+  virt_stack *st     = init_test();
+  gc_alloc_profiling = true;
+
+  gc_alloc_site = 1001;
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  gc_alloc_site = 1002;
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  force_gc_cycle(st);
+  force_gc_cycle(st);
+
+  const alloc_site_stats *kept = find_alloc_site(1001);
+  assert((kept != NULL && kept->count == 1 && kept->survivals == 2 && kept->live == 1));
+  assert((kept->words == BYTES_TO_WORDS(string_size(strlen("alive")))));
+  const alloc_site_stats *dropped = find_alloc_site(1002);
+  assert((dropped != NULL && dropped->count == 2 && dropped->survivals == 0 && dropped->live == 0));
+
+  gc_alloc_profiling = false;
+  gc_alloc_site      = 0;
+  cleanup_test(st);
+}
+
+void test_heap_census (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc"));
+  // the array refers to the string, both are counted once
+  size_t str = vstack_kth_from_start(st, 0);
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), str));
+  for (int i = 0; i < 2; ++i) {
+    vstack_push(
+        st, call_runtime_function(vstack_top(st) - 4, Bsexp, 3, BOX(2), BOX(1), LtagHash("Cons")));
+  }
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+
+  const heap_census_stats *c = heap_take_census();
+  assert((c->strings.count == 1 && c->strings.bytes == string_size(3)));
+  assert((c->arrays.count == 1 && c->closures.count == 0 && c->sexps.count == 2));
+  assert((c->sexp_tags_count == 1 && c->sexp_tags[0].tag_hash == UNBOX(LtagHash("Cons"))));
+  assert((c->sexp_tags[0].total.count == 2 && c->sexp_tags[0].total.bytes == c->sexps.bytes));
+
+  char path[] = "/tmp/lama-heap-snapshot-XXXXXX";
+  close(mkstemp(path));
+  assert((heap_snapshot(path)));
+  FILE *f = fopen(path, "rb");
+  char  magic[sizeof(HEAP_SNAPSHOT_MAGIC)] = {0};
+  assert((fread(magic, 1, strlen(HEAP_SNAPSHOT_MAGIC), f) == strlen(HEAP_SNAPSHOT_MAGIC)));
+  assert((strcmp(magic, HEAP_SNAPSHOT_MAGIC) == 0));
+  fclose(f);
+  unlink(path);
+
+  __gc_stack_top = 0;
+  cleanup_test(st);
+}
+
+void test_ropes (void) {
+  virt_stack *st         = init_test();
+  char        flat[1201] = {0};
+
+  // a string built by `++` of short pieces becomes a rope
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, ""));
+  for (int i = 0; i < 60; ++i) {
+    size_t piece = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "0123456789");
+    size_t s     = call_runtime_function(
+        vstack_top(st) - 4, Li__Infix_4343, 2, vstack_kth_from_start(st, 0), piece);
+    vstack_pop(st);
+    vstack_push(st, s);
+    strcat(flat, "0123456789");
+  }
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, flat));
+  force_gc_cycle(st);
+
+  void *rope = (void *)vstack_kth_from_start(st, 0), *str = (void *)vstack_kth_from_start(st, 1);
+  assert((TAG(TO_DATA(rope)->data_header) == ROPE_TAG));
+  assert((Llength(rope) == BOX(600)));
+  assert((Lcompare(rope, str) == BOX(0) && Lhash(rope) == Lhash(str)));
+
+  // a rope made of the rope is not changed by a change of the latter
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4, Li__Infix_4343, 2, (size_t)rope, (size_t)str));
+  memcpy(flat + 600, flat, 600);
+  assert((call_runtime_function(vstack_top(st) - 4, Belem, 2, vstack_kth_from_start(st, 0), BOX(123))
+          == BOX('3')));
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, BOX('x'), BOX(0), vstack_kth_from_start(st, 0));
+  force_gc_cycle(st);
+
+  rope        = (void *)vstack_kth_from_start(st, 0);
+  void *outer = (void *)vstack_kth_from_start(st, 2);
+  assert((call_runtime_function(vstack_top(st) - 4, Belem, 2, (size_t)rope, BOX(0)) == BOX('x')));
+  assert((Lcompare(rope, (void *)vstack_kth_from_start(st, 1)) != BOX(0)));
+  assert((Llength(outer) == BOX(1200)));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, flat));
+  assert((Lcompare(outer, (void *)vstack_kth_from_start(st, 3)) == BOX(0)));
+
+  cleanup_test(st);
+}
+
+void test_literals (void) {
+  virt_stack       *st      = init_test();
+  static const char literal[] = "a literal that is longer than a rope";
+
+  // each evaluation of a literal gives a new string that shares the bytes with the others
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bliteral, 1, literal));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bliteral, 1, literal));
+  void *a = (void *)vstack_kth_from_start(st, 0), *b = (void *)vstack_kth_from_start(st, 1);
+  assert((a != b && TAG(TO_DATA(a)->data_header) == ROPE_TAG));
+  assert((((int *)a)[0] == ((int *)b)[0] && !is_valid_heap_pointer((void *)((int *)a)[0])));
+
+  // a change copies the bytes, neither the other string nor the literal changes
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, BOX('A'), BOX(0), (size_t)a);
+  force_gc_cycle(st);
+  a = (void *)vstack_kth_from_start(st, 0);
+  b = (void *)vstack_kth_from_start(st, 1);
+  assert((call_runtime_function(vstack_top(st) - 4, Belem, 2, (size_t)a, BOX(0)) == BOX('A')));
+  assert((call_runtime_function(vstack_top(st) - 4, Belem, 2, (size_t)b, BOX(0)) == BOX('a')));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, literal));
+  assert((Lcompare(b, (void *)vstack_kth_from_start(st, 2)) == BOX(0)));
+  assert((Llength(a) == BOX(strlen(literal))));
+
+  // short literals are copied
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bliteral, 1, "abc"));
+  assert((TAG(TO_DATA(vstack_kth_from_start(st, 3))->data_header) == STRING_TAG));
+
+  cleanup_test(st);
+}
+
+// makes `input` the stdin of the runtime
+static void set_test_input (const char *input) {
+  int    fds[2];
+  size_t len = strlen(input);
+  assert((pipe(fds) == 0));
+  assert((write(fds[1], input, len) == (ssize_t)len));
+  close(fds[1]);
+  dup2(fds[0], STDIN_FILENO);
+  close(fds[0]);
+  reset_input();
+}
+
+// writes the numbers with Lwrite and returns what has reached stdout
+static char *written_by_lwrite (const int *numbers, int n) {
+  static char output[256];
+  FILE       *out   = tmpfile();
+  int         saved = dup(STDOUT_FILENO);
+  fflush(stdout);
+  dup2(fileno(out), STDOUT_FILENO);
+  for (int i = 0; i < n; ++i) { Lwrite(BOX(numbers[i])); }
+  flush_output();
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  rewind(out);
+  output[fread(output, 1, sizeof(output) - 1, out)] = 0;
+  fclose(out);
+  return output;
+}
+
+void test_batch_io (void) {
+  virt_stack *st = init_test();
+  setenv("LAMA_IO", "batch", 1);
+
+  // the limits of unboxed numbers are written and read back
+  const int limits[] = {(1 << 30) - 1, -(1 << 30), 0, -1};
+  char     *written  = written_by_lwrite(limits, 4);
+  assert((strcmp(written, "1073741823\n-1073741824\n0\n-1\n") == 0));
+  set_test_input(written);
+  for (int i = 0; i < 4; ++i) { assert((Lread() == BOX(limits[i]))); }
+
+  // a sign without digits is no number, the rest of the input is not lost; as in the interactive
+  // mode, where scanf leaves the initial value, there is BOX(0) boxed once more then
+  const int no_number = BOX(BOX(0));
+  set_test_input("-\n+ 7\n");
+  assert((Lread() == no_number));
+  assert((Lread() == no_number));
+  assert((Lread() == BOX(7)));
+  // the end of the input
+  assert((Lread() == no_number));
+  assert((call_runtime_function(vstack_top(st) - 4, LreadLine, 0) == BOX(0)));
+
+  // an empty line gives 0 and its line break is left for the next read
+  set_test_input("\n12\n");
+  assert((call_runtime_function(vstack_top(st) - 4, LreadLine, 0) == BOX(0)));
+  assert((Lread() == BOX(12)));
+
+  // lines longer than the initial buffer, the last one without a line break
+  enum { LONG_LINE = 1000 };
+  char *input = malloc(2 * LONG_LINE + 2);
+  memset(input, 'x', 2 * LONG_LINE + 1);
+  input[LONG_LINE]         = '\n';
+  input[2 * LONG_LINE + 1] = 0;
+  set_test_input(input);
+  input[LONG_LINE] = 0;
+  for (int i = 0; i < 2; ++i) {
+    char *line = (char *)call_runtime_function(vstack_top(st) - 4, LreadLine, 0);
+    assert((Llength(line) == BOX(LONG_LINE) && strcmp(line, input) == 0));
+  }
+  assert((call_runtime_function(vstack_top(st) - 4, LreadLine, 0) == BOX(0)));
+  free(input);
+
+  cleanup_test(st);
+}
+
+// the list of numbers n-1, ..., 1, 0, last
+static size_t make_long_list (virt_stack *st, int n, int last) {
+  vstack_push(st, BOX(0));
+  for (int i = -1; i < n; ++i) {
+    size_t list = call_runtime_function(vstack_top(st) - 4,
+                                        Bsexp,
+                                        4,
+                                        BOX(3),
+                                        i < 0 ? BOX(last) : BOX(i),
+                                        vstack_kth_from_start(st, vstack_size(st) - 1),
+                                        LtagHash("cons"));
+    vstack_pop(st);
+    vstack_push(st, list);
+  }
+  return vstack_kth_from_start(st, vstack_size(st) - 1);
+}
+
+void test_iterative_compare_and_hash (void) {
+  virt_stack *st = init_test();
+  const int   N  = 200000;
+
+  // far deeper than the C stack would allow for a recursive walk
+  make_long_list(st, N, 1);
+  make_long_list(st, N, 1);
+  make_long_list(st, N, 2);
+  void *a = (void *)vstack_kth_from_start(st, 0), *b = (void *)vstack_kth_from_start(st, 1),
+       *c = (void *)vstack_kth_from_start(st, 2);
+  assert((Lcompare(a, b) == BOX(0) && Lhash(a) == Lhash(b)));
+  assert((Lcompare(a, c) == BOX(-1) && Lcompare(c, a) == BOX(1)));
+
+  // arrays of numbers are compared by the first differing element
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(37)));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(37)));
+  void *x = (void *)vstack_kth_from_start(st, 3), *y = (void *)vstack_kth_from_start(st, 4);
+  assert((Lcompare(x, y) == BOX(0) && Lhash(x) == Lhash(y)));
+  Bsta((void *)BOX(5), BOX(29), x);
+  Bsta((void *)BOX(7), BOX(29), y);
+  assert((Lcompare(x, y) == BOX(-2)));
+
+  cleanup_test(st);
+}
+
+extern ISOLATE_LOCAL size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
   srand(seed);
@@ -246,6 +842,59 @@ void run_stress_test_random_obj_forest (int seed) {
   cleanup_test(st);
 }
 
+void run_stress_test_parallel_compaction (int seed) {
+  // every heap is large enough to be compacted by several threads
+  set_compaction_threads(4, 0);
+  run_stress_test_random_obj_forest(seed);
+  set_compaction_threads(1, PARALLEL_COMPACTION_MIN_WORDS);
+}
+
+// objects_snapshot can't walk mark-region heap, so objects are checked starting from the stack
+static void check_sexp_forest (virt_stack *st) {
+  for (size_t i = 0; i < vstack_size(st); ++i) {
+    size_t obj = vstack_kth_from_start(st, i);
+    if (UNBOXED(obj)) { continue; }
+    assert((KIND(TO_DATA(obj)->data_header) == SEXP_TAG));
+    assert((SEXP_TAG_HASH(TO_DATA(obj)) == UNBOX(LtagHash("test"))));
+    for (int f = 0; f < 2; ++f) {
+      size_t field = SEXP_FIELDS(TO_DATA(obj))[f];
+      assert((UNBOXED(field) || KIND(TO_DATA(field)->data_header) == SEXP_TAG));
+    }
+  }
+}
+
+void run_stress_test_mark_region (int seed) {
+  setenv("LAMA_GC", "mark-region", 1);
+  virt_stack *st = init_test();
+
+  generate_random_obj_forest(st, 100000, seed);
+  check_sexp_forest(st);
+  // garbage left by the first forest makes blocks fragmented, so next cycles evacuate objects
+  for (int k = 0; k < 3; ++k) {
+    while (vstack_size(st) > 0) { vstack_pop(st); }
+    generate_random_obj_forest(st, 20000, seed + k + 1);
+    check_sexp_forest(st);
+  }
+
+  cleanup_test(st);
+  unsetenv("LAMA_GC");
+}
+
+void run_stress_test_semispace (int seed) {
+  setenv("LAMA_GC", "semispace", 1);
+  virt_stack *st = init_test();
+
+  size_t expected_alive = generate_random_obj_forest(st, 100000, seed);
+  check_sexp_forest(st);
+  // the copying collector does not keep the allocation order, only the number of objects
+  const int SZ = 100000;
+  int       ids[SZ];
+  assert((objects_snapshot(ids, SZ) == expected_alive));
+
+  cleanup_test(st);
+  unsetenv("LAMA_GC");
+}
+
 #endif
 
 #include <time.h>
@@ -261,13 +910,29 @@ int main (int argc, char **argv) {
   test_single_object_allocation_with_collection_virtual_stack();
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
+  test_snapshot_barrier();
+  test_shared_structure_is_marked();
+  test_inline_allocation();
   test_small_tree_compaction();
+  test_small_sexp_survives_compaction();
+  test_pointer_free_arrays();
+  test_large_objects_are_not_moved();
+  test_gc_stats();
+  test_alloc_profile_survivors();
+  test_heap_census();
+  test_ropes();
+  test_literals();
+  test_batch_io();
+  test_iterative_compare_and_hash();
 
   time_t start, end;
   double diff;
   time(&start);
   // stress test
   for (int s = 0; s < 100; ++s) { run_stress_test_random_obj_forest(s); }
+  for (int s = 0; s < 10; ++s) { run_stress_test_parallel_compaction(s); }
+  for (int s = 0; s < 10; ++s) { run_stress_test_mark_region(s); }
+  for (int s = 0; s < 10; ++s) { run_stress_test_semispace(s); }
   time(&end);
   diff = difftime(end, start);
   printf("Stress tests took %.2lf seconds to complete\n", diff);
@@ -0,0 +1,152 @@
+// ============================================================================
+//                       Word scanning and bulk kernels
+// ============================================================================
+// Stacks, the static area and large arrays are mostly filled with unboxed
+// numbers and addresses that do not point to the heap. `find_candidate_word`
+// skips over them several words at a time and stops only at words that may be
+// pointers into the given range: even words lying in [lo, hi]. The caller
+// checks the candidates precisely. `find_mismatch_word` skips the common
+// prefix of two ranges of words, structural comparison uses it on fields.
+// The bulk kernels fill, copy in reverse order and look for the first
+// pointer-like word, they build arrays from constants and operand stacks.
+// The SSE2 (4 words per step) and AVX2 (8 words per step) versions are compiled
+// in when the instruction set is enabled, e.g. by SIMD_FLAGS=-mavx2, otherwise
+// the scalar loop is used. Both assume 4-byte words of the 32-bit runtime.
+
+#ifndef __LAMA_WORD_SCAN__
+#define __LAMA_WORD_SCAN__
+
+#include <stddef.h>
+
+#if __SIZEOF_SIZE_T__ == 4 && (defined(__AVX2__) || defined(__SSE2__))
+#  include <immintrin.h>
+#  define WORD_SCAN_SIMD
+#endif
+
+static inline int is_candidate_word (size_t w, size_t lo, size_t hi) {
+  return (w & 1) == 0 && w - lo <= hi - lo;
+}
+
+// returns the first word of [from, to) that may point into [lo, hi], or `to` if there is none
+static inline size_t *find_candidate_word (size_t *from, size_t *to, size_t lo, size_t hi) {
+  if (hi < lo) { return to; }
+#ifdef WORD_SCAN_SIMD
+  // w is in [lo, hi] iff w - lo <= hi - lo as unsigned numbers, the unsigned comparison is done
+  // as the signed one with flipped sign bits
+#  ifdef __AVX2__
+  const __m256i bias8 = _mm256_set1_epi32((int)0x80000000);
+  const __m256i lo8   = _mm256_set1_epi32((int)lo);
+  const __m256i span8 = _mm256_set1_epi32((int)((hi - lo) ^ 0x80000000));
+  const __m256i one8  = _mm256_set1_epi32(1);
+  for (; from + 8 <= to; from += 8) {
+    __m256i w       = _mm256_loadu_si256((const __m256i *)from);
+    __m256i shifted = _mm256_xor_si256(_mm256_sub_epi32(w, lo8), bias8);
+    __m256i rejected =
+        _mm256_or_si256(_mm256_cmpgt_epi32(shifted, span8),
+                        _mm256_cmpeq_epi32(_mm256_and_si256(w, one8), one8));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(rejected);
+    if (mask != 0xFFFFFFFFu) { return from + __builtin_ctz(~mask) / 4; }
+  }
+#  endif
+  const __m128i bias = _mm_set1_epi32((int)0x80000000);
+  const __m128i lo4  = _mm_set1_epi32((int)lo);
+  const __m128i span = _mm_set1_epi32((int)((hi - lo) ^ 0x80000000));
+  const __m128i one  = _mm_set1_epi32(1);
+  for (; from + 4 <= to; from += 4) {
+    __m128i w        = _mm_loadu_si128((const __m128i *)from);
+    __m128i shifted  = _mm_xor_si128(_mm_sub_epi32(w, lo4), bias);
+    __m128i rejected = _mm_or_si128(_mm_cmpgt_epi32(shifted, span),
+                                    _mm_cmpeq_epi32(_mm_and_si128(w, one), one));
+    unsigned mask    = (unsigned)_mm_movemask_epi8(rejected);
+    if (mask != 0xFFFFu) { return from + __builtin_ctz(~mask) / 4; }
+  }
+#endif
+  for (; from < to; ++from) {
+    if (is_candidate_word(*from, lo, hi)) { return from; }
+  }
+  return to;
+}
+
+// returns the index of the first word where `a` and `b` differ, or `n` if they are equal
+static inline size_t find_mismatch_word (const size_t *a, const size_t *b, size_t n) {
+  size_t i = 0;
+#ifdef WORD_SCAN_SIMD
+#  ifdef __AVX2__
+  for (; i + 8 <= n; i += 8) {
+    __m256i  eq   = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                    _mm256_loadu_si256((const __m256i *)(b + i)));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(eq);
+    if (mask != 0xFFFFFFFFu) { return i + __builtin_ctz(~mask) / 4; }
+  }
+#  endif
+  for (; i + 4 <= n; i += 4) {
+    __m128i  eq   = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+                                 _mm_loadu_si128((const __m128i *)(b + i)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+    if (mask != 0xFFFFu) { return i + __builtin_ctz(~mask) / 4; }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (a[i] != b[i]) { return i; }
+  }
+  return n;
+}
+
+static inline void fill_words (size_t *dst, size_t value, size_t n) {
+  size_t i = 0;
+#ifdef WORD_SCAN_SIMD
+#  ifdef __AVX2__
+  const __m256i v8 = _mm256_set1_epi32((int)value);
+  for (; i + 8 <= n; i += 8) { _mm256_storeu_si256((__m256i *)(dst + i), v8); }
+#  endif
+  const __m128i v4 = _mm_set1_epi32((int)value);
+  for (; i + 4 <= n; i += 4) { _mm_storeu_si128((__m128i *)(dst + i), v4); }
+#endif
+  for (; i < n; ++i) { dst[i] = value; }
+}
+
+// dst[i] = src[n - 1 - i], the ranges do not overlap
+static inline void copy_words_reversed (size_t *dst, const size_t *src, size_t n) {
+  size_t i = 0;
+#ifdef WORD_SCAN_SIMD
+#  ifdef __AVX2__
+  const __m256i reverse8 = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  for (; i + 8 <= n; i += 8) {
+    __m256i w = _mm256_loadu_si256((const __m256i *)(src + n - i - 8));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(w, reverse8));
+  }
+#  endif
+  for (; i + 4 <= n; i += 4) {
+    __m128i w = _mm_loadu_si128((const __m128i *)(src + n - i - 4));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi32(w, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+#endif
+  for (; i < n; ++i) { dst[i] = src[n - 1 - i]; }
+}
+
+// returns the index of the first even word, i.e. a boxed value, or `n` if all values are unboxed
+static inline size_t find_boxed_word (const size_t *p, size_t n) {
+  size_t i = 0;
+#ifdef WORD_SCAN_SIMD
+#  ifdef __AVX2__
+  const __m256i one8 = _mm256_set1_epi32(1);
+  for (; i + 8 <= n; i += 8) {
+    __m256i  w    = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(w, one8), one8));
+    if (mask != 0xFFFFFFFFu) { return i + __builtin_ctz(~mask) / 4; }
+  }
+#  endif
+  const __m128i one = _mm_set1_epi32(1);
+  for (; i + 4 <= n; i += 4) {
+    __m128i  w    = _mm_loadu_si128((const __m128i *)(p + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(w, one), one));
+    if (mask != 0xFFFFu) { return i + __builtin_ctz(~mask) / 4; }
+  }
+#endif
+  for (; i < n; ++i) {
+    if ((p[i] & 1) == 0) { return i; }
+  }
+  return n;
+}
+
+#endif